@@ -11,11 +11,14 @@ function(set_source_files_base)
         src/blip/Message.cc
         src/blip/MessageBuilder.cc
         src/blip/MessageOut.cc
+        src/blip/MessageQueue.cc
+        src/blip/PropertyCodec.cc
         src/util/Actor.cc
         src/util/ActorProperty.cc
         src/util/Async.cc
         src/util/Channel.cc
         src/util/Codec.cc
+        src/util/MappedFile.cc
         src/util/Timer.cc
         src/websocket/WebSocketImpl.cc
         src/websocket/WebSocketInterface.cc
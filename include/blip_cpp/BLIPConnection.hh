@@ -20,12 +20,20 @@
 #include "WebSocketInterface.hh"
 #include "Message.hh"
 #include "Logging.hh"
+#include "Async.hh"
 #include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
 
 namespace litecore { namespace blip {
     class BLIPIO;
     class ConnectionDelegate;
+    class EncodedMessage;
     class MessageOut;
+    class RequestHandle;
 
 
     /** A BLIP connection. Use this object to open and close connections and send requests.
@@ -47,10 +55,71 @@ namespace litecore { namespace blip {
         /** WebSocket 'protocol' name for BLIP; use as value of kProtocolsOption option. */
         static constexpr const char *kWSProtocolName = "BLIP_3";
 
+        /** WebSocket 'protocol' name for BLIP with tokenized (compressed) message properties.
+            A client that supports it should offer it ahead of kWSProtocolName, i.e. set the
+            kProtocolsOption to "BLIP_3+tokens,BLIP_3"; properties are tokenized if the server's
+            response selects it. On the server side, put the protocol that was selected in the
+            Connection's options under kProtocolsOption. */
+        static constexpr const char *kWSTokenizedProtocolName = "BLIP_3+tokens";
+
+        /** Option to turn off the dynamic table of tokenized properties, leaving only the
+            static table of common strings. Value is a boolean; the default is true. */
+        static constexpr const char *kDynamicPropertyTableOption = "BLIPDynamicPropertyTable";
+
         /** Option to set the 'deflate' compression level. Value must be an integer in the range
             0 (no compression) to 9 (best compression). */
         static constexpr const char *kCompressionLevelOption = "BLIPCompressionLevel";
 
+        /** Options to set the lower and upper bounds of outgoing frame sizes, in bytes.
+            Frame sizes adapt to the measured throughput of the WebSocket within these bounds;
+            the defaults are 2048 and 65536. */
+        static constexpr const char *kMinFrameSizeOption = "BLIPMinFrameSize";
+        static constexpr const char *kMaxFrameSizeOption = "BLIPMaxFrameSize";
+
+        /** Options to set the lower and upper bounds of the flow-control window: the number of
+            bytes of a message that may be sent before the peer acknowledges them. The window
+            adapts to the measured round-trip time and throughput within these bounds; the
+            defaults are 128000 and 16MB. */
+        static constexpr const char *kMinFlowWindowOption = "BLIPMinFlowWindow";
+        static constexpr const char *kMaxFlowWindowOption = "BLIPMaxFlowWindow";
+
+        /** Option to set the default time, in milliseconds, to wait for the response to a
+            request after the request has been sent. If the response hasn't completely arrived
+            by then, the request's progress callback is called with the state kTimedOut, and
+            the response (or the rest of it) is ignored if it arrives later. The default is 0,
+            meaning forever. (A MessageBuilder's `responseTimeout` overrides this.) */
+        static constexpr const char *kResponseTimeoutOption = "BLIPResponseTimeout";
+
+        /** Option to cap the memory used by each incoming message body: once a body grows past
+            this many bytes, the rest of it is written to a temporary file, and the complete body
+            is available as a memory-mapped view of the file (see MessageIn::mappedBody.)
+            The default is 0, meaning never. Doesn't apply to bodies streamed to a body sink. */
+        static constexpr const char *kSpillThresholdOption = "BLIPSpillThreshold";
+
+        /** Option to set the directory the temporary files go in; by default it's the system's
+            temporary directory. */
+        static constexpr const char *kSpillDirectoryOption = "BLIPSpillDirectory";
+
+        /** Number of traffic classes that outgoing messages can be scheduled in. */
+        static constexpr unsigned kNumTrafficClasses = 8;
+
+        /** Determines how outgoing bandwidth is shared between messages. Each outgoing message
+            belongs to a traffic class: the one set in its MessageBuilder's `trafficClass`,
+            else the one its "Profile" property maps to, else class 0. When several classes
+            have messages waiting, the bytes sent are divided between them in proportion to
+            their weights.
+            Within a class, messages normally take turns sending a frame each. In
+            `shortestRemainingFirst` mode the message with the fewest bytes left to send goes
+            first instead, which lowers the average time to complete a message; at most
+            `maxActiveMessages` partly-sent messages are interleaved at once. Either way, urgent
+            messages still get at least half of their class's frames. */
+        struct SchedulingPolicy {
+            unsigned weights[kNumTrafficClasses] = {1, 1, 1, 1, 1, 1, 1, 1};
+            std::map<std::string, uint8_t> profileClasses;
+            bool shortestRemainingFirst {false};
+            unsigned maxActiveMessages {4};
+        };
+
         /** Creates a BLIP connection on a WebSocket. */
         Connection(websocket::WebSocket*,
                    const fleece::AllocedDict &options,
@@ -64,14 +133,95 @@ namespace litecore { namespace blip {
 
         void start();
 
-        /** Sends a built message as a new request. */
-        void sendRequest(MessageBuilder&);
+        /** Sends a built message as a new request. The returned handle can be used to
+            cancel it. The request isn't numbered until its first frame is sent, since the
+            scheduler may begin queued requests in a different order than they were sent;
+            until then its `number()` is 0. */
+        RequestHandle sendRequest(MessageBuilder&);
+
+        /** Sends a pre-encoded message as a new request. The message can be sent again, by this
+            or other Connections; `onProgress` is called with this send's progress. */
+        RequestHandle sendRequest(EncodedMessage*,
+                                  MessageProgressCallback onProgress =nullptr);
 
         typedef std::function<void(MessageIn*)> RequestHandler;
 
-        /** Registers a callback that will be called when a message with a given profile arrives. */
+        /** Registers a callback that will be called when a message with a given profile arrives.
+            The profile may end with "*" to match every profile with that prefix; "*" alone
+            matches every message. An exact profile takes precedence over a prefix, and a
+            longer prefix over a shorter one. A null handler removes the registration. */
         void setRequestHandler(std::string profile, bool atBeginning, RequestHandler);
 
+        /** A request handler that finishes asynchronously. It (or something it starts) must
+            respond to the request; the result should become ready once it has, and be false
+            if the request wasn't handled after all, in which case the Connection responds
+            with a "no handler" error. */
+        typedef std::function<actor::Async<bool>(MessageIn*)> AsyncRequestHandler;
+
+        /** Registers an asynchronous handler for complete messages with a given profile (which
+            may be a prefix or wildcard, as in setRequestHandler.) */
+        void setAsyncRequestHandler(std::string profile, AsyncRequestHandler);
+
+        /** Determines where incoming requests are handled. By default, request handlers (and
+            the delegate's request methods) are called on the Connection's I/O thread, so a
+            slow handler holds up all other traffic on the connection. If `workers` is nonzero,
+            they're called on a pool of that many actors instead. A profile's requests are
+            handled at most `profileLimits[profile]` at a time, or `maxConcurrent` for
+            profiles not listed (0 means no limit); the rest wait their turn. A request is
+            being handled until its handler returns, or its async handler's result is ready. */
+        struct DispatchPolicy {
+            unsigned workers {0};
+            unsigned maxConcurrent {0};
+            std::map<std::string, unsigned> profileLimits;
+        };
+
+        /** Changes where incoming requests are handled. */
+        void setDispatchPolicy(const DispatchPolicy&);
+
+        /** Changes how outgoing messages are scheduled. Affects messages already queued. */
+        void setSchedulingPolicy(const SchedulingPolicy&);
+
+        /** The total number of bytes sent so far by messages in a traffic class
+            (frame headers and checksums included, ACKs excluded.) Returns 0 for a class
+            that's out of range. */
+        uint64_t bytesSent(unsigned trafficClass) const {
+            return trafficClass < kNumTrafficClasses ? _bytesSentByClass[trafficClass].load() : 0;
+        }
+
+        /** The current size of outgoing frames. This adapts to the throughput of the
+            WebSocket, so that a frame takes a few milliseconds to transmit. */
+        size_t bigFrameSize() const                             {return _bigFrameSize;}
+
+        /** The current size of frames of normal messages sent while urgent messages are
+            waiting; smaller than bigFrameSize(), so the urgent messages get through sooner. */
+        size_t smallFrameSize() const                           {return _smallFrameSize;}
+
+        /** The current flow-control window: the number of bytes an outgoing message may have
+            in flight before it has to wait for the peer to acknowledge them. */
+        size_t flowWindow() const                               {return _flowWindow;}
+
+        /** Limits on the amount of outgoing data waiting to be sent (in the outbox, or waiting
+            for the peer to ACK earlier data.) When the bytes or the count of waiting messages
+            reach a high watermark, the outbox is full; once both drop to their low watermarks,
+            the delegate's onOutboxWritable method is called. */
+        struct OutboxWatermarks {
+            size_t highBytes    = SIZE_MAX,  lowBytes    = SIZE_MAX;
+            size_t highMessages = SIZE_MAX,  lowMessages = SIZE_MAX;
+        };
+
+        void setOutboxWatermarks(const OutboxWatermarks&);
+
+        /** The number of bytes of outgoing message data waiting to be sent. (Data that hasn't
+            yet been read from messages' data sources isn't counted.) */
+        size_t queuedBytes() const                              {return _queuedBytes;}
+
+        /** The number of outgoing messages that haven't been completely sent. */
+        size_t queuedMessages() const                           {return _queuedMessages;}
+
+        /** True if the outgoing data has reached a high watermark; a producer should stop
+            sending until the delegate's onOutboxWritable method is called. */
+        bool outboxFull() const                                 {return _outboxFull;}
+
         /** Closes the connection. */
         void close(websocket::CloseCode =websocket::kCodeNormal,
                    fleece::slice message =fleece::nullslice);
@@ -87,9 +237,15 @@ namespace litecore { namespace blip {
         virtual ~Connection();
 
         friend class MessageIn;
+        friend class MessageOut;
         friend class BLIPIO;
+        friend class RequestHandle;
 
         void send(MessageOut*);
+        void cancel(MessageOut*);
+        void acksResumed(MessageIn*);
+        void dequeued(size_t bytes, size_t messages);
+        void notifyIfOutboxWritable();
         void gotHTTPResponse(int status, const fleece::AllocedDict &headers);
         void connected();
         void closed(CloseStatus);
@@ -102,6 +258,96 @@ namespace litecore { namespace blip {
         int8_t _compressionLevel;
         std::atomic<State> _state {kClosed};
         CloseStatus _closeStatus;
+        std::atomic<uint64_t> _bytesSentByClass[kNumTrafficClasses] {};
+        std::atomic<size_t> _bigFrameSize {0}, _smallFrameSize {0};
+        std::atomic<size_t> _flowWindow {0};
+        uint32_t _ackInterval, _announcedAckInterval;   // Incoming ACK intervals [BLIPIO thread]
+        size_t _spillThreshold {0};                 // Body size at which to use a temp file
+        std::string _spillDirectory;                // Where to put the temp files
+        bool _dynamicPropertyTable {true};          // Use dynamic table if tokenizing props?
+        std::atomic<size_t> _queuedBytes {0}, _queuedMessages {0};
+        std::atomic<size_t> _highBytes {SIZE_MAX}, _lowBytes {SIZE_MAX};
+        std::atomic<size_t> _highMessages {SIZE_MAX}, _lowMessages {SIZE_MAX};
+        std::atomic<bool> _outboxFull {false};
+    };
+
+
+    /** A reference to an outgoing request, returned by Connection::sendRequest, that can cancel
+        it. (The handle keeps the request's message in memory; release it when it's no longer
+        needed.) */
+    class RequestHandle {
+    public:
+        RequestHandle()                                         { }
+
+        explicit operator bool() const                          {return _request != nullptr;}
+
+        /** Withdraws the request. If it's still waiting to be sent, it's removed from the
+            outbox; if it's partly sent, the peer is told to discard what it's received; if it's
+            been sent, its response will be ignored. Either way its data is freed, and its
+            progress callback won't be called again. (A peer that didn't negotiate
+            kWSTokenizedProtocolName can't be told to discard a partly-sent request, so the rest
+            of it is sent anyway, and then its response is ignored.) Does nothing if the
+            response has already arrived, or if the request has already been canceled. */
+        void cancel();
+
+    private:
+        friend class Connection;
+
+        RequestHandle(Connection *connection, Message *request)
+        :_connection(connection), _request(request)
+        { }
+
+        Retained<Connection> _connection;
+        Retained<Message> _request;
+    };
+
+
+    /** Sends one EncodedMessage as a request to many Connections, and tracks the copies as a
+        group. Each Connection gets its own MessageOut, but they all share the encoded payload:
+        an uncompressed body is sent by reference to it, and a plain-text form of the
+        properties is computed only once. Only the frame headers and checksums, and tokenized
+        properties, are generated per connection.
+        This is a convenience over calling Connection::sendRequest for each Connection, which
+        is what it does: each copy is still queued separately, and frames aren't shared
+        between connections, since every frame carries its connection's message number and
+        checksum, and is sized for its connection's throughput. */
+    class Broadcast : public RefCounted {
+    public:
+        /** Called once every copy has been delivered or has failed, with the number of each.
+            A copy is delivered when it's been sent (if it's noreply) or replied to; it fails
+            if it's disconnected, expired, timed out, or canceled. Called on an arbitrary
+            thread, and shouldn't block. */
+        using CompletionCallback = std::function<void(size_t delivered, size_t failed)>;
+
+        /** Sends the message to each Connection, returning the Broadcast that tracks it. */
+        static Retained<Broadcast> send(const std::vector<Retained<Connection>>&,
+                                        EncodedMessage*,
+                                        CompletionCallback onComplete =nullptr);
+
+        size_t count() const                                    {return _count;}
+        size_t delivered() const                                {return _delivered;}
+        size_t failed() const                                   {return _failed;}
+        bool done() const                                       {return _remaining == 0;}
+
+        /** Cancels every copy that hasn't yet been delivered (see RequestHandle::cancel); they
+            count as failed. */
+        void cancel();
+
+    private:
+        class Copy;
+
+        Broadcast(size_t count, CompletionCallback onComplete)
+        :_count(count), _remaining(count), _onComplete(std::move(onComplete))
+        { }
+
+        void finished(bool delivered);
+
+        size_t const _count;                        // Number of Connections sent to
+        std::atomic<size_t> _delivered {0}, _failed {0};
+        std::atomic<size_t> _remaining;             // Copies not yet delivered or failed
+        CompletionCallback _onComplete;
+        std::mutex _mutex;
+        std::vector<RequestHandle> _handles;        // Handles of the copies, until all are done
     };
 
 
@@ -129,6 +375,10 @@ namespace litecore { namespace blip {
 
         /** Called when an incoming request is completely received. */
         virtual void onRequestReceived(MessageIn* request)      {request->notHandled();}
+
+        /** Called when the outgoing data, having reached a high watermark, has dropped to the
+            low watermarks. (See Connection::setOutboxWatermarks.) */
+        virtual void onOutboxWritable()                         { }
     };
 
 } }
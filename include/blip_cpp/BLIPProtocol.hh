@@ -24,11 +24,13 @@ namespace litecore { namespace blip {
     // https://github.com/couchbaselabs/BLIP-Cpp/blob/master/docs/BLIP%20Protocol.md
 
     enum MessageType: uint8_t {
-        kRequestType     = 0,  // A message initiated by a peer
-        kResponseType    = 1,  // A response to a Request
-        kErrorType       = 2,  // A response indicating failure
-        kAckRequestType  = 4,  // Acknowledgement of data received from a Request (internal)
-        kAckResponseType = 5,  // Acknowledgement of data received from a Response (internal)
+        kRequestType       = 0,  // A message initiated by a peer
+        kResponseType      = 1,  // A response to a Request
+        kErrorType         = 2,  // A response indicating failure
+        kAckRequestType    = 4,  // Acknowledgement of data received from a Request (internal)
+        kAckResponseType   = 5,  // Acknowledgement of data received from a Response (internal)
+        kCancelRequestType = 6,  // The rest of a partly-sent Request won't be sent (internal)
+        kCancelResponseType= 7,  // A partly-sent Response is abandoned; another follows (internal)
     };
 
     // Array mapping MessageType to a short mnemonic like "REQ".
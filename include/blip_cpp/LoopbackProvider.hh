@@ -75,6 +75,27 @@ namespace litecore { namespace websocket {
             return newValue <= kSendBufferSize;
         }
 
+        /** Segments with owners are retained, not copied, until the driver sends them, as a
+            real transport would hand them to a scatter/gather write. (Only then are they
+            gathered, since the peer receives each message in one piece.) */
+        virtual bool sendBatch(const std::vector<MessageSegment> &segments, bool binary) override {
+            std::vector<MessageSegment> owned;
+            owned.reserve(segments.size());
+            size_t size = 0;
+            for (auto &seg : segments) {
+                if (seg.owned()) {
+                    owned.push_back(seg);
+                } else {
+                    fleece::alloc_slice copy(seg.data);
+                    owned.emplace_back(copy, copy, seg.endOfMessage);
+                }
+                size += seg.data.size;
+            }
+            auto newValue = (_driver->_bufferedBytes += size);
+            _driver->enqueue(&Driver::_sendBatch, owned, binary);
+            return newValue <= kSendBufferSize;
+        }
+
         virtual void close(int status =1000, fleece::slice message =fleece::nullslice) override {
             _driver->enqueue(&Driver::_close, status, fleece::alloc_slice(message));
         }
@@ -230,6 +251,16 @@ namespace litecore { namespace websocket {
                 }
             }
 
+            void _sendBatch(std::vector<MessageSegment> segments, bool binary) {
+                size_t first = 0;
+                for (size_t i = 0; i < segments.size(); ++i) {
+                    if (segments[i].endOfMessage) {
+                        _send(gatherSegments(&segments[first], i + 1 - first), binary);
+                        first = i + 1;
+                    }
+                }
+            }
+
             virtual void _received(Retained<Message> message) {
                 if (!connected())
                     return;
@@ -20,15 +20,22 @@
 #include "BLIPProtocol.hh"
 #include "RefCounted.hh"
 #include "fleece/Fleece.hh"
+#include <chrono>
 #include <functional>
 #include <ostream>
 #include <memory>
 #include <mutex>
+#include <vector>
 
 namespace fleece {
     class Value;
 }
 
+namespace litecore {
+    class MappedFile;
+    class TemporaryFile;
+}
+
 namespace litecore { namespace blip {
     using fleece::RefCounted;
     using fleece::Retained;
@@ -38,24 +45,7 @@ namespace litecore { namespace blip {
     class MessageIn;
     class InflaterWriter;
     class Codec;
-
-
-    /** Progress notification for an outgoing request. */
-    struct MessageProgress {
-        enum State {
-            kQueued,                // Outgoing request has been queued for delivery
-            kSending,               // First bytes of message have been sent
-            kAwaitingReply,         // Message sent; waiting for a reply (unless noreply)
-            kReceivingReply,        // Reply is being received
-            kComplete,              // Delivery (and receipt, if not noreply) complete.
-            kDisconnected           // Socket disconnected before delivery or receipt completed
-        } state;
-        MessageSize bytesSent;
-        MessageSize bytesReceived;
-        Retained<MessageIn> reply;
-    };
-
-    using MessageProgressCallback = std::function<void(const MessageProgress&)>;
+    class PropertyDecoder;
 
 
     struct Error {
@@ -83,6 +73,60 @@ namespace litecore { namespace blip {
     };
 
 
+    /** Progress notification for an outgoing request. */
+    struct MessageProgress {
+        enum State {
+            kQueued,                // Outgoing request has been queued for delivery
+            kSending,               // First bytes of message have been sent
+            kAwaitingReply,         // Message sent; waiting for a reply (unless noreply)
+            kReceivingReply,        // Reply is being received
+            kComplete,              // Delivery (and receipt, if not noreply) complete.
+            kDisconnected,          // Socket disconnected before delivery or receipt completed
+            kExpired,               // Deadline passed before message could be sent; not sent
+            kTimedOut,              // Reply didn't arrive within the response timeout
+            kFailed                 // Body's data source failed, or reply's body couldn't be
+                                    // stored; message abandoned (see error)
+        } state;
+        MessageSize bytesSent;
+        MessageSize bytesReceived;
+        Retained<MessageIn> reply;
+        Error error;                // What went wrong, if state is kFailed
+    };
+
+    using MessageProgressCallback = std::function<void(const MessageProgress&)>;
+
+
+    /** A time after which a message is no longer worth sending or handling. It's measured by
+        the wall clock, since it can be sent to the peer (see MessageBuilder::setDeadline.)
+        The default value, the epoch, means no deadline. */
+    using Deadline = std::chrono::system_clock::time_point;
+
+
+    /** Index of a message's encoded properties (a series of NUL-terminated names and values),
+        giving the offsets of every name and value, and a hash of every name. A lookup doesn't
+        have to scan the properties for NULs, and only compares the bytes of a name whose hash
+        matches. (It's still a linear search of the entries, since messages have few
+        properties.) */
+    class PropertyIndex {
+    public:
+        /** Indexes `properties`. Returns false if they're malformed (a name with no value.) */
+        bool build(fleece::slice properties);
+
+        /** Looks up a property's value in `properties`, which must be what was indexed. */
+        fleece::slice find(fleece::slice properties, fleece::slice name) const;
+
+        bool empty() const                      {return _entries.empty();}
+        void clear()                            {_entries.clear();}
+
+    private:
+        struct Entry {
+            uint32_t name, value, end;          // Offsets of name, value, and value's NUL
+            uint32_t hash;                      // Hash of the name
+        };
+        std::vector<Entry> _entries;
+    };
+
+
     /** Abstract base class of messages */
     class Message : public RefCounted {
     public:
@@ -94,6 +138,8 @@ namespace litecore { namespace blip {
         bool urgent() const                 {return hasFlag(kUrgent);}
         bool noReply() const                {return hasFlag(kNoReply);}
 
+        /** The message's number. An outgoing request is numbered when its first frame is
+            sent, so this is 0 until then. */
         MessageNo number() const            {return _number;}
 
     protected:
@@ -113,6 +159,8 @@ namespace litecore { namespace blip {
         bool hasFlag(FrameFlags f) const    {return (_flags & f) != 0;}
         bool isAck() const                  {return type() == kAckRequestType ||
                                                     type() == kAckResponseType;}
+        /** ACKs and cancels are internal control frames, not real messages. */
+        bool isControl() const              {return type() >= kAckRequestType;}
         virtual bool isIncoming() const     {return false;}
         MessageType type() const            {return (MessageType)(_flags & kTypeMask);}
         const char* typeName() const        {return kMessageTypeNames[type()];}
@@ -137,11 +185,26 @@ namespace litecore { namespace blip {
     /** An incoming message. */
     class MessageIn : public Message {
     public:
-        /** Gets a property value */
+        /** Gets a property value. (An integer or boolean value is returned as text, formatted
+            when the message arrived; intProperty and boolProperty read it without formatting.) */
         slice property(slice property) const;
+
+        /** Gets a property value as an integer, either sent as one or as decimal text; returns
+            `defaultValue` if it's missing or isn't a number. */
         long intProperty(slice property, long defaultValue =0) const;
+
+        /** Gets a property value as a boolean: one sent as a boolean, "true"/"false", "YES"/"NO"
+            (in any case), or a nonzero/zero integer. */
         bool boolProperty(slice property, bool defaultValue =false) const;
 
+        /** Gets a property whose value is one of a fixed set of strings, returning the index
+            of the value in `values`, or `defaultValue` if it's missing or not in the list. */
+        int enumProperty(slice property, std::initializer_list<slice> values,
+                         int defaultValue =-1) const;
+
+        /** The "Profile" property. (Unlike property(), this doesn't have to search.) */
+        slice profile() const                   {return _profile;}
+
         /** Returns information about an error (if this message is an error.) */
         Error getError() const;
 
@@ -150,16 +213,48 @@ namespace litecore { namespace blip {
         /** Returns true if the message has been completely received including the body. */
         bool isComplete() const;
 
-        /** The body of the message. */
+        /** The deadline the sender set for the message, if it sent it as a property. */
+        Deadline deadline() const;
+
+        /** Returns true if the message has a deadline and it's passed. */
+        bool isExpired() const;
+
+        /** The body of the message. (Null if it was spilled to a file; see mappedBody.) */
         alloc_slice body() const;
 
         /** Returns the body, removing it from the message. The next call to extractBody() or
-            body() will return only the data that's been read since this call. */
+            body() will return only the data that's been read since this call.
+            Returns null once the body has begun to spill to a file. */
         alloc_slice extractBody();
 
+        /** If the body grew too large to keep in memory (see
+            Connection::kSpillThresholdOption), this returns a read-only memory-mapped view of
+            the temporary file it was written to, once the message is complete. Otherwise it
+            returns null. */
+        Retained<MappedFile> mappedBody() const;
+
         /** Converts the body from JSON to Fleece and returns a pointer to the root object. */
         fleece::Value JSONBody();
 
+        /** Receives the body of a message as it arrives: each chunk of (decompressed) data,
+            then an empty chunk with `complete` true once the message is complete. */
+        using BodySink = std::function<void(slice chunk, bool complete)>;
+
+        /** Streams the body to a sink instead of collecting it in memory, so body() and
+            extractBody() will return nothing. Any of the body that's already arrived is passed
+            to the sink along with the next frame's data, or right away if the message is
+            complete. Call this from onRequestBeginning, or for a response from its progress
+            callback (the kReceivingReply state.) The sink is called on the Connection's I/O
+            thread, once per frame. */
+        void setBodySink(BodySink);
+
+        /** Backpressure for a body sink that can't keep up: while paused, no ACKs are sent for
+            this message, so the sender stops once its flow-control window is used up. A frame
+            isn't ACKed until the sink has been given its data, so a sink can call pauseAcks
+            from inside its callback to hold back the ACK of the frame it's been given. */
+        void pauseAcks();
+        void resumeAcks();
+
         /** Sends a response. (The message must be complete.) */
         void respond(MessageBuilder&);
 
@@ -194,13 +289,23 @@ namespace litecore { namespace blip {
                   MessageSize outgoingSize =0);
         virtual ~MessageIn();
         virtual bool isIncoming() const     {return true;}
-        ReceiveState receivedFrame(Codec&, slice frame, FrameFlags);
+        ReceiveState receivedFrame(Codec&, slice frame, FrameFlags,
+                                   PropertyDecoder* =nullptr);
+        void discard();
 
         std::string description();
 
     private:
+        void formatTypedProperties();
+        slice formattedProperty(slice value) const;
+        bool integerProperty(slice name, int64_t &result) const;
         void readFrame(Codec&, int mode, slice &frame, bool finalFrame);
+        void writeBody(slice data);
+        alloc_slice takeBufferedBody();
+        void spillBody();
+        void finishBody();
         void acknowledge(uint32_t frameSize);
+        void sendAckIfDue();
 
         Retained<Connection> _connection;       // The owning BLIP connection     
         std::mutex _receiveMutex;
@@ -210,10 +315,24 @@ namespace litecore { namespace blip {
         slice _propertiesRemaining;             // Subrange of _properties still to be read
         uint32_t _unackedBytes {0};             // # bytes received that haven't been ACKed yet
         alloc_slice _properties;                // Just the (still encoded) properties
+        slice _profile;                         // The Profile property, within _properties
+        PropertyIndex _propertyIndex;           // Index of _properties
+        alloc_slice _formattedValues;           // Text of the integer & boolean properties
+        std::vector<std::pair<const void*, slice>> _formattedProperties; // Value -> its text
         alloc_slice _body;                      // Just the body
         alloc_slice _bodyAsFleece;              // Body re-encoded into Fleece [lazy]
         const MessageSize _outgoingSize {0};
         bool _complete {false};
+        bool _discarding {false};               // Throw away incoming data? (see discard())
+        BodySink _bodySink;                     // Consumer of body data, if streaming
+        Retained<MappedFile> _sinkBacklog;      // Spilled body data not yet given to _bodySink
+        MessageSize _bodyBytesReceived {0};     // Total length of body data received so far
+        bool _acksPaused {false};               // Is the body sink applying backpressure?
+        size_t _bufferedBodySize {0};           // Bytes of body data in _in
+        std::unique_ptr<TemporaryFile> _spillFile; // File the body's being written to, if any
+        Retained<MappedFile> _mappedBody;       // The spilled body, once complete
+        bool _spillFailed {false};              // Couldn't create _spillFile; don't try again
+        bool _bodyLost {false};                 // Couldn't write to _spillFile; message failed
     };
 
 } }
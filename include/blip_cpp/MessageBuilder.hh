@@ -18,7 +18,9 @@
 
 #pragma once
 #include "Message.hh"
-#include <sstream>
+#include <deque>
+#include <memory>
+#include <vector>
 
 namespace litecore { namespace blip {
 
@@ -27,6 +29,70 @@ namespace litecore { namespace blip {
         return the number of bytes written, or 0 on EOF, or a negative number on error. */
     using MessageDataSource = std::function<int(void* buf, size_t capacity)>;
 
+
+    /** An alternative to MessageDataSource for a body that isn't available right away, such as
+        one read from disk or produced by another actor. Instead of BLIP calling a function to
+        get data, the producer writes data to this object, on any thread, whenever it has some.
+        While it has nothing buffered, the message is set aside without blocking the connection.
+        The producer ends the body by calling close(), or calls fail() if it can't produce it;
+        then a request is canceled, and a response is replaced by an error response. Either way
+        the message's progress callback is called with the state kFailed and the error. */
+    class AsyncDataSource : public RefCounted {
+    public:
+        using slice = fleece::slice;
+        using alloc_slice = fleece::alloc_slice;
+
+        /** Appends data to the body. */
+        void write(alloc_slice data);
+        void write(slice data)                      {write(alloc_slice(data));}
+
+        /** Marks the end of the body. */
+        void close();
+
+        /** Gives up on the message; the error is sent to the peer if this is a response. */
+        void fail(Error);
+
+        /** The number of bytes written but not yet sent. A producer that can get ahead of the
+            connection should use this to pace itself. */
+        size_t bufferedBytes() const;
+
+        /** True if the message was canceled or its connection closed. Further writes are
+            ignored, so the producer might as well stop. */
+        bool canceled() const;
+
+    protected:
+        friend class MessageOut;
+        friend class BLIPIO;
+
+        enum ReadResult {kData, kWaiting, kEnd, kFailed};
+
+        /** Takes the next chunk written, if any. */
+        ReadResult read(alloc_slice &chunk);
+
+        /** If no data is buffered, saves `onReady` to be called after the next write(), close()
+            or fail(), and returns true. Otherwise returns false. */
+        bool waitForData(std::function<void()> onReady);
+
+        /** Called when the message is abandoned; frees the buffered data and any callback. */
+        void detach();
+
+        /** The error passed to fail(). */
+        Error error() const;
+
+    private:
+        std::function<void()> takeCallback();
+
+        mutable std::mutex _mutex;
+        std::deque<alloc_slice> _chunks;        // Data written but not yet read
+        size_t _bufferedBytes {0};              // Total size of _chunks
+        bool _closed {false};                   // Has close() or fail() been called?
+        bool _detached {false};                 // Has detach() been called?
+        std::function<void()> _onReady;         // Callback from waitForData()
+        alloc_slice _errorDomain, _errorMessage;
+        int _errorCode {0};
+    };
+
+
     /** A temporary object used to construct an outgoing message (request or response).
         The message is sent by calling Connection::sendRequest() or MessageIn::respond(). */
     class MessageBuilder {
@@ -45,12 +111,19 @@ namespace litecore { namespace blip {
         /** Constructs a MessageBuilder for a response. */
         MessageBuilder(MessageIn *inReplyTo);
 
+        ~MessageBuilder();
+
         /** Adds a property. */
         MessageBuilder& addProperty(slice name, slice value);
 
-        /** Adds a property with an integer value. */
+        /** Adds a property with an integer value. If the peer supports it, the value is sent
+            in binary, and MessageIn::intProperty() can read it without parsing. */
         MessageBuilder& addProperty(slice name, int64_t value);
 
+        /** Adds a property with a boolean value, sent in binary like an integer value.
+            (Not an overload of addProperty, since a string literal would convert to bool.) */
+        MessageBuilder& addBoolProperty(slice name, bool value);
+
         /** Adds multiple properties. */
         MessageBuilder& addProperties(std::initializer_list<property>);
 
@@ -65,19 +138,51 @@ namespace litecore { namespace blip {
         /** Makes a response an error. */
         void makeError(Error);
 
-        /** JSON encoder that can be used to write JSON to the body. */
-        fleece::JSONEncoder& jsonBody()          {finishProperties(); return _out;}
+        /** JSON encoder that can be used to write JSON to the body. (Its output is copied into
+            the message when write() or finish() is called.) */
+        fleece::JSONEncoder& jsonBody();
 
         /** Adds data to the body of the message. No more properties can be added afterwards. */
         MessageBuilder& write(slice s);
         MessageBuilder& operator<< (slice s)        {return write(s);}
 
-        /** Clears the MessageBuilder so it can be used to create another message. */
+        /** Adds data to the body by reference: the buffer is retained and sent as it is, in
+            its place after anything already written, instead of being copied into the message.
+            It mustn't be modified until the message has been sent. */
+        MessageBuilder& attachBody(alloc_slice data);
+
+        /** Appends the contents of a file to the body; nothing more can be written afterwards.
+            The file is memory-mapped instead of read, and if the message isn't compressed its
+            pages are handed straight to the WebSocket, so the file mustn't be modified until
+            the message has been sent. In particular, on Unix, reading a mapped page past the
+            end of a file that's been truncated raises SIGBUS and kills the process. The file's
+            size is checked before each frame, and if it's shrunk the message fails like one
+            whose data source failed; but that can't catch a truncation between the check and
+            the read. Throws if the file can't be opened, or would make the message larger
+            than 4GB. */
+        MessageBuilder& writeFile(const std::string &path);
+
+        /** Sets `deadline`. If `asProperty` is true, the deadline is also sent as the
+            "Deadline" property, so the receiver can skip handling the message once it's
+            expired; in that case this has to be called before the body is written. */
+        MessageBuilder& setDeadline(Deadline, bool asProperty =false);
+
+        /** Sets a deadline `ttl` from now. (See setDeadline.) */
+        MessageBuilder& setTimeToLive(std::chrono::milliseconds ttl, bool asProperty =false) {
+            return setDeadline(std::chrono::system_clock::now() + ttl, asProperty);
+        }
+
+        /** Clears the MessageBuilder so it can be used to create another message. A builder
+            that's reused, instead of constructing a new one for every message, sizes its buffer
+            from the previous message, so it usually allocates nothing but the payload. */
         void reset();
 
         /** Callback to provide the body of the message; will be called whenever data is needed. */
         MessageDataSource dataSource;
 
+        /** Object the producer of the body writes to, instead of using `dataSource`. */
+        Retained<AsyncDataSource> asyncDataSource;
+
         /** Callback to be invoked as the message is delivered (and replied to, if appropriate) */
         MessageProgressCallback onProgress;
 
@@ -90,22 +195,83 @@ namespace litecore { namespace blip {
         /** Should the message refuse replies? */
         bool noreply        {false};
 
+        /** Traffic class to schedule the message in, from 0 to
+            Connection::kNumTrafficClasses-1 (a higher value means the last class.) If
+            negative, the Connection's SchedulingPolicy assigns the class based on the "Profile"
+            property. */
+        int8_t trafficClass {-1};
+
+        /** If the message hasn't begun to be sent by this time, it's dropped from the outbox,
+            and its progress callback is called with the state kExpired. Messages that have
+            begun are always finished. */
+        Deadline deadline;
+
+        /** How long to wait for a response after the request is sent, before giving up on it
+            (see Connection::kResponseTimeoutOption.) Zero means to use the Connection's
+            default; negative means to wait forever. */
+        std::chrono::milliseconds responseTimeout {0};
+
     protected:
         friend class MessageIn;
         friend class MessageOut;
+        friend class EncodedMessage;
 
         FrameFlags flags() const;
         alloc_slice finish();
-        void writeTokenizedString(std::ostream &out, slice str);
+        void writeTokenizedString(slice str);
+        void writeTypedValue(slice value);
+
+        using Attachment = std::pair<size_t, alloc_slice>;  // Offset in payload, and data
 
         MessageType type {kRequestType};
 
     private:
         void finishProperties();
+        void flushJSON();
+        void append(slice data);
+        void reserve(size_t extra);
+
+        alloc_slice _buffer;            // The payload: properties size, properties, body
+        size_t _size {0};               // Number of bytes of _buffer in use
+        size_t _capacityHint;           // Size to allocate _buffer at
+        std::unique_ptr<fleece::JSONEncoder> _json; // Encoder returned by jsonBody() [lazy]
+        bool _wroteProperties {false};  // Has the properties size been filled in?
+        std::vector<Attachment> _attachments; // Buffers from attachBody(), in order
+        Retained<MappedFile> _bodyFile; // File to send after the body in _buffer
+    };
+
+
+    /** A request that's been encoded once, so it can be sent any number of times, by any number
+        of Connections, without being rebuilt. Every send shares the same payload (and attached
+        buffers and file), and differs only in its message number and progress callback.
+        Constructing it finishes the MessageBuilder, which can then be reset and reused. The
+        builder can't have a `dataSource` or `asyncDataSource`, since those can only be read
+        once, nor an `onProgress` callback, which is given to Connection::sendRequest instead. */
+    class EncodedMessage : public RefCounted {
+    public:
+        using alloc_slice = fleece::alloc_slice;
+
+        explicit EncodedMessage(MessageBuilder&);
+
+        FrameFlags flags() const                        {return _flags;}
+
+        /** The encoded properties and body (not including any attachments or file.) */
+        alloc_slice payload() const                     {return _payload;}
+
+    protected:
+        virtual ~EncodedMessage();
+
+    private:
+        friend class MessageOut;
 
-        fleece::JSONEncoder _out;    // Actually using it for the entire msg, not just JSON
-        std::stringstream _properties;  // Accumulates encoded properties
-        bool _wroteProperties {false};  // Have _properties been written to _out yet?
+        alloc_slice _payload;                           // Properties and body
+        alloc_slice _plainHeader;                       // Plain-text properties, if different
+        std::vector<MessageBuilder::Attachment> _attachments; // Buffers from attachBody()
+        Retained<MappedFile> _bodyFile;                 // File from writeFile()
+        FrameFlags _flags;
+        int8_t _trafficClass;
+        Deadline _deadline;
+        std::chrono::milliseconds _responseTimeout;
     };
 
 } }
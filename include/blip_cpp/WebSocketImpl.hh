@@ -47,6 +47,8 @@ namespace litecore { namespace websocket {
                       bool framing);
 
         virtual bool send(fleece::slice message, bool binary =true) override;
+        virtual bool sendBatch(const std::vector<MessageSegment> &segments,
+                               bool binary =true) override;
         virtual void close(int status =kCodeNormal, fleece::slice message =fleece::nullslice) override;
 
         // Concrete socket implementation needs to call these:
@@ -67,6 +69,12 @@ namespace litecore { namespace websocket {
         // These methods have to be implemented in subclasses:
         virtual void closeSocket() =0;
         virtual void sendBytes(fleece::alloc_slice) =0;
+
+        // Sends the concatenation of the segments (which all have owners) as one write.
+        // The default implementation gathers them and calls sendBytes(), which copies them, so
+        // BLIP's zero-copy bodies only save a copy in a subclass that overrides this with
+        // scatter/gather I/O.
+        virtual void sendSegments(std::vector<MessageSegment>);
         virtual void receiveComplete(size_t byteCount) =0;
         virtual void requestClose(int status, fleece::slice message) =0;
 
@@ -79,6 +87,10 @@ namespace litecore { namespace websocket {
         using ServerProtocol = uWS::WebSocketProtocol<true>;
 
         bool sendOp(fleece::slice, int opcode);
+        size_t formatMessage(void *dst, fleece::slice message, int opcode);
+        void formatSegments(const MessageSegment *segments, size_t count, int opcode,
+                            fleece::alloc_slice &scratch, size_t &scratchUsed,
+                            std::vector<MessageSegment> &output);
         bool handleFragment(char *data,
                             size_t length,
                             unsigned int remainingBytes,
@@ -25,6 +25,7 @@
 #include <atomic>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace litecore { namespace websocket {
     using fleece::RefCounted;
@@ -79,6 +80,30 @@ namespace litecore { namespace websocket {
     };
 
 
+    /** A contiguous piece of an outgoing message. If `owner` is non-null, `data` lies within it,
+        and the WebSocket may retain `owner` instead of copying the data; likewise if `holder`
+        is non-null, it keeps `data` valid (for memory that isn't an alloc_slice, like a mapped
+        file.) Otherwise `data` is only valid during the call it's passed to. */
+    struct MessageSegment {
+        fleece::slice data;
+        fleece::alloc_slice owner;
+        Retained<RefCounted> holder;
+        bool endOfMessage;              // Is this the last segment of its message?
+
+        MessageSegment(fleece::slice d =fleece::nullslice, bool end =true)
+        :data(d), endOfMessage(end) { }
+        MessageSegment(fleece::slice d, fleece::alloc_slice o, bool end =true)
+        :data(d), owner(o), endOfMessage(end) { }
+
+        /** True if the data can be retained instead of copied. */
+        bool owned() const              {return owner || holder;}
+    };
+
+    /** Returns the concatenation of `count` segments, avoiding a copy if there's only one
+        segment and it's an entire alloc_slice. */
+    fleece::alloc_slice gatherSegments(const MessageSegment *segments, size_t count);
+
+
     struct CloseStatus {
         CloseReason reason;
         int code;
@@ -124,6 +149,12 @@ namespace litecore { namespace websocket {
             then stop sending until it gets an onWebSocketWriteable delegate call. */
         virtual bool send(fleece::slice message, bool binary =true) =0;
 
+        /** Sends several messages at once, which may be much more efficient than calling send()
+            on each one. Each message consists of one or more segments, the last of which has
+            its `endOfMessage` flag set. Returns the same value send() would after the last
+            message. The default implementation gathers each message and calls send(). */
+        virtual bool sendBatch(const std::vector<MessageSegment> &segments, bool binary =true);
+
         /** Closes the WebSocket. Callable from any thread. */
         virtual void close(int status =kCodeNormal, fleece::slice message =fleece::nullslice) =0;
 
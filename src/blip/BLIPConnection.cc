@@ -18,6 +18,10 @@
 
 #include "BLIPConnection.hh"
 #include "MessageOut.hh"
+#include "MessageIndex.hh"
+#include "MessageQueue.hh"
+#include "ProfileRouter.hh"
+#include "PropertyCodec.hh"
 #include "BLIPInternal.hh"
 #include "WebSocketInterface.hh"
 #include "Actor.hh"
@@ -31,9 +35,15 @@
 #include <algorithm>
 #include <assert.h>
 #include <atomic>
+#include <deque>
+#include <limits.h>
 #include <mutex>
 #include <map>
+#include <memory>
+#include <queue>
+#include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 using namespace std;
@@ -43,48 +53,210 @@ using namespace litecore::websocket;
 
 namespace litecore { namespace blip {
 
-    static const size_t kDefaultFrameSize = 4096;       // Default size of frame
-    static const size_t kBigFrameSize = 16384;          // Max size of frame
+    static const size_t kDefaultMinFrameSize = 2048;    // Default lower bound of frame size
+    static const size_t kDefaultMaxFrameSize = 65536;   // Default upper bound of frame size
+    static const size_t kAbsoluteMinFrameSize = 1024;   // Smallest frame size allowed at all
+    static const size_t kInitialFrameSize = 16384;      // Frame size before any measurements
+    static const size_t kDefaultMinFlowWindow = 128000; // Default lower bound of flow window
+    static const size_t kDefaultMaxFlowWindow = 16 * 1024 * 1024; // Default upper bound
+    static const size_t kMaxBatchSize = 64 * 1024;      // Most bytes of frames to send at once
+    static const size_t kMaxFrameOverhead = kMaxVarintLen64 + 1 + 4;   // msg#, flags, checksum
+    static const size_t kMaxDeflateOverhead = 64;       // Most that deflate can expand a frame by
 
     static const auto kDefaultCompressionLevel = (Deflater::CompressionLevel)6;
 
+    static_assert(MessageQueue::kNumClasses == Connection::kNumTrafficClasses,
+                  "MessageQueue and Connection disagree on number of traffic classes");
+
     const char* const kMessageTypeNames[8] = {"REQ", "RES", "ERR", "?3?",
-                                              "ACKREQ", "AKRES", "?6?", "?7?"};
+                                              "ACKREQ", "AKRES", "CANREQ", "CANRES"};
 
     LogDomain BLIPLog("BLIP", LogLevel::Warning);
     static LogDomain BLIPMessagesLog("BLIPMessages", LogLevel::None);
 
 
-    /** Queue of outgoing messages; each message gets to send one frame in turn. */
-    class MessageQueue : public vector<Retained<MessageOut>> {
+    /** Chooses the sizes of outgoing frames, based on how fast the WebSocket drains.
+        A big frame is sized to take about kTargetFrameTime to transmit at the measured rate,
+        so that an urgent message never waits long behind one; a small frame, used for normal
+        messages while urgent ones are waiting, is a quarter of that.
+        The rate is measured between consecutive onWebSocketWriteable calls, since in between
+        the socket has been sending at full speed. If the socket keeps accepting data without
+        filling up, the link is keeping up, and frames grow toward the maximum. */
+    class FrameSizer {
     public:
-        MessageQueue()                          { }
-        MessageQueue(size_t rsrv)               {reserve(rsrv);}
+        static constexpr double kTargetFrameTime = 0.005;       // seconds
+        static constexpr size_t kGrowAfterBytes = 1024 * 1024;  // Unstalled bytes before growing
+
+        FrameSizer(size_t minSize, size_t maxSize)
+        :_minSize(max(minSize, kAbsoluteMinFrameSize))
+        ,_maxSize(max(maxSize, _minSize))
+        ,_bigSize(clamp(kInitialFrameSize))
+        { }
+
+        size_t maxSize() const                  {return _maxSize;}
+        size_t bigFrameSize() const             {return _bigSize;}
+        size_t smallFrameSize() const           {return clamp(_bigSize / 4);}
+
+        /** Call after writing bytes to the WebSocket; `stalled` is true if it's full. */
+        void wrote(size_t bytes, bool stalled) {
+            _bytesSinceDrain += bytes;
+            if (stalled) {
+                _stalled = true;
+                _unstalledBytes = 0;
+            } else if ((_unstalledBytes += bytes) >= kGrowAfterBytes) {
+                _unstalledBytes = 0;
+                _bigSize = clamp(_bigSize * 2);
+            }
+        }
 
-        bool contains(MessageOut *msg) const    {return find(begin(), end(), msg) != end();}
+        /** Call when the WebSocket becomes writeable again. */
+        void drained() {
+            double elapsed = _sinceDrain.elapsed();
+            if (_stalled && _bytesSinceDrain > 0 && elapsed > 0) {
+                double rate = _bytesSinceDrain / elapsed;
+                _bytesPerSec = (_bytesPerSec > 0) ? (0.75 * _bytesPerSec + 0.25 * rate) : rate;
+                _bigSize = clamp(size_t(_bytesPerSec * kTargetFrameTime));
+            }
+            _stalled = false;
+            _bytesSinceDrain = 0;
+            _sinceDrain.reset();
+        }
 
-        MessageOut* findMessage(MessageNo msgNo, bool isResponse) const {
-            auto i = find_if(begin(), end(), [&](const Retained<MessageOut> &msg) {
-                return msg->number() == msgNo && msg->isResponse() == isResponse;
-            });
-            return (i != end()) ? *i : nullptr;
+    private:
+        size_t clamp(size_t size) const {
+            size = (size + 511) & ~size_t(511);     // round up to a multiple of 512
+            return min(max(size, _minSize), _maxSize);
         }
 
-        Retained<MessageOut> pop() {
-            if (empty())
-                return nullptr;
-            Retained<MessageOut> msg(front());
-            erase(begin());
-            return msg;
+        size_t const _minSize, _maxSize;
+        size_t _bigSize;
+        double _bytesPerSec {0};                // Estimated drain rate (smoothed)
+        Stopwatch _sinceDrain;                  // Time since last drained()
+        size_t _bytesSinceDrain {0};            // Bytes written since last drained()
+        size_t _unstalledBytes {0};             // Bytes written since last stall
+        bool _stalled {false};                  // Has send() returned false since drained()?
+    };
+
+
+    /** Chooses the flow-control window: how many unacknowledged bytes an outgoing message may
+        have in flight. To keep a fast, long link busy the window has to be at least its
+        bandwidth-delay product, which is estimated from the rate at which ACKed bytes arrive
+        and the round-trip time of ACKs.
+        Whenever a message uses up the window while the WebSocket still has room, the window is
+        what's limiting throughput, so it doubles (up to the maximum.) When the WebSocket is
+        full, the link is the limit, so the window shrinks toward twice the bandwidth-delay
+        product. It never goes below twice the interval at which the peer has announced it
+        will send ACKs, or the peer would wait for more data while we wait for an ACK. */
+    class FlowWindow {
+    public:
+        FlowWindow(size_t minSize, size_t maxSize)
+        :_minSize(max(minSize, size_t(2 * kIncomingAckThreshold)))
+        ,_maxSize(max(maxSize, _minSize))
+        ,_size(_minSize)
+        { }
+
+        size_t size() const                     {return _size;}
+        size_t maxSize() const                  {return _maxSize;}
+        double roundTripTime() const            {return _rtt;}
+
+        /** Call when an ACK arrives. `rtt` is the round-trip time measured by it, or -1. */
+        void receivedAck(size_t bytesAcked, double rtt, double now) {
+            if (rtt >= 0)
+                _rtt = (_rtt > 0) ? (0.875 * _rtt + 0.125 * rtt) : rtt;
+            _bytesAcked += bytesAcked;
+            double elapsed = now - _rateStart;
+            if (elapsed >= max(_rtt, 0.001)) {
+                double rate = _bytesAcked / elapsed;
+                _bytesPerSec = (_bytesPerSec > 0) ? (0.75 * _bytesPerSec + 0.25 * rate) : rate;
+                _bytesAcked = 0;
+                _rateStart = now;
+            }
+        }
+
+        /** Call when the peer announces the interval at which it sends ACKs. */
+        void setPeerAckInterval(size_t interval) {
+            _floor = 2 * interval;
+            _size = max(_size, _floor);
         }
 
-        bool remove(MessageOut *msg) {
-            auto i = find(begin(), end(), msg);
-            if (i == end())
+        /** Call when a message has used up the window. */
+        void exhausted(bool webSocketFull) {
+            if (!webSocketFull)
+                _size = clamp(max(2 * _size, 2 * bandwidthDelayProduct()));
+            else if (_bytesPerSec > 0 && _rtt > 0)
+                _size = clamp(max(_size / 2, 2 * bandwidthDelayProduct()));
+        }
+
+    private:
+        size_t bandwidthDelayProduct() const    {return size_t(_bytesPerSec * _rtt);}
+
+        size_t clamp(size_t size) const {
+            return max(min(max(size, _minSize), _maxSize), _floor);
+        }
+
+        size_t const _minSize, _maxSize;
+        size_t _size;
+        size_t _floor {0};                      // Twice the peer's ACK interval
+        double _rtt {0};                        // Estimated round-trip time (smoothed)
+        double _bytesPerSec {0};                // Estimated rate of ACKed bytes (smoothed)
+        double _rateStart {0};                  // Start time of current rate sample
+        size_t _bytesAcked {0};                 // Bytes ACKed since _rateStart
+    };
+
+
+    /** Estimates the rate at which message data arrives, to set the interval at which it's
+        ACKed. The sender keeps its window at least twice the interval, so ACKs should come a
+        few times per round trip: the interval is the data that arrives in a quarter of the
+        round-trip time. That can only be timed by sending (see FlowWindow), so until it has
+        been, as at a peer that only receives, kDefaultAckPeriod stands in for it. */
+    class IncomingFlow {
+    public:
+        static constexpr double kDefaultAckPeriod = 0.025;  // Secs of data to ACK, if no RTT
+        static constexpr double kSamplePeriod = 0.02;       // Secs over which to measure rate
+        static constexpr double kIdleTime = 1.0;            // Gap that starts a new sample
+
+        /** Call when a frame of a message arrives. Returns true if the estimate changed. */
+        bool received(size_t bytes, double now) {
+            double elapsed = now - _rateStart;
+            if (elapsed >= kIdleTime) {
+                // Don't count the time the connection sat idle:
+                _bytes = bytes;
+                _rateStart = now;
+                return false;
+            }
+            _bytes += bytes;
+            if (elapsed < kSamplePeriod)
                 return false;
-            erase(i);
+            double rate = _bytes / elapsed;
+            _bytesPerSec = (_bytesPerSec > 0) ? (0.75 * _bytesPerSec + 0.25 * rate) : rate;
+            _bytes = 0;
+            _rateStart = now;
             return true;
         }
+
+        /** The interval at which to ACK, given the round-trip time (or 0 if it's unknown.) */
+        size_t ackInterval(double rtt) const {
+            return size_t(_bytesPerSec * ((rtt > 0) ? rtt / 4 : kDefaultAckPeriod));
+        }
+
+    private:
+        double _bytesPerSec {0};                // Estimated rate of arrival (smoothed)
+        double _rateStart {-kIdleTime};         // Start time of current rate sample
+        size_t _bytes {0};                      // Bytes received since _rateStart
+    };
+
+
+    /** An actor that calls incoming requests' handlers, so they don't hold up the BLIPIO. */
+    class RequestWorker : public actor::Actor {
+    public:
+        explicit RequestWorker(const string &name)
+        :Actor(name)
+        { }
+
+        void run(function<void()> fn)           {enqueue(&RequestWorker::_run, fn);}
+
+    private:
+        void _run(function<void()> fn)          {fn();}
     };
 
 
@@ -94,41 +266,88 @@ namespace litecore { namespace blip {
     /** The guts of a Connection. */
     class BLIPIO : public actor::Actor, public Logging, public websocket::Delegate {
     private:
+        /** Something to call to handle an incoming request: a RequestHandler, an
+            AsyncRequestHandler, or (if there's no handler for its profile) the delegate. */
+        struct Handler {
+            Connection::RequestHandler sync;
+            Connection::AsyncRequestHandler async;
+        };
+
+        /** Requests of one profile being handled by workers, or waiting their turn. */
+        struct ProfileDispatch {
+            unsigned running {0};
+            deque<pair<Retained<MessageIn>, bool>> waiting;     // Request, beginning?
+        };
+
         using MessageMap = unordered_map<MessageNo, Retained<MessageIn>>;
-        using HandlerKey = pair<string, bool>;
-        using RequestHandlers = map<HandlerKey, Connection::RequestHandler>;
+        using RequestHandlers = ProfileRouter<Handler>;
+        using ProfileClasses = map<string, uint8_t>;
+        using ResponseTimeout = pair<double, MessageNo>;    // Expiration time, request number
+        using ResponseTimeouts = priority_queue<ResponseTimeout, vector<ResponseTimeout>,
+                                                greater<ResponseTimeout>>;
 
         Retained<Connection>    _connection;
         Retained<WebSocket>     _webSocket;
         unique_ptr<error>       _closingWithError;
         actor::Batcher<BLIPIO,websocket::Message> _incomingFrames;
         MessageQueue            _outbox;
-        MessageQueue            _icebox;
-        bool                    _writeable {true};
+        MessageIndex            _outgoing;      // Started msgs in _outbox, plus the icebox
+        bool                    _writeable {false}; // (Not until connected; see below)
         MessageMap              _pendingRequests, _pendingResponses;
+        unordered_set<MessageNo> _ignoredResponses; // Timed out or canceled before arriving
         atomic<MessageNo>       _lastMessageNo {0};
         MessageNo               _numRequestsReceived {0};
         Deflater                _outputCodec;
         Inflater                _inputCodec;
-        unique_ptr<uint8_t[]>   _frameBuf;
-        RequestHandlers         _requestHandlers;
+        unique_ptr<PropertyEncoder> _propertyEncoder;   // Tokenizes outgoing properties, if enabled
+        unique_ptr<PropertyDecoder> _propertyDecoder;   // Expands incoming properties, if enabled
+        unique_ptr<uint8_t[]>   _frameBuf;      // Holds a batch of outgoing frames
+        vector<MessageSegment>  _batch;         // Frames not yet sent
+        size_t                  _batchSize {0}; // Total size of _batch
+        size_t                  _batchBufUsed {0}; // Bytes of _frameBuf used by _batch
+        FrameSizer              _frameSizer;
+        FlowWindow              _flowWindow;
+        IncomingFlow            _incomingFlow;
+        bool                    _peerAnnouncesAckInterval {false};  // Understands ACK intervals?
+        bool                    _peerCanCancel {false};     // Understands CANREQ and CANRES?
+        double                  _responseTimeout;   // Default timeout in secs (0 = none)
+        ResponseTimeouts        _responseTimeouts;  // Queue of responses' expiration times
+        double                  _nextTimeoutCheck {-1}; // When _checkResponseTimeouts will run
+        RequestHandlers         _requestHandlers[2];    // Indexed by `atBeginning`
+        Handler                 _delegateHandlers[2];   // Call the delegate (ditto)
+        vector<Retained<RequestWorker>> _workers;   // If empty, handlers run on this actor
+        map<string, unsigned>   _profileLimits;     // Max concurrent handlers per profile
+        unsigned                _defaultLimit {0};  // Same, for other profiles (0 = none)
+        unordered_map<string, ProfileDispatch> _dispatching;
+        unordered_map<MessageNo, Retained<RequestWorker>> _beganOn; // Worker a request began on
+        ProfileClasses          _profileClasses;
         size_t                  _maxOutboxDepth {0}, _totalOutboxDepth {0}, _countOutboxDepth {0};
         uint64_t                _totalBytesWritten {0}, _totalBytesRead {0};
         Stopwatch               _timeOpen;
 
     public:
 
-        BLIPIO(Connection *connection, WebSocket *webSocket, Deflater::CompressionLevel compressionLevel)
+        BLIPIO(Connection *connection, WebSocket *webSocket,
+               Deflater::CompressionLevel compressionLevel,
+               size_t minFrameSize, size_t maxFrameSize,
+               size_t minFlowWindow, size_t maxFlowWindow, double responseTimeout)
         :Actor(string("BLIP[") + connection->name() + "]")
         ,Logging(BLIPLog)
         ,_connection(connection)
         ,_webSocket(webSocket)
         ,_incomingFrames(this, &BLIPIO::_onWebSocketMessages)
-        ,_outbox(10)
         ,_outputCodec(compressionLevel)
+        ,_frameSizer(minFrameSize, maxFrameSize)
+        ,_flowWindow(minFlowWindow, maxFlowWindow)
+        ,_responseTimeout(responseTimeout)
         {
             _pendingRequests.reserve(10);
             _pendingResponses.reserve(10);
+            ConnectionDelegate *delegate = &connection->delegate();
+            _delegateHandlers[false].sync = [=](MessageIn *r) {delegate->onRequestReceived(r);};
+            _delegateHandlers[true].sync  = [=](MessageIn *r) {delegate->onRequestBeginning(r);};
+            publishFrameSizes();
+            flowWindowChanged();
         }
 
         void start() {
@@ -140,11 +359,39 @@ namespace litecore { namespace blip {
             enqueue(&BLIPIO::_queueMessage, Retained<MessageOut>(msg));
         }
 
+        void cancel(MessageOut *msg) {
+            enqueue(&BLIPIO::_cancel, Retained<MessageOut>(msg));
+        }
+
+        void acksResumed(MessageIn *msg) {
+            enqueue(&BLIPIO::_acksResumed, Retained<MessageIn>(msg));
+        }
+
+        void dataAvailable(MessageOut *msg) {
+            enqueue(&BLIPIO::_dataAvailable, Retained<MessageOut>(msg));
+        }
+
+        void usePropertyTokens(bool dynamicTable) {
+            enqueue(&BLIPIO::_usePropertyTokens, dynamicTable);
+        }
+
         void setRequestHandler(std::string profile, bool atBeginning,
                                Connection::RequestHandler handler) {
             enqueue(&BLIPIO::_setRequestHandler, profile, atBeginning, handler);
         }
 
+        void setAsyncRequestHandler(std::string profile, Connection::AsyncRequestHandler handler) {
+            enqueue(&BLIPIO::_setAsyncRequestHandler, profile, handler);
+        }
+
+        void setDispatchPolicy(const Connection::DispatchPolicy &policy) {
+            enqueue(&BLIPIO::_setDispatchPolicy, policy);
+        }
+
+        void setSchedulingPolicy(const Connection::SchedulingPolicy &policy) {
+            enqueue(&BLIPIO::_setSchedulingPolicy, policy);
+        }
+
         void close(CloseCode closeCode = kCodeNormal, slice message =nullslice) {
             enqueue(&BLIPIO::_close, closeCode, alloc_slice(message));
         }
@@ -176,6 +423,9 @@ namespace litecore { namespace blip {
         }
 
         // websocket::Delegate interface:
+        // Nothing's written until the WebSocket connects, since until then a client doesn't
+        // know whether the server chose BLIP_3+tokens, which changes how properties are
+        // encoded. (The HTTP response arrives first, so _usePropertyTokens is already queued.)
         virtual void onWebSocketConnect() override {
             _timeOpen.reset();
             _connection->connected();
@@ -199,6 +449,19 @@ namespace litecore { namespace blip {
 
     private:
 
+        /** Turns on property compression, once the peer is known to support it. */
+        void _usePropertyTokens(bool dynamicTable) {
+            logInfo("Peer supports tokenized properties");
+            _propertyEncoder.reset(new PropertyEncoder(dynamicTable));
+            _propertyDecoder.reset(new PropertyDecoder);
+            // A peer that speaks BLIP_3+tokens also understands ACK intervals, which a peer
+            // that only receives would otherwise never get to show by sending an ACK:
+            _peerAnnouncesAckInterval = true;
+            ackIntervalChanged();
+            // ...and cancel frames, which an older peer would ignore:
+            _peerCanCancel = true;
+        }
+
         /** Implementation of public close() method. Closes the WebSocket. */
         void _close(CloseCode closeCode, alloc_slice message) {
             if (_webSocket && !_closingWithError) {
@@ -225,12 +488,18 @@ namespace litecore { namespace blip {
                     status.message = alloc_slice(_closingWithError->what());
                 }
                 _connection->closed(status);
-                _connection = nullptr;
                 cancelAll(_outbox);
-                cancelAll(_icebox);
+                cancelFrozen();
                 cancelAll(_pendingRequests);
                 cancelAll(_pendingResponses);
-                _requestHandlers.clear();
+                _ignoredResponses.clear();
+                _responseTimeouts = ResponseTimeouts();
+                _connection = nullptr;
+                _requestHandlers[0].clear();
+                _requestHandlers[1].clear();
+                _dispatching.clear();
+                _beganOn.clear();
+                _workers.clear();
                 release(this); // webSocket is done calling delegate now (balances retain in ctor)
             }
         }
@@ -248,12 +517,11 @@ namespace litecore { namespace blip {
                 msg->disconnected();
                 return;
             }
-            if (msg->_number == 0)
-                msg->_number = ++_lastMessageNo;
-            if (BLIPLog.willLog(LogLevel::Verbose)) {
-                if (!msg->isAck() || BLIPLog.willLog(LogLevel::Debug))
-                    logVerbose("Sending %s", msg->description().c_str());
-            }
+            // From here on _trafficClass is a valid index, even if the client set it too high:
+            if (msg->_trafficClass < 0)
+                msg->_trafficClass = trafficClassOf(msg);
+            msg->_trafficClass = (int8_t)min(unsigned(msg->_trafficClass),
+                                             Connection::kNumTrafficClasses - 1);
             _maxOutboxDepth = max(_maxOutboxDepth, _outbox.size()+1);
             _totalOutboxDepth += _outbox.size()+1;
             ++_countOutboxDepth;
@@ -261,28 +529,72 @@ namespace litecore { namespace blip {
         }
 
 
+        /** Implementation of public cancel() method. Takes the message out of the outbox, the
+            icebox or the parked messages; or if it's been completely sent, stops waiting for its
+            response. */
+        void _cancel(Retained<MessageOut> msg) {
+            if (msg->_bytesSent > 0 && !_peerCanCancel
+                    && _outgoing.find(msg->number(), msg->isResponse()) == msg.get()) {
+                // It's partly sent, but an older peer would ignore a CANREQ and keep the part
+                // it's received forever; so finish sending it, and ignore its response:
+                logInfo("Peer can't cancel a partly-sent message; finishing %s",
+                        msg->description().c_str());
+                msg->_onProgress = nullptr;
+                return;
+            }
+            bool frozen = false;
+            bool unfinished = _outbox.remove(msg);
+            if (!unfinished && msg->_number != 0
+                    && _outgoing.find(msg->number(), msg->isResponse(), &frozen) == msg.get())
+                unfinished = frozen || _outgoing.isParked(msg);
+            if (unfinished) {
+                logInfo("Canceling %s", msg->description().c_str());
+                if (msg->_bytesSent > 0) {
+                    _outgoing.remove(msg);
+                    // Tell the peer to throw away the part of the message it's received:
+                    requeue(new MessageOut(_connection,
+                                           (FrameFlags)(kCancelRequestType | kUrgent | kNoReply),
+                                           alloc_slice(), nullptr, msg->number()),
+                            true);
+                }
+            } else {
+                if (msg->type() != kRequestType || msg->noReply() || msg->_number == 0)
+                    return;
+                auto i = _pendingResponses.find(msg->number());
+                if (i == _pendingResponses.end())
+                    return;     // Response already arrived (or request already canceled)
+                logInfo("Canceling REQ #%llu; ignoring its response", msg->number());
+                ignoreResponse(i);
+            }
+            msg->canceled();
+        }
+
+
+        /** Looks up the traffic class of an outgoing message from its Profile property. */
+        int8_t trafficClassOf(MessageOut *msg) {
+            if (_profileClasses.empty() || msg->type() != kRequestType)
+                return 0;
+            const char *profile = msg->findProperty("Profile");
+            if (!profile)
+                return 0;
+            auto i = _profileClasses.find(profile);
+            return (i != _profileClasses.end()) ? (int8_t)i->second : 0;
+        }
+
+
+        void _setSchedulingPolicy(Connection::SchedulingPolicy policy) {
+            for (unsigned c = 0; c < Connection::kNumTrafficClasses; ++c)
+                _outbox.setWeight(c, policy.weights[c]);
+            _outbox.setShortestRemainingFirst(policy.shortestRemainingFirst,
+                                              policy.maxActiveMessages);
+            _profileClasses = move(policy.profileClasses);
+        }
+
+
         /** Adds a message to the outgoing queue */
         void requeue(MessageOut *msg, bool andWrite =false) {
             DebugAssert(!_outbox.contains(msg));
-            auto i = _outbox.end();
-            if (msg->urgent() && _outbox.size() > 1) {
-                // High-priority gets queued after the last existing high-priority message,
-                // leaving one regular-priority message in between if possible:
-                const bool isNew = (msg->_bytesSent == 0);
-                do {
-                    --i;
-                    if ((*i)->urgent()) {
-                        if ((i+1) != _outbox.end())
-                            ++i;
-                        break;
-                    } else if (isNew && (*i)->_bytesSent == 0) {
-                        break;
-                    }
-                } while (i != _outbox.begin());
-                ++i;
-            }
-            _outbox.emplace(i, msg);  // inserts _at_ position i, before message *i
-
+            _outbox.push(msg);
             if (andWrite)
                 writeToWebSocket();
         }
@@ -292,17 +604,82 @@ namespace litecore { namespace blip {
         void freezeMessage(MessageOut *msg) {
             logVerbose("Freezing %s #%llu", kMessageTypeNames[msg->type()], msg->number());
             DebugAssert(!_outbox.contains(msg));
-            DebugAssert(!_icebox.contains(msg));
-            _icebox.push_back(msg);
+            _outgoing.setFrozen(msg, true);
         }
 
 
         /** Removes an outgoing message from the icebox and re-queues it (after ACK arrives.) */
         void thawMessage(MessageOut *msg) {
             logVerbose("Thawing %s #%llu", kMessageTypeNames[msg->type()], msg->number());
-            LITECORE_UNUSED bool removed = _icebox.remove(msg);
-            DebugAssert(removed);
-            requeue(msg, true);
+            _outgoing.setFrozen(msg, false);
+            continueMessage(msg, true);
+        }
+
+
+        /** Re-queues a partly-sent message, unless it has to wait for its AsyncDataSource, or
+            the data source has failed. */
+        void continueMessage(MessageOut *msg, bool andWrite) {
+            if (parkIfStarving(msg))
+                return;
+            else if (msg->failed())
+                abortMessage(msg, andWrite);
+            else
+                requeue(msg, andWrite);
+        }
+
+
+        /** If a message has nothing to send until its AsyncDataSource produces more, parks it
+            (outside the outbox) and returns true. The data source will call dataAvailable()
+            when the producer writes more. */
+        bool parkIfStarving(MessageOut *msg) {
+            if (!msg->needsData())
+                return false;
+            Retained<BLIPIO> self = this;
+            Retained<MessageOut> retainedMsg = msg;
+            auto onReady = [self, retainedMsg] {self->dataAvailable(retainedMsg);};
+            if (!msg->_contents.asyncSource()->waitForData(onReady))
+                return false;   // Producer wrote something in the meantime
+            logVerbose("Parking %s #%llu until it has more data",
+                       kMessageTypeNames[msg->type()], msg->number());
+            _outgoing.setParked(msg, true);
+            return true;
+        }
+
+
+        /** Re-queues a parked message once its AsyncDataSource has more data (or has ended.) */
+        void _dataAvailable(Retained<MessageOut> msg) {
+            if (!_outgoing.isParked(msg))
+                return;         // It's been canceled, or the connection closed
+            logVerbose("Unparking %s #%llu", kMessageTypeNames[msg->type()], msg->number());
+            _outgoing.setParked(msg, false);
+            continueMessage(msg, true);
+        }
+
+
+        /** Gives up on a partly-sent message whose data source failed. The peer is told to
+            discard what it's received; a response is then replaced by an error response. The
+            message's progress callback gets the state kFailed.
+            An older peer doesn't understand CANREQ or CANRES, and would take the rest of the
+            connection's frames as the rest of the message; so with one, the connection is
+            closed instead. */
+        void abortMessage(MessageOut *msg, bool andWrite) {
+            warn("Data source of %s failed; aborting it", msg->description().c_str());
+            _outgoing.remove(msg);
+            if (msg->_bytesSent > 0 && !_peerCanCancel) {
+                warn("Peer can't cancel a partly-sent message; closing connection");
+                msg->aborted();
+                _close(kCodeUnexpectedCondition, alloc_slice("Data source of message failed"));
+                return;
+            }
+            if (msg->_bytesSent > 0) {
+                auto cancelType = msg->isResponse() ? kCancelResponseType : kCancelRequestType;
+                requeue(new MessageOut(_connection, (FrameFlags)(cancelType | kUrgent | kNoReply),
+                                       alloc_slice(), nullptr, msg->number()),
+                        andWrite);
+            }
+            if (msg->isResponse())
+                _connection->send(msg->createErrorResponse());
+            msg->aborted();
         }
 
 
@@ -310,11 +687,43 @@ namespace litecore { namespace blip {
         void _onWebSocketWriteable() {
             logVerbose("WebSocket is hungry!");
             _writeable = true;
+            _frameSizer.drained();
+            publishFrameSizes();
             writeToWebSocket();
         }
 
 
-        /** Sends the next frame. */
+        /** Makes the current flow-control window visible to the Connection's clients. */
+        void flowWindowChanged() {
+            _connection->_flowWindow = _flowWindow.size();
+        }
+
+
+        /** Scales the interval at which incoming messages are ACKed with the rate they arrive
+            at, once the peer is known to understand ACK intervals. It's capped at a quarter of
+            our own maximum window, on the assumption that the peer's is similar. (The peer can't
+            depend on a larger interval until it's been announced in an ACK; see
+            MessageIn::sendAckIfDue.) */
+        void ackIntervalChanged() {
+            if (!_peerAnnouncesAckInterval)
+                return;
+            size_t interval = _incomingFlow.ackInterval(_flowWindow.roundTripTime());
+            interval = min(interval, min(_flowWindow.maxSize() / 4, size_t(UINT32_MAX)));
+            _connection->_ackInterval = (uint32_t)max(interval, size_t(kIncomingAckThreshold));
+        }
+
+
+        /** Makes the current frame sizes visible to the Connection's clients. */
+        void publishFrameSizes() {
+            _connection->_bigFrameSize = _frameSizer.bigFrameSize();
+            _connection->_smallFrameSize = _frameSizer.smallFrameSize();
+        }
+
+
+        /** Sends frames until the WebSocket is full or the outbox is empty. The frames are
+            collected in _frameBuf and sent in batches, to reduce the overhead per frame.
+            Uncompressed message bodies aren't copied into _frameBuf; the batch references
+            them in the messages' payloads or mapped files. */
         void writeToWebSocket() {
             if (!_writeable)
                 return;
@@ -328,25 +737,69 @@ namespace litecore { namespace blip {
                     break;
 
                 FrameFlags frameFlags;
+                uint32_t prevBytesSent = msg->_bytesSent;
+                if (prevBytesSent == 0) {
+                    // A message that's past its deadline is dropped, unless it's begun:
+                    if (msg->isExpired()) {
+                        logInfo("Dropping expired %s", msg->description().c_str());
+                        msg->expired();
+                        continue;
+                    }
+                    // A new request gets its number when it's begun, so that requests are
+                    // always begun in numerical order, as the protocol requires.
+                    if (msg->_number == 0)
+                        msg->_number = ++_lastMessageNo;
+                    if (BLIPLog.willLog(LogLevel::Verbose)) {
+                        if (!msg->isControl() || BLIPLog.willLog(LogLevel::Debug))
+                            logVerbose("Sending %s", msg->description().c_str());
+                    }
+                }
                 {
                     // Set up a buffer for the frame contents:
-                    size_t maxSize = kDefaultFrameSize;
-                    if (msg->urgent() || _outbox.empty() || !_outbox.front()->urgent())
-                        maxSize = kBigFrameSize;
+                    size_t maxSize = _frameSizer.smallFrameSize();
+                    if (msg->urgent() || !_outbox.hasUrgent())
+                        maxSize = _frameSizer.bigFrameSize();
+
+                    // Encode a new message's properties for the peer. If tokenized, they may use
+                    // the dynamic table only if they're sure to fit in this frame, even if
+                    // deflate expands them:
+                    if (prevBytesSent == 0 && !msg->isControl()) {
+                        size_t overhead = kMaxFrameOverhead + kMaxDeflateOverhead;
+                        msg->encodeProperties(_propertyEncoder.get(),
+                                              (maxSize > overhead) ? maxSize - overhead : 0);
+                    }
 
                     if (!_frameBuf)
-                        _frameBuf.reset(new uint8_t[kMaxVarintLen64 + 1 + 4 + kBigFrameSize]);
-                    slice out(_frameBuf.get(), maxSize);
+                        _frameBuf.reset(new uint8_t[kMaxBatchSize + kMaxFrameOverhead
+                                                    + _frameSizer.maxSize()]);
+                    uint8_t *frameStart = _frameBuf.get() + _batchBufUsed;
+                    slice out(frameStart, maxSize);
                     WriteUVarInt(&out, msg->_number);
                     auto flagsPos = (FrameFlags*)out.buf;
                     out.moveStart(1);
+                    auto bodyPos = out.buf;
 
-                    // Ask the MessageOut to write data to fill the buffer:
-                    auto prevBytesSent = msg->_bytesSent;
-                    msg->nextFrameToSend(_outputCodec, out, frameFlags);
+                    // Ask the MessageOut to write data to fill the buffer. If it's uncompressed
+                    // it may instead return the body as a reference to its payload:
+                    websocket::MessageSegment bodyRef;
+                    msg->nextFrameToSend(_outputCodec, out, frameFlags, &bodyRef);
                     *flagsPos = frameFlags;
-                    slice frame(_frameBuf.get(), out.buf);
-                    bytesWritten += frame.size;
+                    slice frame(frameStart, out.buf);
+                    _batchBufUsed += frame.size;
+                    size_t frameSize = frame.size + bodyRef.data.size;
+                    if (bodyRef.data.buf) {
+                        // Frame is header + referenced body + checksum:
+                        _batch.emplace_back(slice(frameStart, bodyPos), false);
+                        bodyRef.endOfMessage = false;
+                        _batch.push_back(move(bodyRef));
+                        _batch.emplace_back(slice(bodyPos, out.buf));
+                    } else {
+                        _batch.emplace_back(frame);
+                    }
+                    bytesWritten += frameSize;
+                    _outbox.sent(msg, frameSize);
+                    if (!msg->isControl())
+                        _connection->_bytesSentByClass[msg->_trafficClass] += frameSize;
 
                     logVerbose("    Sending frame: %s #%llu %c%c%c%c, bytes %u--%u",
                                kMessageTypeNames[frameFlags & kTypeMask], msg->number(),
@@ -356,32 +809,122 @@ namespace litecore { namespace blip {
                                (frameFlags & kCompressed ? 'C' : '-'),
                                prevBytesSent, msg->_bytesSent - 1);
                     //logVerbose("    %s", frame.hexString().c_str());
-                    // Write it to the WebSocket:
-                    _writeable = _webSocket->send(frame);
+                    // Send the batch if it's full:
+                    _batchSize += frameSize;
+                    if (_batchSize >= kMaxBatchSize)
+                        flushBatch();
                 }
                 
                 // Return message to the queue if it has more frames left to send:
                 if (frameFlags & kMoreComing) {
-                    if (msg->needsAck())
+                    if (prevBytesSent == 0 && !msg->isControl())
+                        _outgoing.add(msg);
+                    if (msg->_rttProbeTime < 0) {
+                        // Time how long it takes for an ACK to cover this frame:
+                        msg->_rttProbeBytes = prevBytesSent;
+                        msg->_rttProbeTime = _timeOpen.elapsed();
+                    }
+                    if (msg->needsAck(_flowWindow.size())) {
+                        _flowWindow.exhausted(!_writeable);
+                        flowWindowChanged();
+                    }
+                    if (msg->needsAck(_flowWindow.size()) && !msg->failed())
                         freezeMessage(msg);
                     else
-                        requeue(msg);
+                        continueMessage(msg, false);
                 } else {
-                    if (!msg->isAck()) {
+                    if (!msg->isControl()) {
+                        if (prevBytesSent > 0)
+                            _outgoing.remove(msg);
                         logVerbose("Finished sending %s", msg->description().c_str());
                         // Add its response message to _pendingResponses:
                         MessageIn* response = msg->createResponse();
-                        if (response)
+                        if (response) {
                             _pendingResponses.emplace(response->number(), response);
+                            startResponseTimeout(msg);
+                        }
                     }
                 }
             }
+            flushBatch();
             _totalBytesWritten += bytesWritten;
+            publishFrameSizes();
             logVerbose("...Wrote %zu bytes to WebSocket (writeable=%d)",
                        bytesWritten, _writeable);
         }
 
 
+        /** Starts the clock on the response to a request that's just been sent, if it has a
+            timeout. The expiration times of all responses are kept in one priority queue, and
+            only the earliest has a delayed call scheduled. */
+        void startResponseTimeout(MessageOut *request) {
+            double timeout = _responseTimeout;
+            if (request->_responseTimeout.count() != 0)
+                timeout = request->_responseTimeout.count() / 1000.0;
+            if (timeout <= 0)
+                return;
+            double expiration = _timeOpen.elapsed() + timeout;
+            _responseTimeouts.emplace(expiration, request->number());
+            scheduleTimeoutCheck(expiration);
+        }
+
+
+        void scheduleTimeoutCheck(double when) {
+            if (_nextTimeoutCheck >= 0 && _nextTimeoutCheck <= when)
+                return;
+            _nextTimeoutCheck = when;
+            enqueueAfter(actor::delay_t(max(when - _timeOpen.elapsed(), 0.0)),
+                         &BLIPIO::_checkResponseTimeouts);
+        }
+
+
+        /** Gives up on responses that haven't completely arrived by their expiration times.
+            (Queue entries of responses that have already arrived are just skipped.) */
+        void _checkResponseTimeouts() {
+            _nextTimeoutCheck = -1;
+            double now = _timeOpen.elapsed();
+            while (!_responseTimeouts.empty() && _responseTimeouts.top().first <= now) {
+                MessageNo msgNo = _responseTimeouts.top().second;
+                _responseTimeouts.pop();
+                auto i = _pendingResponses.find(msgNo);
+                if (i == _pendingResponses.end() || i->second->_discarding)
+                    continue;
+                logInfo("Timed out waiting for response to REQ #%llu", msgNo);
+                Retained<MessageIn> response = i->second;
+                response->sendProgress(MessageProgress::kTimedOut,
+                                       response->_outgoingSize, 0, nullptr);
+                ignoreResponse(i);
+            }
+            if (!_responseTimeouts.empty())
+                scheduleTimeoutCheck(_responseTimeouts.top().first);
+        }
+
+
+        /** Stops waiting for a response. If it's begun to arrive, it's left in
+            _pendingResponses to read and drop the rest, since the codec state carries over to
+            later frames; otherwise its number is remembered, so that if it does arrive it's
+            recognized and dropped. */
+        void ignoreResponse(MessageMap::iterator i) {
+            if (i->second->_rawBytesReceived > 0) {
+                i->second->discard();
+            } else {
+                _ignoredResponses.insert(i->first);
+                _pendingResponses.erase(i);
+            }
+        }
+
+
+        /** Sends the frames collected by writeToWebSocket to the WebSocket. */
+        void flushBatch() {
+            if (_batch.empty())
+                return;
+            _writeable = _webSocket->sendBatch(_batch);
+            _frameSizer.wrote(_batchSize, !_writeable);
+            _batch.clear();
+            _batchSize = _batchBufUsed = 0;
+        }
+
+
 #pragma mark INCOMING:
 
         
@@ -424,6 +967,12 @@ namespace litecore { namespace blip {
                         case kAckResponseType:
                             receivedAck(msgNo, (type == kAckResponseType), payload);
                             break;
+                        case kCancelRequestType:
+                            receivedCancel(msgNo);
+                            break;
+                        case kCancelResponseType:
+                            receivedResponseCancel(msgNo);
+                            break;
                         default:
                             warn("  Unknown BLIP frame type received");
                             // For forward compatibility let's just ignore this instead of closing
@@ -431,11 +980,15 @@ namespace litecore { namespace blip {
                         }
                     }
                     
-                    // Append the frame to the message:
+                    // Append the frame to the message (first updating the ACK interval, which
+                    // it may be ACKed at):
                     if (msg) {
+                        if (_incomingFlow.received(payload.size, _timeOpen.elapsed()))
+                            ackIntervalChanged();
                         MessageIn::ReceiveState state;
                         try {
-                            state = msg->receivedFrame(_inputCodec, payload, flags);
+                            state = msg->receivedFrame(_inputCodec, payload, flags,
+                                                       _propertyDecoder.get());
                         } catch (...) {
                             // If this is the final frame, then msg may not be in either pending list
                             // anymore. But on an exception we need to call its progress handler to
@@ -476,17 +1029,13 @@ namespace litecore { namespace blip {
 
         /** Handle an incoming ACK message, by unfreezing the associated outgoing message. */
         void receivedAck(MessageNo msgNo, bool onResponse, slice body) {
-            // Find the MessageOut in either _outbox or _icebox:
-            bool frozen = false;
-            Retained<MessageOut> msg = _outbox.findMessage(msgNo, onResponse);
+            // Find the MessageOut in either _outbox or the icebox:
+            bool frozen;
+            Retained<MessageOut> msg = _outgoing.find(msgNo, onResponse, &frozen);
             if (!msg) {
-                msg = _icebox.findMessage(msgNo, onResponse);
-                if (!msg) {
-                    //logVerbose("Received ACK of non-current message (%s #%llu)",
-                    //      (onResponse ? "RES" : "REQ"), msgNo);
-                    return;
-                }
-                frozen = true;
+                //logVerbose("Received ACK of non-current message (%s #%llu)",
+                //      (onResponse ? "RES" : "REQ"), msgNo);
+                return;
             }
 
             // Acks have no checksum and don't go through the codec; just read the byte count:
@@ -496,8 +1045,95 @@ namespace litecore { namespace blip {
                 return;
             }
             
+            uint32_t unackedBytes = msg->_unackedBytes;
             msg->receivedAck(byteCount);
-            if (frozen && !msg->needsAck())
+            double rtt = -1, now = _timeOpen.elapsed();
+            if (msg->_rttProbeTime >= 0 && byteCount > msg->_rttProbeBytes) {
+                rtt = now - msg->_rttProbeTime;
+                msg->_rttProbeTime = -1;
+            }
+            _flowWindow.receivedAck(unackedBytes - msg->_unackedBytes, rtt, now);
+
+            // A newer peer follows the byte count with the interval between its ACKs:
+            uint32_t ackInterval;
+            if (ReadUVarInt32(&body, &ackInterval)) {
+                size_t oldWindow = _flowWindow.size();
+                _flowWindow.setPeerAckInterval(ackInterval);
+                flowWindowChanged();
+                if (!_peerAnnouncesAckInterval) {
+                    _peerAnnouncesAckInterval = true;
+                    ackIntervalChanged();
+                }
+                if (_flowWindow.size() > oldWindow)
+                    thawUnblockedMessages();
+            }
+
+            if (frozen && !msg->needsAck(_flowWindow.size()))
+                thawMessage(msg);
+        }
+
+
+        /** Handle an incoming cancel, by discarding the partly-received request. */
+        void receivedCancel(MessageNo msgNo) {
+            auto i = _pendingRequests.find(msgNo);
+            if (i == _pendingRequests.end())
+                return;     // It's already complete, so the cancel crossed its last frame
+            logInfo("Peer canceled REQ #%llu", msgNo);
+            Retained<MessageIn> msg = i->second;
+            _pendingRequests.erase(i);
+            _beganOn.erase(msgNo);
+            purgeWaiting(msg);
+            msg->disconnected();
+        }
+
+
+        /** Removes a request from the requests waiting for a worker, so it won't be handled. */
+        void purgeWaiting(MessageIn *request) {
+            auto i = _dispatching.find(request->profile().asString());
+            if (i == _dispatching.end())
+                return;
+            auto &waiting = i->second.waiting;
+            waiting.erase(remove_if(waiting.begin(), waiting.end(),
+                                    [=](const pair<Retained<MessageIn>, bool> &entry) {
+                                        return entry.first.get() == request;
+                                    }),
+                          waiting.end());
+            if (i->second.running == 0 && waiting.empty())
+                _dispatching.erase(i);
+        }
+
+
+        /** Handle an incoming response-cancel: the peer couldn't finish the response, and will
+            send another (normally an error) in its place, so start over with a new MessageIn. */
+        void receivedResponseCancel(MessageNo msgNo) {
+            auto i = _pendingResponses.find(msgNo);
+            if (i == _pendingResponses.end())
+                return;
+            logInfo("Peer abandoned RES #%llu; waiting for its replacement", msgNo);
+            Retained<MessageIn> old = i->second;
+            i->second = new MessageIn(_connection, (FrameFlags)kResponseType, msgNo,
+                                      old->_onProgress, old->_outgoingSize);
+            if (old->_discarding)
+                i->second->discard();
+        }
+
+
+        /** Sends the ACK an incoming message held back while its body sink was paused. */
+        void _acksResumed(Retained<MessageIn> msg) {
+            lock_guard<mutex> lock(msg->_receiveMutex);
+            if (!msg->_acksPaused && !msg->_complete && _connection)
+                msg->sendAckIfDue();
+        }
+
+
+        /** Thaws all frozen messages that the flow-control window now allows to send more. */
+        void thawUnblockedMessages() {
+            vector<Retained<MessageOut>> unblocked;
+            _outgoing.forEachFrozen([&](MessageOut *msg) {
+                if (!msg->needsAck(_flowWindow.size()))
+                    unblocked.emplace_back(msg);
+            });
+            for (auto &msg : unblocked)
                 thawMessage(msg);
         }
 
@@ -533,6 +1169,14 @@ namespace litecore { namespace blip {
                 msg = i->second;
                 if (!(flags & kMoreComing))
                     _pendingResponses.erase(i);
+            } else if (_ignoredResponses.erase(msgNo) > 0) {
+                // Response to a request that timed out or was canceled. It still has to be
+                // decoded, since the codec state carries over to later frames, but it's dropped:
+                logVerbose("Ignoring late response to REQ #%llu", msgNo);
+                msg = new MessageIn(_connection, flags, msgNo);
+                msg->discard();
+                if (flags & kMoreComing)
+                    _pendingResponses.emplace(msgNo, msg);
             } else {
                 throw runtime_error(format("BLIP protocol error: Bad incoming RES #%llu (%s)",
                        msgNo, (msgNo <= _lastMessageNo ? "no request waiting" : "too high")));
@@ -541,14 +1185,28 @@ namespace litecore { namespace blip {
         }
 
 
-        void cancelAll(MessageQueue &queue) {   // either _outbox or _icebox
+        void cancelAll(MessageQueue &queue) {   // _outbox
             if (!queue.empty())
                 logInfo("Notifying %zd outgoing messages they're canceled", queue.size());
-            for (auto &msg : queue)
+            queue.forEach([](MessageOut *msg) {
                 msg->disconnected();
+            });
             queue.clear();
         }
 
+        void cancelFrozen() {                   // the icebox, and parked messages
+            size_t count = _outgoing.frozenCount() + _outgoing.parkedCount();
+            if (count > 0)
+                logInfo("Notifying %zd outgoing messages they're canceled", count);
+            _outgoing.forEachFrozen([](MessageOut *msg) {
+                msg->disconnected();
+            });
+            _outgoing.forEachParked([](MessageOut *msg) {
+                msg->disconnected();
+            });
+            _outgoing.clear();
+        }
+
         void cancelAll(MessageMap &pending) {   // either _pendingResponses or _pendingRequests
             if (!pending.empty())
                 logInfo("Notifying %zd incoming messages they're canceled", pending.size());
@@ -561,11 +1219,30 @@ namespace litecore { namespace blip {
         void _setRequestHandler(std::string profile, bool atBeginning,
                                 Connection::RequestHandler handler)
         {
-            HandlerKey key{profile, atBeginning};
             if (handler)
-                _requestHandlers.emplace(key, handler);
+                _requestHandlers[atBeginning].set(slice(profile), Handler{handler, nullptr});
+            else
+                _requestHandlers[atBeginning].remove(slice(profile));
+        }
+
+
+        void _setAsyncRequestHandler(std::string profile, Connection::AsyncRequestHandler handler) {
+            if (handler)
+                _requestHandlers[false].set(slice(profile), Handler{nullptr, handler});
             else
-                _requestHandlers.erase(key);
+                _requestHandlers[false].remove(slice(profile));
+        }
+
+
+        void _setDispatchPolicy(Connection::DispatchPolicy policy) {
+            // Requests whose beginning has already been handled by a worker will still finish
+            // on that worker (see dispatchRequest), which _beganOn keeps alive till then.
+            _workers.clear();
+            for (unsigned i = 1; i <= policy.workers; ++i)
+                _workers.emplace_back(new RequestWorker(format("%s worker %u",
+                                                               actorName().c_str(), i)));
+            _profileLimits = move(policy.profileLimits);
+            _defaultLimit = policy.maxConcurrent;
         }
 
 
@@ -574,27 +1251,133 @@ namespace litecore { namespace blip {
         }
 
         void handleRequestReceived(MessageIn *request, MessageIn::ReceiveState state) {
+            if (state == MessageIn::kOther)
+                return;
+            bool beginning = (state == MessageIn::kBeginning);
+            if (request->_bodyLost) {
+                // Its body couldn't be stored (see MessageIn::spillBody):
+                if (!beginning) {
+                    request->respondWithError({"BLIP"_sl, 500, "couldn't store request body"_sl});
+                    _beganOn.erase(request->number());
+                }
+                return;
+            }
+            if (request->isExpired()) {
+                // The sender's deadline has passed, so the result would be useless:
+                if (!beginning) {
+                    logInfo("Not handling expired %s", request->description().c_str());
+                    request->respondWithError({"BLIP"_sl, 408, "request expired"_sl});
+                    _beganOn.erase(request->number());
+                }
+                return;
+            }
+            if (_workers.empty() && !_beganOn.count(request->number())) {
+                runHandler(findHandler(request, beginning), request, nullptr);
+                return;
+            }
+            // Hand the request to a worker, unless too many of its profile are running:
+            string profile = request->profile().asString();
+            ProfileDispatch &dispatch = _dispatching[profile];
+            if (dispatch.running < limitFor(profile))
+                dispatchRequest(profile, request, beginning);
+            else
+                dispatch.waiting.emplace_back(request, beginning);
+        }
+
+
+        /** Returns the handler for a request: the best route for its profile, if any, else
+            the delegate. */
+        const Handler& findHandler(MessageIn *request, bool beginning) {
+            const Handler *handler = _requestHandlers[beginning].find(request->profile());
+            return handler ? *handler : _delegateHandlers[beginning];
+        }
+
+
+        unsigned limitFor(const string &profile) const {
+            auto i = _profileLimits.find(profile);
+            unsigned limit = (i != _profileLimits.end()) ? i->second : _defaultLimit;
+            return limit ? limit : UINT_MAX;
+        }
+
+
+        /** Runs a request's handler on a worker. The worker is chosen by the request number;
+            but the call for a request's end goes to the worker its beginning went to, even if
+            the dispatch policy has changed since, so the two calls are made in order. */
+        void dispatchRequest(const string &profile, MessageIn *request, bool beginning) {
+            ++_dispatching[profile].running;
+            Handler handler = findHandler(request, beginning);
+            Retained<BLIPIO> self(this);
+            Retained<MessageIn> req(request);
+            Retained<RequestWorker> worker;
+            auto i = _beganOn.find(request->number());
+            if (i != _beganOn.end()) {
+                worker = move(i->second);
+                _beganOn.erase(i);
+            } else {
+                worker = _workers[request->number() % _workers.size()];
+            }
+            if (beginning)
+                _beganOn[request->number()] = worker;
+            worker->run([=]() {
+                self->runHandler(handler, req, [=]() {
+                    self->enqueue(&BLIPIO::_handlerFinished, profile);
+                });
+            });
+        }
+
+
+        /** Called when a worker's handler is done; lets the next waiting request run. */
+        void _handlerFinished(string profile) {
+            auto i = _dispatching.find(profile);
+            if (i == _dispatching.end())
+                return;     // (connection closed)
+            ProfileDispatch &dispatch = i->second;
+            --dispatch.running;
+            if (_workers.empty()) {
+                // The worker pool's been turned off, so handle any waiting requests here
+                // (except the ends of ones that began on a worker, which go back to it):
+                auto waiting = move(dispatch.waiting);
+                dispatch.waiting.clear();
+                for (auto &next : waiting) {
+                    if (_beganOn.count(next.first->number()))
+                        dispatchRequest(profile, next.first, next.second);
+                    else
+                        runHandler(findHandler(next.first, next.second), next.first, nullptr);
+                }
+            } else if (!dispatch.waiting.empty()) {
+                auto next = move(dispatch.waiting.front());
+                dispatch.waiting.pop_front();
+                dispatchRequest(profile, next.first, next.second);
+            }
+            if (dispatch.running == 0 && dispatch.waiting.empty())
+                _dispatching.erase(i);
+        }
+
+
+        /** Calls a handler, then calls `onFinished` (if non-null) when the handler returns or,
+            if it's asynchronous, when its result is ready. This may run on a worker's thread,
+            so it mustn't touch any BLIPIO state. */
+        void runHandler(const Handler &handler, Retained<MessageIn> request,
+                        function<void()> onFinished)
+        {
             try {
-                if (state == MessageIn::kOther)
+                if (handler.async) {
+                    actor::Async<bool> result = handler.async(request);
+                    result.wait([=](bool handled) {
+                        if (!handled)
+                            request->notHandled();
+                        if (onFinished)
+                            onFinished();
+                    });
                     return;
-                bool beginning = (state == MessageIn::kBeginning);
-                auto profile = request->property("Profile"_sl);
-                if (profile) {
-                    auto i = _requestHandlers.find({profile.asString(), beginning});
-                    if (i != _requestHandlers.end()) {
-                        i->second(request);
-                        return;
-                    }
                 }
-                // No handler; just pass it to the delegate:
-                if (beginning)
-                    _connection->delegate().onRequestBeginning(request);
-                else
-                    _connection->delegate().onRequestReceived(request);
+                handler.sync(request);
             } catch (...) {
                 logError("Caught exception thrown from BLIP request handler");
                 request->respondWithError({"BLIP"_sl, 501, "unexpected exception"_sl});
             }
+            if (onFinished)
+                onFinished();
         }
 
     }; // end of class BLIPIO
@@ -621,8 +1404,46 @@ namespace litecore { namespace blip {
         if (levelP.isInteger())
             _compressionLevel = (int8_t)levelP.asInt();
 
+        size_t minFrameSize = kDefaultMinFrameSize, maxFrameSize = kDefaultMaxFrameSize;
+        auto minP = options.get(kMinFrameSizeOption), maxP = options.get(kMaxFrameSizeOption);
+        if (minP.isInteger())
+            minFrameSize = (size_t)minP.asInt();
+        if (maxP.isInteger())
+            maxFrameSize = (size_t)maxP.asInt();
+
+        size_t minFlowWindow = kDefaultMinFlowWindow, maxFlowWindow = kDefaultMaxFlowWindow;
+        auto minWinP = options.get(kMinFlowWindowOption);
+        auto maxWinP = options.get(kMaxFlowWindowOption);
+        if (minWinP.isInteger())
+            minFlowWindow = (size_t)minWinP.asInt();
+        if (maxWinP.isInteger())
+            maxFlowWindow = (size_t)maxWinP.asInt();
+        _ackInterval = _announcedAckInterval = kIncomingAckThreshold;
+
+        double responseTimeout = 0;
+        auto timeoutP = options.get(kResponseTimeoutOption);
+        if (timeoutP.isInteger())
+            responseTimeout = timeoutP.asInt() / 1000.0;
+
+        auto spillP = options.get(kSpillThresholdOption);
+        if (spillP.isInteger())
+            _spillThreshold = (size_t)max(spillP.asInt(), (int64_t)0);
+        _spillDirectory = options.get(kSpillDirectoryOption).asString().asString();
+
+        auto dynamicP = options.get(kDynamicPropertyTableOption);
+        if (dynamicP)
+            _dynamicPropertyTable = dynamicP.asBool();
+
         // Now connect the websocket:
-        _io = new BLIPIO(this, webSocket, (Deflater::CompressionLevel)_compressionLevel);
+        _io = new BLIPIO(this, webSocket, (Deflater::CompressionLevel)_compressionLevel,
+                         minFrameSize, maxFrameSize, minFlowWindow, maxFlowWindow,
+                         responseTimeout);
+
+        // A server already knows what protocol it agreed to; a client finds out in
+        // gotHTTPResponse.
+        slice protocol = options.get(WebSocket::kProtocolsOption).asString();
+        if (_role == Role::Server && protocol == slice(kWSTokenizedProtocolName))
+            _io->usePropertyTokens(_dynamicPropertyTable);
     }
 
 
@@ -640,10 +1461,39 @@ namespace litecore { namespace blip {
 
 
     /** Public API to send a new request. */
-    void Connection::sendRequest(MessageBuilder &mb) {
+    RequestHandle Connection::sendRequest(MessageBuilder &mb) {
         Retained<MessageOut> message = new MessageOut(this, mb, 0);
         DebugAssert(message->type() == kRequestType);
         send(message);
+        return RequestHandle(this, message);
+    }
+
+
+    /** Public API to send a pre-encoded message as a new request. */
+    RequestHandle Connection::sendRequest(EncodedMessage *encoded,
+                                          MessageProgressCallback onProgress) {
+        Retained<MessageOut> message = new MessageOut(this, *encoded, 0, move(onProgress));
+        DebugAssert(message->type() == kRequestType);
+        send(message);
+        return RequestHandle(this, message);
+    }
+
+
+    void Connection::cancel(MessageOut *msg) {
+        _io->cancel(msg);
+    }
+
+
+    void Connection::acksResumed(MessageIn *msg) {
+        _io->acksResumed(msg);
+    }
+
+
+    void RequestHandle::cancel() {
+        if (_request) {
+            _connection->cancel((MessageOut*)_request.get());
+            _request = nullptr;
+        }
     }
 
 
@@ -651,6 +1501,19 @@ namespace litecore { namespace blip {
     void Connection::send(MessageOut *msg) {
         if (_compressionLevel == 0)
             msg->dontCompress();
+        if (!msg->isControl()) {
+            // Count the message as queued until it's sent (see MessageOut::dequeue):
+            size_t bytes = msg->unsentPayloadSize();
+            msg->queued(bytes);
+            bytes = (_queuedBytes += bytes);
+            size_t messages = ++_queuedMessages;
+            if (bytes >= _highBytes || messages >= _highMessages) {
+                _outboxFull = true;
+                // The I/O thread may have drained the outbox after the counts were updated
+                // but before the flag was set, in which case it didn't notify; check again:
+                notifyIfOutboxWritable();
+            }
+        }
         if (BLIPMessagesLog.effectiveLevel() <= LogLevel::Info) {
             stringstream dump;
             bool withBody = BLIPMessagesLog.willLog(LogLevel::Verbose);
@@ -662,12 +1525,59 @@ namespace litecore { namespace blip {
     }
 
 
+    void Connection::dequeued(size_t bytes, size_t messages) {
+        _queuedBytes -= bytes;
+        _queuedMessages -= messages;
+        notifyIfOutboxWritable();
+    }
+
+
+    /** If the outbox is full but has drained to its low watermarks, clears the flag and tells
+        the delegate. This is called from both send() and dequeued(); since each updates its
+        side (the flag or the counts) before checking the other, at least one of them sees the
+        outbox writable, and the exchange makes sure only one notifies. */
+    void Connection::notifyIfOutboxWritable() {
+        if (_outboxFull && _queuedBytes <= _lowBytes && _queuedMessages <= _lowMessages) {
+            if (_outboxFull.exchange(false))
+                delegate().onOutboxWritable();
+        }
+    }
+
+
+    void Connection::setOutboxWatermarks(const OutboxWatermarks &w) {
+        _highBytes = w.highBytes;
+        _lowBytes = min(w.lowBytes, w.highBytes);
+        _highMessages = w.highMessages;
+        _lowMessages = min(w.lowMessages, w.highMessages);
+    }
+
+
     void Connection::setRequestHandler(string profile, bool atBeginning, RequestHandler handler) {
         _io->setRequestHandler(profile, atBeginning, handler);
     }
 
 
+    void Connection::setAsyncRequestHandler(string profile, AsyncRequestHandler handler) {
+        _io->setAsyncRequestHandler(profile, handler);
+    }
+
+
+    void Connection::setDispatchPolicy(const DispatchPolicy &policy) {
+        _io->setDispatchPolicy(policy);
+    }
+
+
+    void Connection::setSchedulingPolicy(const SchedulingPolicy &policy) {
+        _io->setSchedulingPolicy(policy);
+    }
+
+
     void Connection::gotHTTPResponse(int status, const fleece::AllocedDict &headers) {
+        if (status == 101 || status == 200) {
+            slice protocol = headers.get("Sec-WebSocket-Protocol"_sl).asString();
+            if (protocol == slice(kWSTokenizedProtocolName))
+                _io->usePropertyTokens(_dynamicPropertyTable);
+        }
         delegate().onHTTPResponse(status, headers);
     }
 
@@ -700,4 +1610,94 @@ namespace litecore { namespace blip {
         return _io->webSocket();
     }
 
+
+#pragma mark - BROADCAST:
+
+
+    // Tracks one Connection's copy of a broadcast message. It's owned by the copy's progress
+    // callback, so if the callback is freed without the message reaching a final state
+    // (because it was canceled, or its Connection went away), it's counted as failed then.
+    class Broadcast::Copy {
+    public:
+        explicit Copy(Broadcast *broadcast)
+        :_broadcast(broadcast)
+        { }
+
+        ~Copy() {
+            finish(false);
+        }
+
+        void progress(const MessageProgress &progress) {
+            switch (progress.state) {
+                case MessageProgress::kComplete:
+                    finish(true);
+                    break;
+                case MessageProgress::kDisconnected:
+                case MessageProgress::kExpired:
+                case MessageProgress::kTimedOut:
+                case MessageProgress::kFailed:
+                    finish(false);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+    private:
+        void finish(bool delivered) {
+            if (!_finished.exchange(true))
+                _broadcast->finished(delivered);
+        }
+
+        Retained<Broadcast> _broadcast;
+        std::atomic<bool> _finished {false};
+    };
+
+
+    Retained<Broadcast> Broadcast::send(const vector<Retained<Connection>> &connections,
+                                        EncodedMessage *message,
+                                        CompletionCallback onComplete)
+    {
+        Retained<Broadcast> broadcast = new Broadcast(connections.size(), move(onComplete));
+        broadcast->_handles.reserve(connections.size());
+        for (auto &connection : connections) {
+            auto copy = make_shared<Copy>(broadcast);
+            RequestHandle handle = connection->sendRequest(message,
+                                                           [copy](const MessageProgress &p) {
+                copy->progress(p);
+            });
+            // The handles keep the copies' callbacks, and so the Broadcast, alive; so they're
+            // only kept until every copy is done (see finished()):
+            lock_guard<mutex> lock(broadcast->_mutex);
+            if (!broadcast->done())
+                broadcast->_handles.push_back(move(handle));
+        }
+        if (connections.empty() && broadcast->_onComplete)
+            broadcast->_onComplete(0, 0);
+        return broadcast;
+    }
+
+
+    void Broadcast::cancel() {
+        vector<RequestHandle> handles;
+        {
+            lock_guard<mutex> lock(_mutex);
+            handles.swap(_handles);
+        }
+        for (auto &handle : handles)
+            handle.cancel();
+    }
+
+
+    void Broadcast::finished(bool delivered) {
+        ++(delivered ? _delivered : _failed);
+        if (--_remaining == 0) {
+            if (_onComplete)
+                _onComplete(_delivered, _failed);
+            vector<RequestHandle> handles;
+            lock_guard<mutex> lock(_mutex);
+            handles.swap(_handles);
+        }
+    }
+
 } }
@@ -18,9 +18,17 @@
 
 #pragma once
 #include "Logging.hh"
+#include <stdint.h>
 
 namespace litecore { namespace blip {
 
     extern LogDomain BLIPLog;
+
+    /** Number of bytes of a message received between ACKs, until the peer is known to
+        understand the ACK interval announced in ACK frames. */
+    static const uint32_t kIncomingAckThreshold = 50000;
+
+    /** Property containing a message's deadline, in milliseconds since the Unix epoch. */
+    static constexpr const char *kDeadlineProperty = "Deadline";
     
 } }
@@ -21,11 +21,15 @@
 #include "BLIPConnection.hh"
 #include "BLIPInternal.hh"
 #include "Codec.hh"
+#include "MappedFile.hh"
+#include "PropertyCodec.hh"
 #include "fleece/Fleece.hh"
 #include "StringUtil.hh"
 #include "varint.hh"
 #include <algorithm>
 #include <assert.h>
+#include <climits>
+#include <string.h>
 #include <sstream>
 
 #include <iostream>
@@ -35,9 +39,8 @@ using namespace fleece;
 
 namespace litecore { namespace blip {
 
-
-    // How many bytes to receive before sending an ACK
-    static const size_t kIncomingAckThreshold = 50000;
+    // Once a body is spilling to disk, how much of it to buffer between writes to the file
+    static const size_t kSpillBufferSize = 64 * 1024;
 
 
     void Message::sendProgress(MessageProgress::State state,
@@ -97,10 +100,11 @@ namespace litecore { namespace blip {
                     break;  // illegal: missing value
                 auto endOfVal = val + strlen(val);
 
+                char buf[TypedValue::kMaxTextSize];
                 out << "\n\t";
                 dumpSlice(out, {key, endOfKey});
                 out << ": ";
-                dumpSlice(out, {val, endOfVal});
+                dumpSlice(out, TypedValue::text({val, endOfVal}, buf));
                 key = endOfVal + 1;
             }
             if (body.size > 0) {
@@ -112,19 +116,100 @@ namespace litecore { namespace blip {
     }
 
 
-    const char* Message::findProperty(slice payload, const char *propertyName) {
-        auto key = (const char*)payload.buf;
-        auto end = (const char*)payload.end();
+    // Calls `fn(name, value)` for each property, in order, until it returns true; returns the
+    // value it stopped at, or a null slice. (memchr finds the NULs faster than strlen would, since
+    // it knows where the data ends.)
+    template <class FN>
+    static slice scanProperties(slice properties, FN fn) {
+        auto key = (const char*)properties.buf;
+        auto end = (const char*)properties.end();
         while (key < end) {
-            auto endOfKey = key + strlen(key);
-            auto val = endOfKey + 1;
-            if (val >= end)
+            auto endOfKey = (const char*)memchr(key, 0, end - key);
+            if (!endOfKey || endOfKey + 1 >= end)
                 break;  // illegal: missing value
-            if (0 == strcmp(key, propertyName))
-                return val;
-            key = val + strlen(val) + 1;
+            auto val = endOfKey + 1;
+            auto endOfVal = (const char*)memchr(val, 0, end - val);
+            if (!endOfVal)
+                break;  // illegal: unterminated value
+            if (fn(slice(key, endOfKey), slice(val, endOfVal)))
+                return slice(val, endOfVal);
+            key = endOfVal + 1;
+        }
+        return nullslice;
+    }
+
+
+    const char* Message::findProperty(slice payload, const char *propertyName) {
+        slice name(propertyName);
+        return (const char*)scanProperties(payload, [&](slice key, slice) {
+            return key == name;
+        }).buf;
+    }
+
+
+#pragma mark - PROPERTY INDEX:
+
+
+    // FNV-1a hash of a property name.
+    static uint32_t hashName(slice name) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < name.size; ++i)
+            hash = (hash ^ name[i]) * 16777619u;
+        return hash;
+    }
+
+
+    bool PropertyIndex::build(slice properties) {
+        _entries.clear();
+        auto start = (const char*)properties.buf;
+        const char *next = start;
+        scanProperties(properties, [&](slice key, slice value) {
+            auto name = (const char*)key.buf;
+            auto val = (const char*)value.buf;
+            _entries.push_back({uint32_t(name - start), uint32_t(val - start),
+                                uint32_t(val + value.size - start), hashName(key)});
+            next = val + value.size + 1;
+            return false;
+        });
+        return next == (const char*)properties.end();
+    }
+
+
+    slice PropertyIndex::find(slice properties, slice name) const {
+        auto start = (const char*)properties.buf;
+        uint32_t hash = hashName(name);
+        for (auto &e : _entries) {
+            // (The name ends just before the value starts.)
+            if (e.hash == hash && e.value - 1 - e.name == name.size
+                    && memcmp(start + e.name, name.buf, name.size) == 0)
+                return slice(start + e.value, start + e.end);
         }
-        return nullptr;
+        return nullslice;
+    }
+
+
+    // Parses a decimal integer, with an optional sign, that's the entire contents of `str`.
+    // (Unlike strtol, this doesn't need a NUL-terminated copy of the string.)
+    static bool parseInteger(slice str, int64_t &result) {
+        auto c = (const char*)str.buf, end = c + str.size;
+        bool negative = (c < end && *c == '-');
+        if (c < end && (*c == '-' || *c == '+'))
+            ++c;
+        if (c == end)
+            return false;
+        uint64_t n = 0;
+        for (; c < end; ++c) {
+            if (*c < '0' || *c > '9')
+                return false;
+            unsigned digit = *c - '0';
+            if (n > (UINT64_MAX - digit) / 10)
+                return false;
+            n = n * 10 + digit;
+        }
+        if (n > uint64_t(INT64_MAX) + negative)
+            return false;
+        result = negative ? -int64_t(n - 1) - 1 : int64_t(n);
+        return true;
     }
 
 
@@ -147,17 +232,21 @@ namespace litecore { namespace blip {
 
     MessageIn::ReceiveState MessageIn::receivedFrame(Codec &codec,
                                                      slice frame,
-                                                     FrameFlags frameFlags)
+                                                     FrameFlags frameFlags,
+                                                     PropertyDecoder *propertyDecoder)
     {
         ReceiveState state = kOther;
         MessageSize bodyBytesReceived;
+        auto frameSize = (uint32_t)frame.size;
+        BodySink sink;
+        Retained<MappedFile> sinkBacklog;
+        alloc_slice sinkData;
         {
             // First, lock the mutex:
             lock_guard<mutex> lock(_receiveMutex);
 
-            // Update byte count and send acknowledgement packet when appropriate:
+            // Update byte count. (The frame is ACKed at the end, after the sink's seen it.)
             _rawBytesReceived += frame.size;
-            acknowledge((uint32_t)frame.size);
 
             auto mode = (frameFlags & kCompressed) ? Codec::Mode::SyncFlush : Codec::Mode::Raw;
 
@@ -177,7 +266,8 @@ namespace litecore { namespace blip {
             }
 
             bool justFinishedProperties = false;
-            if (!_in) {
+            bool firstFrame = !_in;
+            if (firstFrame) {
                 // First frame!
                 // Update my flags and allocate the Writer:
                 DebugAssert(_number > 0);
@@ -203,7 +293,7 @@ namespace litecore { namespace blip {
                     justFinishedProperties = true;
                 // And anything left over after that becomes the start of the body:
                 if (dst.size > 0)
-                    _in->writeRaw(dst);
+                    writeBody(dst);
             }
 
             if (_propertiesRemaining.size > 0) {
@@ -216,13 +306,15 @@ namespace litecore { namespace blip {
                 // Finished reading properties:
                 if (_propertiesSize > 0 && _properties[_propertiesSize - 1] != 0)
                     throw std::runtime_error("message properties not null-terminated");
-#if DEBUG
-                int nulls = 0;
-                for (size_t i = 0; i < _propertiesSize; ++i)
-                    if (_properties[i] == 0)
-                        ++nulls;
-                DebugAssert((nulls & 1) == 0);
-#endif
+                if (propertyDecoder)
+                    propertyDecoder->decode(_properties, firstFrame);
+                else
+                    PropertyDecoder::decodePlain(_properties);
+                _propertiesSize = (uint32_t)_properties.size;
+                if (!_propertyIndex.build(_properties))
+                    throw std::runtime_error("message properties malformed");
+                formatTypedProperties();
+                _profile = property("Profile"_sl);
                 if (_connection->willLog(LogLevel::Verbose))
                     _connection->_logVerbose("Receiving %s", description().c_str());
 
@@ -238,15 +330,25 @@ namespace litecore { namespace blip {
             slice checksumSlice{checksum, Codec::kChecksumSize};
             codec.readAndVerifyChecksum(checksumSlice);
 
-            bodyBytesReceived = _in->bytesWritten();
+            bodyBytesReceived = _bodyBytesReceived;
+
+            // Take the frame's body data for the sink, which is called after the mutex is
+            // unlocked, so it can call pauseAcks():
+            if (_bodySink && !_discarding) {
+                sink = _bodySink;
+                sinkBacklog = move(_sinkBacklog);
+                sinkData = takeBufferedBody();
+            }
 
             if (!(frameFlags & kMoreComing)) {
                 // Completed!
                 if (_propertiesRemaining.size > 0)
                     throw std::runtime_error("message ends before end of properties");
-                _body = _in->finish();
+                if (!_bodySink)
+                    finishBody();
                 _in.reset();
                 _complete = true;
+                _bodySink = nullptr;
 
                 if (_connection->willLog(LogLevel::Verbose))
                     _connection->_logVerbose("Finished receiving %s", description().c_str());
@@ -255,6 +357,30 @@ namespace litecore { namespace blip {
         }
         // ...mutex is now unlocked
 
+        if (sink) {
+            if (sinkBacklog)
+                sink(sinkBacklog->contents(), false);
+            if (sinkData.size > 0)
+                sink(sinkData, false);
+            if (state == kEnd)
+                sink(nullslice, true);
+        }
+
+        {
+            // Now ACK the frame, unless the sink has paused ACKs to hold back the sender:
+            lock_guard<mutex> lock(_receiveMutex);
+            acknowledge(frameSize);
+        }
+
+        if (state == kEnd && _bodyLost) {
+            // A reply whose body couldn't be stored fails. (A request gets an error response
+            // instead of a handler; see BLIPIO::handleRequestReceived.)
+            if (_onProgress)
+                _onProgress({MessageProgress::kFailed, _outgoingSize, bodyBytesReceived, nullptr,
+                             Error("BLIP"_sl, 500, "couldn't store message body"_sl)});
+            return state;
+        }
+
         // Send progress. ("kReceivingReply" is somewhat misleading if this isn't a reply.)
         // Include a pointer to myself when my properties are available, _unless_ I'm an
         // incomplete error. (We need the error body first since it contains the message.)
@@ -268,11 +394,26 @@ namespace litecore { namespace blip {
 
     void MessageIn::acknowledge(uint32_t frameSize) {
         _unackedBytes += frameSize;
-        if (_unackedBytes >= kIncomingAckThreshold) {
-            // Send an ACK after enough data has been received of this message:
+        if (!_acksPaused)
+            sendAckIfDue();
+    }
+
+
+    // Sends an ACK if enough of the message has arrived since the last one. (Called on the
+    // BLIPIO thread, with _receiveMutex locked.)
+    void MessageIn::sendAckIfDue() {
+        // The peer's flow-control window is only guaranteed to cover the ACK interval that was
+        // last announced to it, so don't wait longer than that:
+        uint32_t ackInterval = _connection->_ackInterval;
+        if (_unackedBytes >= min(ackInterval, _connection->_announcedAckInterval)) {
+            // Send an ACK after enough data has been received of this message. After the byte
+            // count comes the interval at which future ACKs will be sent:
             MessageType msgType = isResponse() ? kAckResponseType : kAckRequestType;
-            uint8_t buf[kMaxVarintLen64];
-            alloc_slice payload(buf, PutUVarInt(buf, _rawBytesReceived));
+            uint8_t buf[2 * kMaxVarintLen64];
+            size_t size = PutUVarInt(buf, _rawBytesReceived);
+            size += PutUVarInt(buf + size, ackInterval);
+            alloc_slice payload(buf, size);
+            _connection->_announcedAckInterval = ackInterval;
             Retained<MessageOut> ack = new MessageOut(_connection,
                                                       (FrameFlags)(msgType | kUrgent | kNoReply),
                                                       payload,
@@ -290,8 +431,151 @@ namespace litecore { namespace blip {
             slice output {buffer, sizeof(buffer)};
             codec.write(frame, output, Codec::Mode(mode));
             if (output.buf > buffer)
-                _in->writeRaw(slice(buffer, output.buf));
+                writeBody(slice(buffer, output.buf));
+        }
+    }
+
+
+    // Adds decoded body data to _in. If there's a sink, receivedFrame passes it on at the end of
+    // the frame; otherwise, once the body has outgrown the Connection's spill threshold, _in
+    // becomes a buffer for the file.
+    void MessageIn::writeBody(slice data) {
+        _bodyBytesReceived += data.size;
+        if (_discarding)
+            return;
+        _in->writeRaw(data);
+        _bufferedBodySize += data.size;
+        if (_bodySink) {
+            return;
+        } else if (_spillFile) {
+            if (_bufferedBodySize >= kSpillBufferSize)
+                spillBody();
+        } else {
+            size_t threshold = _connection->_spillThreshold;
+            if (threshold > 0 && _bufferedBodySize > threshold && !_spillFailed)
+                spillBody();
+        }
+    }
+
+
+    // Removes and returns the body data buffered in _in.
+    alloc_slice MessageIn::takeBufferedBody() {
+        if (!_in || _bufferedBodySize == 0)
+            return nullslice;
+        alloc_slice data = _in->finish();
+        _in->reset();
+        _bufferedBodySize = 0;
+        return data;
+    }
+
+
+    // Moves the body data buffered in _in to the temporary file, creating it if necessary.
+    void MessageIn::spillBody() {
+        if (!_spillFile) {
+            try {
+                _spillFile.reset(new TemporaryFile(_connection->_spillDirectory));
+            } catch (const exception &x) {
+                // Can't spill, so keep the body in memory after all:
+                _connection->warn("Can't spill body of %s to disk: %s",
+                                  description().c_str(), x.what());
+                _spillFailed = true;
+                return;
+            }
+            _connection->_logVerbose("Spilling body of %s to disk", description().c_str());
+        }
+        try {
+            _spillFile->write(_in->finish());
+        } catch (const exception &x) {
+            // The body's incomplete, so the message fails; but only this message, not the
+            // connection. The rest of its frames are read and dropped:
+            _connection->warn("Can't write body of %s to disk: %s",
+                              description().c_str(), x.what());
+            _bodyLost = true;
+            _discarding = true;
+            _spillFile.reset();
+        }
+        _in->reset();
+        _bufferedBodySize = 0;
+    }
+
+
+    // Called when the last frame has arrived: sets either _body or _mappedBody.
+    void MessageIn::finishBody() {
+        if (_bodyLost) {
+            _in.reset();
+        } else if (_spillFile) {
+            spillBody();
+            _mappedBody = _spillFile->map();
+            _spillFile.reset();
+        } else {
+            _body = _in->finish();
         }
+        _bufferedBodySize = 0;
+    }
+
+
+    void MessageIn::setBodySink(BodySink sink) {
+        Retained<MappedFile> spilled;
+        alloc_slice pending;
+        {
+            lock_guard<mutex> lock(_receiveMutex);
+            // Whatever part of the body has already arrived goes to the sink first. If more is
+            // coming, receivedFrame passes it along with the next frame's data, so that the sink
+            // gets everything in order on the I/O thread:
+            if (_spillFile) {
+                spillBody();
+                spilled = _spillFile->map();
+                _spillFile.reset();
+            }
+            if (!_complete) {
+                _sinkBacklog = spilled;
+                _bodySink = move(sink);
+                return;
+            }
+            spilled = _mappedBody;
+            _mappedBody = nullptr;
+            pending = _body;
+            _body = nullslice;
+        }
+        // The message is complete, so nothing else will call the sink:
+        if (spilled)
+            sink(spilled->contents(), false);
+        if (pending.size > 0)
+            sink(pending, false);
+        sink(nullslice, true);
+    }
+
+
+    void MessageIn::pauseAcks() {
+        lock_guard<mutex> lock(_receiveMutex);
+        _acksPaused = true;
+    }
+
+
+    void MessageIn::resumeAcks() {
+        {
+            lock_guard<mutex> lock(_receiveMutex);
+            if (!_acksPaused)
+                return;
+            _acksPaused = false;
+        }
+        // The ACK that's now due has to be sent from the I/O thread:
+        _connection->acksResumed(this);
+    }
+
+
+    // Called on a response whose request has been canceled or has timed out. The remaining
+    // frames still have to be decoded, since the codec's state carries over to the next message,
+    // and ACKed, so the peer can finish sending; but their data and the body so far are dropped.
+    void MessageIn::discard() {
+        lock_guard<mutex> lock(_receiveMutex);
+        _onProgress = nullptr;
+        _discarding = true;
+        _spillFile.reset();
+        _sinkBacklog = nullptr;
+        _bufferedBodySize = 0;
+        if (_in)
+            _in.reset(new fleece::JSONEncoder);
     }
 
 
@@ -316,10 +600,18 @@ namespace litecore { namespace blip {
     }
 
 
+    Retained<MappedFile> MessageIn::mappedBody() const {
+        lock_guard<mutex> lock(const_cast<MessageIn*>(this)->_receiveMutex);
+        return _mappedBody;
+    }
+
+
     fleece::Value MessageIn::JSONBody() {
         lock_guard<mutex> lock(_receiveMutex);
-        if (!_bodyAsFleece)
-            _bodyAsFleece = FLData_ConvertJSON({_body.buf, _body.size}, nullptr);
+        if (!_bodyAsFleece) {
+            slice json = _mappedBody ? _mappedBody->contents() : slice(_body);
+            _bodyAsFleece = FLData_ConvertJSON({json.buf, json.size}, nullptr);
+        }
         return fleece::Value::fromData(_bodyAsFleece);
     }
 
@@ -329,9 +621,10 @@ namespace litecore { namespace blip {
         alloc_slice body = _body;
         if (body) {
             _body = nullslice;
-        } else if (_in) {
+        } else if (_in && !_spillFile) {
             body = _in->finish();
             _in->reset();
+            _bufferedBodySize = 0;
         }
         return body;
     }
@@ -377,47 +670,118 @@ namespace litecore { namespace blip {
 #pragma mark - PROPERTIES:
 
 
+    // (The index is empty until all the properties have arrived, so this returns null until
+    // then.)
     slice MessageIn::property(slice property) const {
-        // Note: using strlen here is safe. It can't fall off the end of _properties, because the
-        // receivedFrame() method has already verified that _properties ends with a zero byte.
-        // OPT: This lookup isn't very efficient. If it turns out to be a hot-spot, we could cache
-        // the starting point of every property string.
-        auto key = (const char*)_properties.buf;
-        auto end = (const char*)_properties.end();
-        while (key < end) {
-            auto endOfKey = key + strlen(key);
-            auto val = endOfKey + 1;
-            if (val >= end)
-                break;  // illegal: missing value
-            auto endOfVal = val + strlen(val);
-            if (property == slice(key, endOfKey))
-                return slice(val, endOfVal);
-            key = endOfVal + 1;
+        slice value = _propertyIndex.find(_properties, property);
+        if (TypedValue::isTyped(value))
+            return formattedProperty(value);
+        return TypedValue::unescape(value);
+    }
+
+
+    // Returns the text form of a typed value, formatting it the first time it's asked for.
+    // Formats all the integer and boolean property values as text, into one buffer, so that
+    // property() can return them without allocating or locking. Called once the properties
+    // have arrived.
+    void MessageIn::formatTypedProperties() {
+        char buf[TypedValue::kMaxTextSize];
+        size_t count = 0, size = 0;
+        scanProperties(_properties, [&](slice, slice value) {
+            if (TypedValue::isTyped(value)) {
+                ++count;
+                size += TypedValue::text(value, buf).size;
+            }
+            return false;
+        });
+        if (count == 0)
+            return;
+        _formattedValues.reset(size);
+        _formattedProperties.reserve(count);
+        auto dst = (char*)_formattedValues.buf;
+        scanProperties(_properties, [&](slice, slice value) {
+            if (TypedValue::isTyped(value)) {
+                slice text = TypedValue::text(value, buf);
+                memcpy(dst, text.buf, text.size);
+                _formattedProperties.emplace_back(value.buf, slice(dst, text.size));
+                dst += text.size;
+            }
+            return false;
+        });
+    }
+
+
+    slice MessageIn::formattedProperty(slice value) const {
+        for (auto &f : _formattedProperties) {
+            if (f.first == value.buf)
+                return f.second;
         }
         return nullslice;
     }
 
 
+    // Gets an integer property, either typed or in decimal.
+    bool MessageIn::integerProperty(slice name, int64_t &result) const {
+        slice value = _propertyIndex.find(_properties, name);
+        return TypedValue::readInteger(value, result) || parseInteger(value, result);
+    }
+
+
     long MessageIn::intProperty(slice name, long defaultValue) const {
-        string value = property(name).asString();
-        if (value.empty())
-            return defaultValue;
-        char *end;
-        long result = strtol(value.c_str(), &end, 10);
-        if (*end != '\0')
+        int64_t result;
+        if (!integerProperty(name, result))
             return defaultValue;
-        return result;
+        return (long)max(min(result, (int64_t)LONG_MAX), (int64_t)LONG_MIN);
     }
 
 
     bool MessageIn::boolProperty(slice name, bool defaultValue) const {
-        slice value = property(name);
-        if (value.caseEquivalent("true"_sl) || value.caseEquivalent("YES"_sl))
+        slice value = _propertyIndex.find(_properties, name);
+        int64_t n;
+        if (TypedValue::readInteger(value, n))
+            return n != 0;
+        else if (value.caseEquivalent("true"_sl) || value.caseEquivalent("YES"_sl))
             return true;
         else if (value.caseEquivalent("false"_sl) || value.caseEquivalent("NO"_sl))
             return false;
+        else if (parseInteger(value, n))
+            return n != 0;
         else
-            return intProperty(name, defaultValue) != 0;
+            return defaultValue;
+    }
+
+
+    int MessageIn::enumProperty(slice name, initializer_list<slice> values,
+                                int defaultValue) const
+    {
+        slice value = property(name);
+        if (value.buf) {
+            int i = 0;
+            for (slice v : values) {
+                if (v == value)
+                    return i;
+                ++i;
+            }
+        }
+        return defaultValue;
+    }
+
+
+    Deadline MessageIn::deadline() const {
+        // The peer chooses the value, so check that it's in the range of Deadline before
+        // converting it, which could otherwise overflow. One that isn't means no deadline.
+        static const int64_t kMaxMillis =
+            chrono::duration_cast<chrono::milliseconds>(Deadline::duration::max()).count();
+        int64_t ms;
+        if (!integerProperty(slice(kDeadlineProperty), ms) || ms <= 0 || ms > kMaxMillis)
+            return Deadline();
+        return Deadline(chrono::milliseconds(ms));
+    }
+
+
+    bool MessageIn::isExpired() const {
+        Deadline d = deadline();
+        return d != Deadline() && d < chrono::system_clock::now();
     }
 
     
@@ -19,11 +19,14 @@
 #include "MessageBuilder.hh"
 #include "BLIPInternal.hh"
 #include "Codec.hh"
+#include "MappedFile.hh"
+#include "PropertyCodec.hh"
 #include "Error.hh"
 #include "Logging.hh"
 #include "StringUtil.hh"
 #include "varint.hh"
-#include <ostream>
+#include <algorithm>
+#include <string.h>
 
 using namespace std;
 using namespace fleece;
@@ -32,8 +35,21 @@ namespace litecore { namespace blip {
 
 #pragma mark - MESSAGE BUILDER:
 
+
+    // Initial size of the buffer a new MessageBuilder allocates
+    static constexpr size_t kInitialCapacity = 256;
+
+    // Largest buffer size a MessageBuilder carries over from one message to the next; a big
+    // message shouldn't make every later small one allocate as much
+    static constexpr size_t kMaxCapacityHint = 4096;
+
+    // Bytes reserved at the start of the buffer for the properties size. Most properties are
+    // shorter than 128 bytes, whose size fits in 1 byte; otherwise they're moved to make room.
+    static constexpr size_t kPropertiesSizeReserve = 1;
+
     
     MessageBuilder::MessageBuilder(slice profile)
+    :_capacityHint(kInitialCapacity)
     {
         if (profile)
             addProperty("Profile"_sl, profile);
@@ -49,6 +65,10 @@ namespace litecore { namespace blip {
     }
 
 
+    MessageBuilder::~MessageBuilder()
+    { }
+
+
     MessageBuilder::MessageBuilder(initializer_list<property> properties)
     :MessageBuilder()
     {
@@ -72,6 +92,16 @@ namespace litecore { namespace blip {
     }
 
 
+    MessageBuilder& MessageBuilder::setDeadline(Deadline d, bool asProperty) {
+        deadline = d;
+        if (asProperty) {
+            auto ms = chrono::duration_cast<chrono::milliseconds>(d.time_since_epoch());
+            addProperty(slice(kDeadlineProperty), (int64_t)ms.count());
+        }
+        return *this;
+    }
+
+
     FrameFlags MessageBuilder::flags() const {
         int flags = type & kTypeMask;
         if (urgent)     flags |= kUrgent;
@@ -81,63 +111,329 @@ namespace litecore { namespace blip {
     }
 
 
-    // Abbreviates certain special strings as a single byte
-    void MessageBuilder::writeTokenizedString(ostream &out, slice str) {
+    // Makes room for `extra` more bytes in _buffer, growing it if necessary. The first call
+    // also reserves the space for the properties size.
+    void MessageBuilder::reserve(size_t extra) {
+        if (_size == 0)
+            _size = kPropertiesSizeReserve;
+        size_t needed = _size + extra;
+        if (needed <= _buffer.size)
+            return;
+        size_t capacity = max(needed, _buffer.size ? 2 * _buffer.size : _capacityHint);
+        if (_buffer)
+            _buffer.resize(capacity);           // (copies the contents to a new buffer)
+        else
+            _buffer.reset(capacity);
+    }
+
+
+    void MessageBuilder::append(slice data) {
+        reserve(data.size);
+        memcpy((uint8_t*)_buffer.buf + _size, data.buf, data.size);
+        _size += data.size;
+    }
+
+
+    // Writes a property string. (The strings aren't abbreviated here, since that depends on the
+    // peer; BLIPIO tokenizes them with a PropertyEncoder when the message is sent.)
+    void MessageBuilder::writeTokenizedString(slice str) {
         Assert(str.findByte('\0') == nullptr);
-        out << str << '\0';
+        reserve(str.size + 1);
+        auto dst = (uint8_t*)_buffer.buf + _size;
+        memcpy(dst, str.buf, str.size);
+        dst[str.size] = 0;
+        _size += str.size + 1;
+    }
+
+
+    // Writes a typed value (see TypedValue.)
+    void MessageBuilder::writeTypedValue(slice value) {
+        writeTokenizedString(value);
     }
 
 
     MessageBuilder& MessageBuilder::addProperty(slice name, slice value) {
         DebugAssert(!_wroteProperties);
-        writeTokenizedString(_properties, name);
-        writeTokenizedString(_properties, value);
+        writeTokenizedString(name);
+        if (TypedValue::needsEscape(value)) {
+            uint8_t escape = PropertyTable::kEscapeToken;
+            append(slice(&escape, 1));
+        }
+        writeTokenizedString(value);
         return *this;
     }
 
 
     MessageBuilder& MessageBuilder::addProperty(slice name, int64_t value) {
-        char valueStr[30];
-        return addProperty(name, slice(valueStr, sprintf(valueStr, "%lld", (long long)value)));
+        DebugAssert(!_wroteProperties);
+        writeTokenizedString(name);
+        char buf[TypedValue::kMaxSize];
+        writeTypedValue(slice(buf, TypedValue::encodeInteger(value, buf)));
+        return *this;
     }
 
 
+    MessageBuilder& MessageBuilder::addBoolProperty(slice name, bool value) {
+        DebugAssert(!_wroteProperties);
+        writeTokenizedString(name);
+        char buf[TypedValue::kMaxSize];
+        writeTypedValue(slice(buf, TypedValue::encodeBool(value, buf)));
+        return *this;
+    }
+
+
+    // Fills in the properties size at the start of the buffer, moving the properties if it
+    // takes up more than the space reserved for it.
     void MessageBuilder::finishProperties() {
-        if (!_wroteProperties) {
-            string properties = _properties.str();
-            _properties.clear();
-            size_t propertiesSize = properties.size();
-            if (propertiesSize > kMaxPropertiesSize)
-                throw std::runtime_error("properties excessively large");
-            char buf[kMaxVarintLen64];
-            slice encodedSize(buf, PutUVarInt(buf, propertiesSize));
-            _out.writeRaw(encodedSize);
-            _out.writeRaw(slice(properties));
-            _wroteProperties = true;
+        if (_wroteProperties)
+            return;
+        reserve(0);
+        size_t propertiesSize = _size - kPropertiesSizeReserve;
+        if (propertiesSize > kMaxPropertiesSize)
+            throw std::runtime_error("properties excessively large");
+        uint8_t sizeBuf[kMaxVarintLen32];
+        size_t sizeLen = PutUVarInt(sizeBuf, propertiesSize);
+        if (sizeLen > kPropertiesSizeReserve) {
+            reserve(sizeLen - kPropertiesSizeReserve);
+            auto start = (uint8_t*)_buffer.buf;
+            memmove(start + sizeLen, start + kPropertiesSizeReserve, propertiesSize);
+            _size = sizeLen + propertiesSize;
+        }
+        memcpy((void*)_buffer.buf, sizeBuf, sizeLen);
+        _wroteProperties = true;
+    }
+
+
+    fleece::JSONEncoder& MessageBuilder::jsonBody() {
+        finishProperties();
+        if (!_json)
+            _json.reset(new JSONEncoder);
+        return *_json;
+    }
+
+
+    // Appends anything written to the JSON encoder to the body.
+    void MessageBuilder::flushJSON() {
+        if (_json && _json->bytesWritten() > 0) {
+            alloc_slice json = _json->finish();
+            _json->reset();
+            append(json);
         }
     }
 
 
     MessageBuilder& MessageBuilder::write(slice data) {
-        if(!_wroteProperties)
-            finishProperties();
-        _out.writeRaw(data);
+        DebugAssert(!_bodyFile);
+        finishProperties();
+        flushJSON();
+        append(data);
+        return *this;
+    }
+
+
+    // The attached buffer is recorded with the offset in _buffer it follows; MessageOut sends
+    // the payload and the attachments interleaved.
+    MessageBuilder& MessageBuilder::attachBody(alloc_slice data) {
+        DebugAssert(!_bodyFile);
+        finishProperties();
+        flushJSON();
+        if (data.size > 0)
+            _attachments.emplace_back(_size, move(data));
+        return *this;
+    }
+
+
+    MessageBuilder& MessageBuilder::writeFile(const string &path) {
+        DebugAssert(!_bodyFile && !dataSource && !asyncDataSource);
+        finishProperties();
+        Retained<MappedFile> file = new MappedFile(path);
+        // MessageOut counts the bytes it's sent in 32 bits:
+        size_t size = _size + file->contents().size;
+        for (auto &att : _attachments)
+            size += att.second.size;
+        if (size > UINT32_MAX)
+            throw std::runtime_error("file is too large to send in a BLIP message");
+        _bodyFile = move(file);
         return *this;
     }
 
 
+    // Returns the payload, handing over the buffer itself -- unless growing it left it far
+    // bigger than the payload, in which case the payload is copied, so the message doesn't
+    // hold on to the slack. The next message's buffer is allocated at the same size (up to a
+    // limit), since messages built in a row tend to be similar.
     alloc_slice MessageBuilder::finish() {
         finishProperties();
-        return _out.finish();
+        flushJSON();
+        alloc_slice payload;
+        if (_buffer.size - _size > max(_size, kInitialCapacity)) {
+            payload = alloc_slice(_buffer.upTo(_size));
+            _buffer = nullslice;
+        } else {
+            _buffer.shorten(_size);
+            payload = move(_buffer);
+        }
+        _capacityHint = min(max(_size, kInitialCapacity), kMaxCapacityHint);
+        _size = 0;
+        return payload;
     }
 
 
     void MessageBuilder::reset() {
+        dataSource = nullptr;
+        asyncDataSource = nullptr;
         onProgress = nullptr;
+        type = kRequestType;
         urgent = compressed = noreply = false;
-        _out.reset();
-        _properties.clear();
+        trafficClass = -1;
+        deadline = Deadline();
+        responseTimeout = chrono::milliseconds(0);
+        _size = 0;                              // (keeps _buffer, if it wasn't finished)
+        if (_json)
+            _json->reset();
         _wroteProperties = false;
+        _attachments.clear();
+        _bodyFile = nullptr;
+    }
+
+
+
+#pragma mark - ENCODED MESSAGE:
+
+
+    EncodedMessage::EncodedMessage(MessageBuilder &mb) {
+        Assert(!mb.dataSource && !mb.asyncDataSource && !mb.onProgress);
+        _payload = mb.finish();
+        _flags = mb.flags();            // (after finish(), which may update the flags)
+        // Peers without tokenized properties all get the same header, so encode it just once:
+        slice props = _payload;
+        uint32_t propertiesSize;
+        if (ReadUVarInt32(&props, &propertiesSize) && propertiesSize <= props.size)
+            _plainHeader = PropertyEncoder::encodePlain(props.upTo(propertiesSize));
+        _attachments = move(mb._attachments);
+        mb._attachments.clear();
+        _bodyFile = move(mb._bodyFile);
+        _trafficClass = mb.trafficClass;
+        _deadline = mb.deadline;
+        _responseTimeout = mb.responseTimeout;
+    }
+
+
+    EncodedMessage::~EncodedMessage()
+    { }
+
+
+#pragma mark - ASYNC DATA SOURCE:
+
+
+    void AsyncDataSource::write(alloc_slice data) {
+        if (data.size == 0)
+            return;
+        function<void()> onReady;
+        {
+            lock_guard<mutex> lock(_mutex);
+            if (_detached)
+                return;
+            DebugAssert(!_closed);
+            _bufferedBytes += data.size;
+            _chunks.push_back(move(data));
+            onReady = takeCallback();
+        }
+        if (onReady)
+            onReady();
+    }
+
+
+    void AsyncDataSource::close() {
+        function<void()> onReady;
+        {
+            lock_guard<mutex> lock(_mutex);
+            _closed = true;
+            onReady = takeCallback();
+        }
+        if (onReady)
+            onReady();
+    }
+
+
+    void AsyncDataSource::fail(Error err) {
+        function<void()> onReady;
+        {
+            lock_guard<mutex> lock(_mutex);
+            if (_closed)
+                return;
+            _closed = true;
+            _errorDomain = alloc_slice(err.domain ? err.domain : "BLIP"_sl);
+            _errorCode = err.code ? err.code : 500;
+            _errorMessage = alloc_slice(err.message);
+            _chunks.clear();
+            _bufferedBytes = 0;
+            onReady = takeCallback();
+        }
+        if (onReady)
+            onReady();
+    }
+
+
+    size_t AsyncDataSource::bufferedBytes() const {
+        lock_guard<mutex> lock(_mutex);
+        return _bufferedBytes;
+    }
+
+
+    bool AsyncDataSource::canceled() const {
+        lock_guard<mutex> lock(_mutex);
+        return _detached;
+    }
+
+
+    AsyncDataSource::ReadResult AsyncDataSource::read(alloc_slice &chunk) {
+        lock_guard<mutex> lock(_mutex);
+        if (!_chunks.empty()) {
+            chunk = move(_chunks.front());
+            _chunks.pop_front();
+            _bufferedBytes -= chunk.size;
+            return kData;
+        } else if (!_closed) {
+            return kWaiting;
+        } else {
+            return _errorCode ? kFailed : kEnd;
+        }
+    }
+
+
+    bool AsyncDataSource::waitForData(function<void()> onReady) {
+        lock_guard<mutex> lock(_mutex);
+        if (!_chunks.empty() || _closed || _detached)
+            return false;
+        _onReady = move(onReady);
+        return true;
+    }
+
+
+    void AsyncDataSource::detach() {
+        function<void()> onReady;
+        {
+            lock_guard<mutex> lock(_mutex);
+            _detached = true;
+            _chunks.clear();
+            _bufferedBytes = 0;
+            onReady = takeCallback();   // Don't call it; just free what it captured
+        }
+    }
+
+
+    Error AsyncDataSource::error() const {
+        lock_guard<mutex> lock(_mutex);
+        return Error(_errorDomain, _errorCode, _errorMessage);
+    }
+
+
+    // Must be called with the mutex locked. The caller calls the callback after unlocking it.
+    function<void()> AsyncDataSource::takeCallback() {
+        function<void()> onReady = move(_onReady);
+        _onReady = nullptr;
+        return onReady;
     }
 
 } }
@@ -0,0 +1,135 @@
+//
+// MessageIndex.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "MessageOut.hh"
+#include "Error.hh"
+#include "PlatformCompat.hh"
+#include <unordered_map>
+
+namespace litecore { namespace blip {
+
+    /** Index of the outgoing messages that have begun sending but not finished, keyed by
+        message number and direction, so an incoming ACK can find its message in constant time.
+        These messages are either in the outbox, or frozen in the "icebox" waiting for an ACK
+        before they can send more frames, or parked waiting for their AsyncDataSource to produce
+        more data. (ACKs aren't indexed; they're always one frame long.) */
+    class MessageIndex {
+    public:
+        MessageIndex()                          {_messages.reserve(10);}
+
+        bool empty() const                      {return _messages.empty();}
+        size_t size() const                     {return _messages.size();}
+        size_t frozenCount() const              {return _frozenCount;}
+        size_t parkedCount() const              {return _parkedCount;}
+
+        void add(MessageOut *msg) {
+            LITECORE_UNUSED bool added =
+                _messages.emplace(key(msg->number(), msg->isResponse()),
+                                  Entry{msg, false, false}).second;
+            DebugAssert(added);
+        }
+
+        /** Returns the message with the given number and direction, or nullptr.
+            If `frozen` is non-null, it's set to whether the message is in the icebox. */
+        MessageOut* find(MessageNo msgNo, bool isResponse, bool *frozen =nullptr) const {
+            auto i = _messages.find(key(msgNo, isResponse));
+            if (i == _messages.end())
+                return nullptr;
+            if (frozen)
+                *frozen = i->second.frozen;
+            return i->second.message;
+        }
+
+        bool remove(MessageOut *msg) {
+            auto i = _messages.find(key(msg->number(), msg->isResponse()));
+            if (i == _messages.end())
+                return false;
+            if (i->second.frozen)
+                --_frozenCount;
+            if (i->second.parked)
+                --_parkedCount;
+            _messages.erase(i);
+            return true;
+        }
+
+        /** Moves an indexed message into (or out of) the icebox. */
+        void setFrozen(MessageOut *msg, bool frozen) {
+            auto i = _messages.find(key(msg->number(), msg->isResponse()));
+            DebugAssert(i != _messages.end() && i->second.message == msg);
+            DebugAssert(i->second.frozen != frozen);
+            i->second.frozen = frozen;
+            if (frozen)
+                ++_frozenCount;
+            else
+                --_frozenCount;
+        }
+
+        /** Moves an indexed message into (or out of) the set waiting for data to send. */
+        void setParked(MessageOut *msg, bool parked) {
+            auto i = _messages.find(key(msg->number(), msg->isResponse()));
+            DebugAssert(i != _messages.end() && i->second.message == msg);
+            DebugAssert(i->second.parked != parked && !i->second.frozen);
+            i->second.parked = parked;
+            if (parked)
+                ++_parkedCount;
+            else
+                --_parkedCount;
+        }
+
+        bool isParked(MessageOut *msg) const {
+            auto i = _messages.find(key(msg->number(), msg->isResponse()));
+            return i != _messages.end() && i->second.message == msg && i->second.parked;
+        }
+
+        /** Calls `fn` on every message in the icebox. */
+        template <class FN>
+        void forEachFrozen(FN fn) const {
+            for (auto &item : _messages)
+                if (item.second.frozen)
+                    fn(item.second.message.get());
+        }
+
+        /** Calls `fn` on every parked message. */
+        template <class FN>
+        void forEachParked(FN fn) const {
+            for (auto &item : _messages)
+                if (item.second.parked)
+                    fn(item.second.message.get());
+        }
+
+        void clear() {
+            _messages.clear();
+            _frozenCount = _parkedCount = 0;
+        }
+
+    private:
+        struct Entry {
+            Retained<MessageOut> message;
+            bool frozen;
+            bool parked;
+        };
+
+        static uint64_t key(MessageNo n, bool isResponse)   {return (n << 1) | isResponse;}
+
+        std::unordered_map<uint64_t, Entry> _messages;
+        size_t _frozenCount {0};
+        size_t _parkedCount {0};
+    };
+
+} }
@@ -20,9 +20,11 @@
 #include "BLIPConnection.hh"
 #include "BLIPInternal.hh"
 #include "Codec.hh"
+#include "PropertyCodec.hh"
 #include "Error.hh"
 #include "varint.hh"
 #include <algorithm>
+#include <sstream>
 
 using namespace std;
 using namespace fleece;
@@ -30,22 +32,30 @@ using namespace fleece;
 namespace litecore { namespace blip {
 
     static const size_t kDataBufferSize = 16384;
+    static const size_t kMinZeroCopySize = 1024;    // Smaller than this, copying is cheaper
 
     MessageOut::MessageOut(Connection *connection,
                            FrameFlags flags,
                            alloc_slice payload,
                            MessageDataSource dataSource,
-                           MessageNo number)
+                           MessageNo number,
+                           AsyncDataSource *asyncDataSource)
     :Message(flags, number)
     ,_connection(connection)
-    ,_contents(payload, dataSource)
+    ,_contents(payload, dataSource, asyncDataSource)
     { }
 
 
-    void MessageOut::nextFrameToSend(Codec &codec, slice &dst, FrameFlags &outFlags) {
+    // Writes the next frame's body and checksum to `dst`. If `bodyRef` is given, and the
+    // message is uncompressed, the body may instead be returned in `bodyRef` as a reference to
+    // the payload or the mapped file; then only the checksum is written to `dst`, and the body
+    // has to be sent in between what's before `dst` and what's written to it.
+    void MessageOut::nextFrameToSend(Codec &codec, slice &dst, FrameFlags &outFlags,
+                                     websocket::MessageSegment *bodyRef)
+    {
         outFlags = flags();
-        if (isAck()) {
-            // Acks have no checksum and don't go through the codec
+        if (isControl()) {
+            // ACKs and cancels have no checksum and don't go through the codec
             slice &data = _contents.dataToSend();
             dst.writeFrom(data);
             _bytesSent += (uint32_t)data.size;
@@ -53,11 +63,19 @@ namespace litecore { namespace blip {
         }
 
         size_t frameSize = dst.size;
+        uint32_t prevUncompressedBytesSent = _uncompressedBytesSent;
         dst.setSize(dst.size - Codec::kChecksumSize);          // Reserve room for checksum at end
 
         // Write the frame:
         auto mode = hasFlag(kCompressed) ? Codec::Mode::SyncFlush : Codec::Mode::Raw;
-        do {
+        size_t bytesReferenced = 0;
+        if (bodyRef && mode == Codec::Mode::Raw
+                    && _contents.referenceBody(dst.size, *bodyRef)) {
+            // Zero-copy: the caller will send the body straight from the payload or file
+            codec.addToChecksum(bodyRef->data);
+            bytesReferenced = bodyRef->data.size;
+            _uncompressedBytesSent += (uint32_t)bytesReferenced;
+        } else do {
             slice &data = _contents.dataToSend();
             if (data.size == 0)
                 break;
@@ -86,10 +104,12 @@ namespace litecore { namespace blip {
 
         // Compute the (compressed) frame size, and update running totals:
         frameSize -= dst.size;
+        frameSize += bytesReferenced;
         _bytesSent += (uint32_t)frameSize;
         _unackedBytes += (uint32_t)frameSize;
 
-        // Update flags & state:
+        // Update flags & state. (If the data source failed, the frame is marked as not the last,
+        // so the peer won't take the message as complete; BLIPIO then aborts it.)
         MessageProgress::State state;
         if (_contents.hasMoreDataToSend()) {
             outFlags = (FrameFlags)(outFlags | kMoreComing);
@@ -99,10 +119,25 @@ namespace litecore { namespace blip {
         } else {
             state = MessageProgress::kAwaitingReply;
         }
+        dequeue(_uncompressedBytesSent - prevUncompressedBytesSent, !(outFlags & kMoreComing));
         sendProgress(state, _uncompressedBytesSent, 0, nullptr);
     }
 
 
+    // Takes bytes that have been sent (and, when finished, the message itself) out of the
+    // Connection's count of queued data.
+    void MessageOut::dequeue(size_t bytes, bool finished) {
+        if (!_queued)
+            return;
+        bytes = min(bytes, _queuedBytes);
+        if (finished)
+            bytes = _queuedBytes;
+        _queuedBytes -= bytes;
+        _queued = !finished;
+        _connection->dequeued(bytes, finished);
+    }
+
+
     void MessageOut::receivedAck(uint32_t byteCount) {
         if (byteCount <= _bytesSent)
             _unackedBytes = min(_unackedBytes, (uint32_t)(_bytesSent - byteCount));
@@ -119,13 +154,58 @@ namespace litecore { namespace blip {
     }
 
 
+    // Creates an error response to send in place of this partly-sent response, whose data
+    // source failed. It has the same number, so it has to be preceded by a kCancelResponseType.
+    MessageOut* MessageOut::createErrorResponse() {
+        DebugAssert(type() == kResponseType && failed());
+        MessageBuilder mb;
+        mb.urgent = urgent();
+        mb.trafficClass = _trafficClass;
+        mb.makeError(_contents.error());
+        return new MessageOut(_connection, mb, _number);
+    }
+
+
     void MessageOut::disconnected() {
+        dequeue(0, true);
+        _contents.detachAsyncSource();
         if (type() != kRequestType || noReply())
             return;
         Message::disconnected();
     }
 
 
+    // Called when the client cancels the message. Frees the payload and data source, and the
+    // progress callback, since there won't be any more progress to report.
+    void MessageOut::canceled() {
+        dequeue(0, true);
+        _contents.clear();
+        _encoded = nullptr;
+        _onProgress = nullptr;
+    }
+
+
+    // Called when the message is abandoned because its data source failed. Unlike a cancel,
+    // this wasn't the client's doing, so the progress callback is told, with the error.
+    // (It's called before the contents are cleared, since the error belongs to the source.)
+    void MessageOut::aborted() {
+        MessageProgressCallback onProgress = move(_onProgress);
+        if (onProgress)
+            onProgress({MessageProgress::kFailed, _uncompressedBytesSent, 0, nullptr,
+                        _contents.error()});
+        canceled();
+    }
+
+
+    // Called when the message is dropped from the outbox because its deadline passed.
+    void MessageOut::expired() {
+        MessageProgressCallback onProgress = move(_onProgress);
+        canceled();
+        if (onProgress)
+            onProgress({MessageProgress::kExpired, 0, 0, nullptr});
+    }
+
+
     void MessageOut::dump(std::ostream& out, bool withBody) {
         slice props, body;
         _contents.getPropsAndBody(props, body);
@@ -135,10 +215,15 @@ namespace litecore { namespace blip {
     }
 
 
+    // (The properties are gone once the payload has been sent, so this returns nullptr then.)
     const char* MessageOut::findProperty(const char *propertyName) {
         slice props, body;
         _contents.getPropsAndBody(props, body);
-        return Message::findProperty(props, propertyName);
+        if (props.size == 0)
+            return nullptr;
+        if (_propertyIndex.empty() && !_propertyIndex.build(props))
+            return nullptr;
+        return (const char*)_propertyIndex.find(props, slice(propertyName)).buf;
     }
 
 
@@ -154,10 +239,12 @@ namespace litecore { namespace blip {
 #pragma mark - DATA:
 
 
-    MessageOut::Contents::Contents(alloc_slice payload, MessageDataSource dataSource)
+    MessageOut::Contents::Contents(alloc_slice payload, MessageDataSource dataSource,
+                                   AsyncDataSource *asyncSource)
     :_payload(payload)
     ,_unsentPayload(payload.buf, payload.size)
     ,_dataSource(dataSource)
+    ,_asyncSource(asyncSource)
     {
         DebugAssert(payload.size <= UINT32_MAX);
     }
@@ -165,12 +252,24 @@ namespace litecore { namespace blip {
 
     // Returns the next message-body data to send (as a slice _reference_)
     slice& MessageOut::Contents::dataToSend() {
-        if (_unsentPayload.size > 0) {
+        if (_unsentHeader.size > 0) {
+            return _unsentHeader;
+        } else if (_unsentPayload.size > 0) {
             return _unsentPayload;
+        } else if (auto segment = nextSegment()) {
+            _payload.reset();
+            return segment->data;
+        } else if (_unsentFile.size > 0 && fileIntact()) {
+            _payload.reset();
+            return _unsentFile;
         } else {
             _payload.reset();
-            if (_unsentDataBuffer.size == 0 && _dataSource) {
-                readFromDataSource();
+            _file = nullptr;
+            if (_unsentDataBuffer.size == 0 && (_dataSource || (_asyncSource && !_failed))) {
+                if (_dataSource)
+                    readFromDataSource();
+                else
+                    readFromAsyncSource();
                 if (_unsentDataBuffer.size == 0)
                     _dataBuffer.reset();
             }
@@ -181,7 +280,140 @@ namespace litecore { namespace blip {
 
     // Is there more data to send?
     bool MessageOut::Contents::hasMoreDataToSend() const {
-        return _unsentPayload.size > 0 || _unsentDataBuffer.size > 0 || _dataSource != nullptr;
+        return _unsentHeader.size > 0 || _unsentPayload.size > 0 || unsentSegmentsSize() > 0
+            || _unsentFile.size > 0 || _unsentDataBuffer.size > 0 || _dataSource != nullptr
+            || _asyncSource != nullptr || _failed;
+    }
+
+
+    // True if there's nothing to send right now, but the async data source will produce more.
+    bool MessageOut::Contents::needsData() {
+        if (_unsentHeader.size > 0 || _unsentPayload.size > 0 || unsentSegmentsSize() > 0
+                || _unsentDataBuffer.size > 0 || !_asyncSource || _failed)
+            return false;
+        readFromAsyncSource();
+        return _unsentDataBuffer.size == 0 && _asyncSource && !_failed;
+    }
+
+
+    // Splits the payload at the offsets where buffers were attached to it by reference. The
+    // pieces after the first, and the attached buffers, are sent in order from _segments.
+    // Must be called before encodeProperties().
+    void MessageOut::Contents::setAttachments(const vector<MessageBuilder::Attachment> &atts) {
+        DebugAssert(!_header && _segments.empty() && !atts.empty());
+        size_t pos = atts.front().first, total = _payload.size;
+        _unsentPayload = _payload.upTo(pos);
+        for (auto &att : atts) {
+            if (att.first > pos)
+                _segments.emplace_back(slice(&_payload[pos], att.first - pos), _payload);
+            _segments.emplace_back(att.second, att.second);
+            pos = att.first;
+            total += att.second.size;
+        }
+        if (pos < _payload.size)
+            _segments.emplace_back(_payload.from(pos), _payload);
+        DebugAssert(total <= UINT32_MAX);
+        _laterSegmentsSize = 0;
+        for (auto i = _segments.begin() + 1; i != _segments.end(); ++i)
+            _laterSegmentsSize += i->data.size;
+    }
+
+
+    // Returns the first segment with data left to send, discarding the ones already sent.
+    // (Only the first segment is ever consumed, so the rest keep the sizes they're counted at
+    // in _laterSegmentsSize.)
+    websocket::MessageSegment* MessageOut::Contents::nextSegment() {
+        while (!_segments.empty() && _segments.front().data.size == 0) {
+            _segments.pop_front();
+            if (!_segments.empty())
+                _laterSegmentsSize -= _segments.front().data.size;
+        }
+        return _segments.empty() ? nullptr : &_segments.front();
+    }
+
+
+    // Reading a file that's been truncated since it was mapped would crash (see MappedFile),
+    // so before each frame, check; if it has, the message fails, as if a data source had.
+    bool MessageOut::Contents::fileIntact() {
+        if (!_file->truncated())
+            return true;
+        WarnError("File of BLIP message body was truncated while being sent");
+        _unsentFile = nullslice;
+        _failed = true;
+        return false;
+    }
+
+
+    void MessageOut::Contents::setFile(Retained<MappedFile> file) {
+        DebugAssert(!_dataSource && !_asyncSource);
+        _file = move(file);
+        _unsentFile = _file->contents();
+        DebugAssert(_payload.size + unsentSegmentsSize() + _unsentFile.size <= UINT32_MAX);
+    }
+
+
+    // Replaces the properties at the start of the payload with their tokenized form (or, if
+    // there's no encoder because the peer doesn't support that, their plain-text form, which
+    // may already be known), which is sent first, followed by the rest of the payload. Must be
+    // called before anything's sent.
+    void MessageOut::Contents::encodeProperties(PropertyEncoder *encoder, size_t maxDynamicSize,
+                                                const alloc_slice *plainHeader) {
+        DebugAssert(!_header && _unsentPayload.buf == _payload.buf);
+        slice props = _payload;
+        uint32_t propertiesSize;
+        if (!ReadUVarInt32(&props, &propertiesSize) || propertiesSize > props.size)
+            return;
+        props.setSize(propertiesSize);
+        if (encoder)
+            _header = encoder->encode(props, maxDynamicSize);
+        else if (plainHeader)
+            _header = *plainHeader;
+        else
+            _header = PropertyEncoder::encodePlain(props);
+        if (_header) {
+            _unsentHeader = _header;
+            _unsentPayload.setStart(props.end());
+        }
+    }
+
+
+    // If enough of the payload, or else of the next attached segment or the file, remains
+    // unsent, returns (up to `maxSize` bytes of) it by reference instead of copying, and marks
+    // it as sent.
+    bool MessageOut::Contents::referenceBody(size_t maxSize, websocket::MessageSegment &segment) {
+        if (maxSize < kMinZeroCopySize || _unsentHeader.size > 0)
+            return false;
+        slice *unsent;
+        websocket::MessageSegment *next = nullptr;
+        if (_unsentPayload.size >= kMinZeroCopySize) {
+            unsent = &_unsentPayload;
+            segment.owner = _payload;
+        } else if (_unsentPayload.size > 0) {
+            return false;
+        } else if ((next = nextSegment()) != nullptr) {
+            if (next->data.size < kMinZeroCopySize)
+                return false;
+            unsent = &next->data;
+            segment.owner = next->owner;
+        } else if (_unsentFile.size >= kMinZeroCopySize && fileIntact()) {
+            unsent = &_unsentFile;
+            segment.holder = _file.get();
+        } else {
+            return false;
+        }
+        segment.data = unsent->upTo(min(maxSize, unsent->size));
+        unsent->moveStart(segment.data.size);
+        return true;
+    }
+
+
+    // How many (uncompressed) bytes are left to send? Returns SIZE_MAX if unknown because the
+    // data source hasn't finished.
+    size_t MessageOut::Contents::bytesRemaining() const {
+        if (_dataSource || _asyncSource)
+            return SIZE_MAX;
+        return _unsentHeader.size + _unsentPayload.size + unsentSegmentsSize() + _unsentFile.size
+             + _unsentDataBuffer.size;
     }
 
 
@@ -190,18 +422,69 @@ namespace litecore { namespace blip {
         if (!_dataBuffer)
             _dataBuffer.reset(kDataBufferSize);
         auto bytesWritten = _dataSource((void*)_dataBuffer.buf, _dataBuffer.size);
+        if (bytesWritten < 0) {
+            WarnError("Error from BLIP message dataSource");
+            _dataSource = nullptr;
+            _failed = true;
+            return;
+        }
         _unsentDataBuffer = _dataBuffer.upTo(bytesWritten);
         if (bytesWritten < _dataBuffer.size) {
             // End of data source
             _dataSource = nullptr;
-            if (bytesWritten < 0) {
-                WarnError("Error from BLIP message dataSource");
-                //FIX: How to report/handle the error?
-            }
         }
     }
 
 
+    // Takes the next chunk of data, if any, that the producer has written to _asyncSource.
+    void MessageOut::Contents::readFromAsyncSource() {
+        switch (_asyncSource->read(_dataBuffer)) {
+            case AsyncDataSource::kData:
+                _unsentDataBuffer = _dataBuffer;
+                break;
+            case AsyncDataSource::kWaiting:
+                break;
+            case AsyncDataSource::kEnd:
+                _asyncSource = nullptr;
+                break;
+            case AsyncDataSource::kFailed:
+                WarnError("Error from BLIP message asyncDataSource");
+                _failed = true;         // (keep _asyncSource, for error())
+                break;
+        }
+    }
+
+
+    Error MessageOut::Contents::error() const {
+        if (_asyncSource && _failed)
+            return _asyncSource->error();
+        return Error("BLIP"_sl, 500, "Couldn't read message body"_sl);
+    }
+
+
+    void MessageOut::Contents::detachAsyncSource() {
+        if (_asyncSource) {
+            _asyncSource->detach();
+            _asyncSource = nullptr;
+        }
+    }
+
+    void MessageOut::Contents::clear() {
+        _header.reset();
+        _unsentHeader = nullslice;
+        _payload.reset();
+        _unsentPayload = nullslice;
+        _segments.clear();
+        _laterSegmentsSize = 0;
+        _file = nullptr;
+        _unsentFile = nullslice;
+        _dataSource = nullptr;
+        detachAsyncSource();
+        _dataBuffer.reset();
+        _unsentDataBuffer = nullslice;
+    }
+
+
     void MessageOut::Contents::getPropsAndBody(slice &props, slice &body) const {
         props = _payload;
         if (props.size) {
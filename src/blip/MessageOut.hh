@@ -18,10 +18,14 @@
 
 #pragma once
 #include "MessageBuilder.hh"
+#include "MappedFile.hh"
+#include "WebSocketInterface.hh"
+#include <deque>
 #include <ostream>
 
 namespace litecore { namespace blip {
     class Codec;
+    class PropertyEncoder;
 
     /** An outgoing message that's been constructed by a MessageBuilder. */
     class MessageOut : public Message {
@@ -29,28 +33,71 @@ namespace litecore { namespace blip {
         friend class MessageIn;
         friend class Connection;
         friend class BLIPIO;
+        friend class MessageQueue;
 
         MessageOut(Connection *connection,
                    FrameFlags flags,
                    alloc_slice payload,
                    MessageDataSource dataSource,
-                   MessageNo number);
+                   MessageNo number,
+                   AsyncDataSource *asyncDataSource =nullptr);
 
         MessageOut(Connection *connection,
                    MessageBuilder &builder,
                    MessageNo number)
-        :MessageOut(connection, (FrameFlags)0, builder.finish(), builder.dataSource, number)
+        :MessageOut(connection, (FrameFlags)0, builder.finish(), builder.dataSource, number,
+                    builder.asyncDataSource)
         {
             _flags = builder.flags();   // finish() may update the flags, so set them after
             _onProgress = std::move(builder.onProgress);
+            _trafficClass = builder.trafficClass;
+            _deadline = builder.deadline;
+            _responseTimeout = builder.responseTimeout;
+            if (!builder._attachments.empty())
+                _contents.setAttachments(builder._attachments);
+            if (builder._bodyFile)
+                _contents.setFile(std::move(builder._bodyFile));
+        }
+
+        MessageOut(Connection *connection,
+                   EncodedMessage &encoded,
+                   MessageNo number,
+                   MessageProgressCallback onProgress)
+        :MessageOut(connection, encoded._flags, encoded._payload, nullptr, number)
+        {
+            _encoded = &encoded;
+            _onProgress = std::move(onProgress);
+            _trafficClass = encoded._trafficClass;
+            _deadline = encoded._deadline;
+            _responseTimeout = encoded._responseTimeout;
+            if (!encoded._attachments.empty())
+                _contents.setAttachments(encoded._attachments);
+            if (encoded._bodyFile)
+                _contents.setFile(encoded._bodyFile);
         }
 
         void dontCompress()                     {_flags = (FrameFlags)(_flags & ~kCompressed);}
-        void nextFrameToSend(Codec &codec, slice &dst, FrameFlags &outFlags);
+        void encodeProperties(PropertyEncoder *encoder, size_t maxDynamicSize) {
+            _contents.encodeProperties(encoder, maxDynamicSize,
+                                       _encoded ? &_encoded->_plainHeader : nullptr);
+        }
+        void nextFrameToSend(Codec &codec, slice &dst, FrameFlags &outFlags,
+                             websocket::MessageSegment *bodyRef =nullptr);
         void receivedAck(uint32_t byteCount);
-        bool needsAck()                         {return _unackedBytes >= kMaxUnackedBytes;}
+        bool needsAck(size_t window) const      {return _unackedBytes >= window;}
+        size_t bytesRemaining() const           {return _contents.bytesRemaining();}
+        size_t unsentPayloadSize() const        {return _contents.unsentPayloadSize();}
+        void queued(size_t bytes)               {_queued = true; _queuedBytes = bytes;}
+        bool isExpired() const                  {return _deadline != Deadline() &&
+                                                    _deadline < std::chrono::system_clock::now();}
+        bool needsData()                        {return _contents.needsData();}
+        bool failed() const                     {return _contents.failed();}
         MessageIn* createResponse();
+        MessageOut* createErrorResponse();
         void disconnected();
+        void canceled();
+        void aborted();
+        void expired();
 
         // for debugging/logging:
         std::string description();
@@ -58,30 +105,68 @@ namespace litecore { namespace blip {
         const char* findProperty(const char *propertyName);
 
     private:
-        static const uint32_t kMaxUnackedBytes = 128000;
+        void dequeue(size_t bytes, bool finished);
 
         /** Manages the data (properties, body, data source) of a MessageOut. */
         class Contents {
         public:
-            Contents(alloc_slice payload, MessageDataSource dataSource);
+            Contents(alloc_slice payload, MessageDataSource dataSource,
+                     AsyncDataSource *asyncSource);
             slice& dataToSend();
             bool hasMoreDataToSend() const;
+            bool needsData();
+            bool failed() const                 {return _failed;}
+            Error error() const;
+            AsyncDataSource* asyncSource() const {return _asyncSource;}
+            size_t bytesRemaining() const;
+            size_t unsentPayloadSize() const    {return _unsentHeader.size + _unsentPayload.size
+                                                        + unsentSegmentsSize() + _unsentFile.size;}
+            void setAttachments(const std::vector<MessageBuilder::Attachment>&);
+            void setFile(Retained<MappedFile> file);
+            void encodeProperties(PropertyEncoder*, size_t maxDynamicSize,
+                                  const alloc_slice *plainHeader =nullptr);
+            bool referenceBody(size_t maxSize, websocket::MessageSegment &segment);
             void getPropsAndBody(slice &props, slice &body) const;
+            void clear();
+            void detachAsyncSource();
         private:
             void readFromDataSource();
+            void readFromAsyncSource();
+            websocket::MessageSegment* nextSegment();
+            bool fileIntact();
+            size_t unsentSegmentsSize() const   {return _segments.empty() ? 0
+                                                        : _segments.front().data.size
+                                                          + _laterSegmentsSize;}
 
+            alloc_slice _header;                // Encoded properties, replacing _payload's
+            slice _unsentHeader;                // Unsent subrange of _header
             alloc_slice _payload;               // Message data (uncompressed)
             slice _unsentPayload;               // Unsent subrange of _payload
+            std::deque<websocket::MessageSegment> _segments; // Body data following _unsentPayload
+            size_t _laterSegmentsSize {0};      // Unsent bytes in _segments after the first
+            Retained<MappedFile> _file;         // File whose contents follow the payload
+            slice _unsentFile;                  // Unsent subrange of _file's contents
             MessageDataSource _dataSource;      // Callback that produces more data to send
+            Retained<AsyncDataSource> _asyncSource; // Producer that writes more data to send
             alloc_slice _dataBuffer;            // Data read from _dataSource
             slice _unsentDataBuffer;            // Unsent subrange of _dataBuffer
+            bool _failed {false};               // Did the data source fail?
         };
 
         Connection* const _connection;          // My BLIP connection
+        Retained<EncodedMessage> _encoded;      // Shared message I was created from, if any
         Contents _contents;                     // Message data
         uint32_t _uncompressedBytesSent {0};    // Number of bytes of the data sent so far
         uint32_t _bytesSent {0};                // Number of bytes transmitted (after compression)
         uint32_t _unackedBytes {0};             // Bytes transmitted for which no ack received yet
+        int8_t _trafficClass {-1};              // Scheduling class; -1 until assigned by BLIPIO
+        uint32_t _rttProbeBytes {0};            // _bytesSent when RTT probe frame was sent
+        double _rttProbeTime {-1};              // Time RTT probe frame was sent, or -1 if none
+        size_t _queuedBytes {0};                // My bytes counted in Connection::queuedBytes
+        bool _queued {false};                   // Am I counted in Connection::queuedMessages?
+        PropertyIndex _propertyIndex;           // Index of properties [lazy]
+        Deadline _deadline;                     // Time to give up sending, if not begun
+        std::chrono::milliseconds _responseTimeout {0}; // Time to wait for response, if nonzero
     };
 
 } }
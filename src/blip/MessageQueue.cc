@@ -0,0 +1,250 @@
+//
+// MessageQueue.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "MessageQueue.hh"
+#include "Logging.hh"
+#include <algorithm>
+#include <functional>
+
+using namespace std;
+
+namespace litecore { namespace blip {
+
+    bool MessageQueue::contains(MessageOut *msg) const {
+        bool found = false;
+        forEach([&](MessageOut *m) {
+            if (m == msg)
+                found = true;
+        });
+        return found;
+    }
+
+
+    void MessageQueue::setWeight(unsigned trafficClass, unsigned weight) {
+        DebugAssert(trafficClass < kNumClasses);
+        _classes[trafficClass].weight = max(weight, 1u);
+    }
+
+
+    void MessageQueue::setShortestRemainingFirst(bool srf, unsigned maxActive) {
+        maxActive = max(maxActive, 1u);
+        if (srf == _srf && maxActive == _maxActive)
+            return;
+        _srf = srf;
+        _maxActive = maxActive;
+        // Move every message into the data structure the new mode uses:
+        for (auto &cls : _classes) {
+            for (auto &lane : cls.lanes) {
+                vector<Retained<MessageOut>> msgs;
+                lane.forEach([&](MessageOut *msg) {msgs.emplace_back(msg);});
+                lane.clear();
+                for (auto &msg : msgs)
+                    lane.push(msg, _srf, ++_pushCount);
+            }
+        }
+    }
+
+
+    unsigned MessageQueue::classOf(const MessageOut *msg) {
+        return min((unsigned)max(msg->_trafficClass, (int8_t)0), kNumClasses - 1);
+    }
+
+
+    void MessageQueue::push(MessageOut *msg) {
+        ++_size;
+        if (msg->isControl()) {
+            ++_urgentCount;
+            _acks.emplace_back(msg);
+            return;
+        }
+        unsigned c = classOf(msg);
+        TrafficClass &cls = _classes[c];
+        if (msg->urgent()) {
+            ++_urgentCount;
+            cls.lanes[kUrgentLane].push(msg, _srf, ++_pushCount);
+        } else {
+            cls.lanes[kNormalLane].push(msg, _srf, ++_pushCount);
+        }
+        if (!cls.active) {
+            cls.active = true;
+            _active.push_back(c);
+        }
+    }
+
+
+    // Urgent messages go first, but if there are normal messages waiting, every urgent
+    // message is followed by a normal one.
+    MessageQueue::LaneID MessageQueue::TrafficClass::nextLane() const {
+        if (lanes[kUrgentLane].empty())
+            return kNormalLane;
+        else if (lanes[kNormalLane].empty() || !lastPoppedUrgent)
+            return kUrgentLane;
+        else
+            return kNormalLane;
+    }
+
+
+    // Deficit round-robin: returns the first class in the ring that still has credit, giving
+    // classes without credit a fresh quantum and moving them to the back of the ring.
+    unsigned MessageQueue::nextClass() {
+        while (true) {
+            DebugAssert(!_active.empty());
+            unsigned c = _active.front();
+            TrafficClass &cls = _classes[c];
+            if (cls.empty()) {
+                // Class has run dry, so it leaves the ring and forfeits its credit:
+                cls.active = false;
+                cls.deficit = 0;
+                _active.pop_front();
+            } else if (cls.deficit > 0) {
+                return c;
+            } else {
+                cls.deficit += (ptrdiff_t)(cls.weight * kQuantum);
+                _active.pop_front();
+                _active.push_back(c);
+            }
+        }
+    }
+
+
+    Retained<MessageOut> MessageQueue::pop() {
+        if (_size == 0)
+            return nullptr;
+        --_size;
+        Retained<MessageOut> msg;
+        if (!_acks.empty()) {
+            msg = move(_acks.front());
+            _acks.pop_front();
+            --_urgentCount;
+        } else {
+            TrafficClass &cls = _classes[nextClass()];
+            LaneID laneID = cls.nextLane();
+            msg = cls.lanes[laneID].pop(_maxActive);
+            cls.lastPoppedUrgent = (laneID == kUrgentLane);
+            if (cls.lastPoppedUrgent)
+                --_urgentCount;
+        }
+        return msg;
+    }
+
+
+    bool MessageQueue::remove(MessageOut *msg) {
+        LaneID laneID = msg->urgent() ? kUrgentLane : kNormalLane;
+        if (msg->isControl() || !_classes[classOf(msg)].lanes[laneID].remove(msg))
+            return false;
+        // (If this empties the class, nextClass() will take it out of the ring later.)
+        --_size;
+        if (laneID == kUrgentLane)
+            --_urgentCount;
+        return true;
+    }
+
+
+    void MessageQueue::sent(MessageOut *msg, size_t frameSize) {
+        if (!msg->isControl())
+            _classes[classOf(msg)].deficit -= (ptrdiff_t)frameSize;
+    }
+
+
+#pragma mark - LANE:
+
+
+    void MessageQueue::Lane::push(MessageOut *msg, bool srf, uint64_t seq) {
+        if (!srf) {
+            _fifo.emplace_back(msg);
+        } else {
+            Heap &heap = (msg->_bytesSent > 0) ? _started : _unstarted;
+            heap.push_back({msg->bytesRemaining(), seq, msg});
+            push_heap(heap.begin(), heap.end(), greater<Entry>());
+        }
+    }
+
+
+    Retained<MessageOut> MessageQueue::Lane::pop(unsigned maxActive) {
+        if (!_fifo.empty()) {
+            Retained<MessageOut> msg = move(_fifo.front());
+            _fifo.pop_front();
+            return msg;
+        }
+        // SRF mode: start a new message only if it's smaller than any partly-sent one, and
+        // either it fits in a frame or there's room for another active message.
+        if (_started.empty())
+            return popHeap(_unstarted);
+        if (!_unstarted.empty()) {
+            const Entry &next = _unstarted.front();
+            if (_started.front() > next
+                    && (_started.size() < maxActive || next.remaining <= kSmallMessageSize))
+                return popHeap(_unstarted);
+        }
+        return popHeap(_started);
+    }
+
+
+    Retained<MessageOut> MessageQueue::Lane::popHeap(Heap &heap) {
+        pop_heap(heap.begin(), heap.end(), greater<Entry>());
+        Retained<MessageOut> msg = move(heap.back().msg);
+        heap.pop_back();
+        return msg;
+    }
+
+
+    bool MessageQueue::Lane::remove(MessageOut *msg) {
+        auto i = find_if(_fifo.begin(), _fifo.end(),
+                         [msg](const Retained<MessageOut> &m) {return m.get() == msg;});
+        if (i != _fifo.end()) {
+            _fifo.erase(i);
+            return true;
+        }
+        return removeFromHeap(_started, msg) || removeFromHeap(_unstarted, msg);
+    }
+
+
+    bool MessageQueue::Lane::removeFromHeap(Heap &heap, MessageOut *msg) {
+        auto i = find_if(heap.begin(), heap.end(),
+                         [msg](const Entry &e) {return e.msg.get() == msg;});
+        if (i == heap.end())
+            return false;
+        heap.erase(i);
+        make_heap(heap.begin(), heap.end(), greater<Entry>());
+        return true;
+    }
+
+
+    void MessageQueue::Lane::clear() {
+        _fifo.clear();
+        _started.clear();
+        _unstarted.clear();
+    }
+
+
+#pragma mark - QUEUE:
+
+
+    void MessageQueue::clear() {
+        _acks.clear();
+        for (auto &cls : _classes) {
+            cls.lanes[kNormalLane].clear();
+            cls.lanes[kUrgentLane].clear();
+            cls.deficit = 0;
+            cls.lastPoppedUrgent = cls.active = false;
+        }
+        _active.clear();
+        _size = _urgentCount = 0;
+    }
+
+} }
@@ -0,0 +1,157 @@
+//
+// MessageQueue.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "MessageOut.hh"
+#include <deque>
+#include <vector>
+#include <stddef.h>
+
+namespace litecore { namespace blip {
+
+    /** Queue of outgoing messages; each message gets to send one frame in turn.
+
+        Messages are grouped by traffic class, and the classes take turns by deficit round-robin:
+        each turn, a class's credit grows by its weight times kQuantum bytes, and it keeps
+        sending frames until its credit is used up. Within a class, urgent and normal messages
+        wait in separate FIFO lanes, and the lanes alternate, so an urgent message goes out
+        after at most one normal one and normal messages are never starved.
+        ACKs and other control frames bypass all of this and are sent before anything else.
+
+        In shortest-remaining-first mode, each lane instead sends from the message with the
+        fewest bytes left, so messages finish one after another instead of all at the end.
+        Only `maxActive` partly-sent messages per lane may be interleaved; past that, a new
+        message can't start unless it's small enough to go in a single frame.
+
+        All operations except contains() and remove() are O(1) (or O(#classes) in the worst
+        case), or O(log n) in shortest-remaining-first mode. */
+    class MessageQueue {
+    public:
+        static constexpr unsigned kNumClasses = 8;
+        static constexpr size_t kQuantum = 16384;
+        static constexpr size_t kSmallMessageSize = 16000;  // Fits in one (big) frame
+
+        MessageQueue()                          { }
+
+        bool empty() const                      {return _size == 0;}
+        size_t size() const                     {return _size;}
+
+        /** True if any urgent message (or ACK) is waiting. */
+        bool hasUrgent() const                  {return _urgentCount > 0;}
+
+        /** Linear search; only for use in assertions. */
+        bool contains(MessageOut *msg) const;
+
+        /** Sets the relative share of bandwidth of a traffic class. (Default is 1.) */
+        void setWeight(unsigned trafficClass, unsigned weight);
+
+        /** Turns shortest-remaining-first mode on or off. Messages already queued are resorted. */
+        void setShortestRemainingFirst(bool srf, unsigned maxActive);
+
+        /** Adds a message at the tail of its lane. */
+        void push(MessageOut *msg);
+
+        /** Removes a message, wherever it is in the queue. Returns false if it wasn't queued.
+            This is a linear search of the message's lane. */
+        bool remove(MessageOut *msg);
+
+        /** Removes and returns the next message to send a frame of, or nullptr if empty. */
+        Retained<MessageOut> pop();
+
+        /** Charges the bytes of a frame just sent to the message's traffic class. */
+        void sent(MessageOut *msg, size_t frameSize);
+
+        /** Removes all messages. */
+        void clear();
+
+        /** Calls `fn` on every queued message. */
+        template <class FN>
+        void forEach(FN fn) const {
+            for (auto &msg : _acks)
+                fn(msg.get());
+            for (auto &cls : _classes)
+                for (auto &lane : cls.lanes)
+                    lane.forEach(fn);
+        }
+
+    private:
+        enum LaneID {kNormalLane = 0, kUrgentLane = 1};
+
+        /** A lane of messages, either FIFO or ordered by bytes remaining. */
+        class Lane {
+        public:
+            bool empty() const                  {return _fifo.empty() && _started.empty()
+                                                     && _unstarted.empty();}
+            void push(MessageOut*, bool srf, uint64_t seq);
+            Retained<MessageOut> pop(unsigned maxActive);
+            bool remove(MessageOut*);
+            void clear();
+
+            template <class FN>
+            void forEach(FN fn) const {
+                for (auto &msg : _fifo)
+                    fn(msg.get());
+                for (auto &e : _started)
+                    fn(e.msg.get());
+                for (auto &e : _unstarted)
+                    fn(e.msg.get());
+            }
+
+        private:
+            struct Entry {
+                size_t remaining;               // Bytes left to send (SIZE_MAX if unknown)
+                uint64_t seq;                   // Tie-breaker, to keep equal sizes in FIFO order
+                Retained<MessageOut> msg;
+                bool operator> (const Entry &e) const {
+                    return remaining > e.remaining || (remaining == e.remaining && seq > e.seq);
+                }
+            };
+            using Heap = std::vector<Entry>;    // Min-heap ordered by Entry::operator>
+
+            static Retained<MessageOut> popHeap(Heap&);
+            static bool removeFromHeap(Heap&, MessageOut*);
+
+            std::deque<Retained<MessageOut>> _fifo;     // Messages, in round-robin mode
+            Heap _started, _unstarted;                  // Messages, in SRF mode
+        };
+
+        struct TrafficClass {
+            Lane lanes[2];                      // Normal and urgent messages
+            unsigned weight {1};                // Share of bandwidth, relative to other classes
+            ptrdiff_t deficit {0};              // Bytes it may send before its turn ends
+            bool lastPoppedUrgent {false};      // Was the last pop() from the urgent lane?
+            bool active {false};                // Is it in _active?
+
+            bool empty() const                  {return lanes[0].empty() && lanes[1].empty();}
+            LaneID nextLane() const;
+        };
+
+        static unsigned classOf(const MessageOut *msg);
+        unsigned nextClass();
+
+        std::deque<Retained<MessageOut>> _acks; // Control frames, which go before everything else
+        TrafficClass _classes[kNumClasses];
+        std::deque<unsigned> _active;           // Round-robin ring of non-empty classes
+        bool _srf {false};                      // Shortest-remaining-first mode?
+        unsigned _maxActive {0};                // Max partly-sent messages per lane in SRF mode
+        uint64_t _pushCount {0};                // Number of push() calls, for Lane::Entry::seq
+        size_t _size {0};                       // Total # of messages
+        size_t _urgentCount {0};                // # of messages in _acks and urgent lanes
+    };
+
+} }
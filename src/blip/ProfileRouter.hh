@@ -0,0 +1,135 @@
+//
+// ProfileRouter.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "fleece/slice.hh"
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+namespace litecore { namespace blip {
+
+    /** Maps message profiles to values (request handlers.) A route is either an exact profile,
+        or a prefix followed by "*", like "sub*"; a route of just "*" matches every message,
+        even one without a profile. An exact route wins over a prefix, and a longer prefix
+        over a shorter one.
+
+        Lookups don't allocate: exact routes are found by the profile's hash, and prefix routes,
+        of which there are presumably few, are scanned longest first. */
+    template <class T>
+    class ProfileRouter {
+    public:
+        using slice = fleece::slice;
+        using alloc_slice = fleece::alloc_slice;
+
+        bool empty() const                      {return _exact.empty() && _prefixes.empty();}
+
+        /** Adds a route, replacing any existing route with the same pattern. */
+        void set(slice pattern, T value) {
+            slice prefix;
+            if (isPrefix(pattern, prefix)) {
+                auto i = findPrefix(prefix);
+                if (i != _prefixes.end()) {
+                    i->value = std::move(value);
+                } else {
+                    // Keep _prefixes sorted longest first, so find() returns the longest match:
+                    auto pos = std::find_if(_prefixes.begin(), _prefixes.end(),
+                                            [&](const Route &r) {return r.name.size < prefix.size;});
+                    _prefixes.insert(pos, Route{alloc_slice(prefix), std::move(value)});
+                }
+            } else {
+                auto &bucket = _exact[pattern.hash()];
+                auto i = findIn(bucket, pattern);
+                if (i != bucket.end())
+                    i->value = std::move(value);
+                else
+                    bucket.push_back(Route{alloc_slice(pattern), std::move(value)});
+            }
+        }
+
+        /** Removes the route with the given pattern. Returns false if there wasn't one. */
+        bool remove(slice pattern) {
+            slice prefix;
+            if (isPrefix(pattern, prefix)) {
+                auto i = findPrefix(prefix);
+                if (i == _prefixes.end())
+                    return false;
+                _prefixes.erase(i);
+            } else {
+                auto b = _exact.find(pattern.hash());
+                if (b == _exact.end())
+                    return false;
+                auto i = findIn(b->second, pattern);
+                if (i == b->second.end())
+                    return false;
+                b->second.erase(i);
+                if (b->second.empty())
+                    _exact.erase(b);
+            }
+            return true;
+        }
+
+        /** Returns the value of the best route matching a profile, or nullptr if none.
+            (`profile` is null if the message has no Profile property.) */
+        const T* find(slice profile) const {
+            if (profile.buf && !_exact.empty()) {
+                auto b = _exact.find(profile.hash());
+                if (b != _exact.end()) {
+                    for (auto &route : b->second)
+                        if (route.name == profile)
+                            return &route.value;
+                }
+            }
+            for (auto &route : _prefixes) {
+                if (route.name.size == 0 || (profile.buf && profile.hasPrefix(route.name)))
+                    return &route.value;
+            }
+            return nullptr;
+        }
+
+        void clear() {
+            _exact.clear();
+            _prefixes.clear();
+        }
+
+    private:
+        struct Route {
+            alloc_slice name;                   // Profile, or prefix (without the "*")
+            T value;
+        };
+        using Routes = std::vector<Route>;
+
+        static bool isPrefix(slice pattern, slice &outPrefix) {
+            if (pattern.size == 0 || pattern[pattern.size - 1] != '*')
+                return false;
+            outPrefix = pattern.upTo(pattern.size - 1);
+            return true;
+        }
+
+        static typename Routes::iterator findIn(Routes &routes, slice name) {
+            return std::find_if(routes.begin(), routes.end(),
+                                [&](const Route &r) {return r.name == name;});
+        }
+
+        typename Routes::iterator findPrefix(slice prefix)     {return findIn(_prefixes, prefix);}
+
+        std::unordered_map<size_t, Routes> _exact;  // Exact routes, by hash of profile
+        Routes _prefixes;                           // Prefix routes, longest first
+    };
+
+} }
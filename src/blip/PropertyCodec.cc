@@ -0,0 +1,396 @@
+//
+// PropertyCodec.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "PropertyCodec.hh"
+#include "BLIPProtocol.hh"
+#include "varint.hh"
+#include <algorithm>
+#include <stdexcept>
+#include <ctype.h>
+#include <string.h>
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore { namespace blip {
+
+    // The strings the static tokens stand for, starting with 0x01. This list is part of the
+    // protocol: entries can't ever be changed or reordered.
+    static const slice kStaticStrings[] = {
+        "Profile"_sl, "Error-Domain"_sl, "Error-Code"_sl, "BLIP"_sl, "HTTP"_sl, "Deadline"_sl,
+        "id"_sl, "rev"_sl, "sequence"_sl, "deleted"_sl, "history"_sl, "since"_sl,
+        "continuous"_sl, "batch"_sl, "digest"_sl, "compressed"_sl, "noconflicts"_sl,
+        "client"_sl, "getCheckpoint"_sl, "setCheckpoint"_sl, "subChanges"_sl, "changes"_sl,
+        "proposeChanges"_sl, "getAttachment"_sl, "proveAttachment"_sl,
+    };
+    static constexpr size_t kNumStaticStrings = sizeof(kStaticStrings) / sizeof(slice);
+    static_assert(kNumStaticStrings == PropertyTable::kFalseToken
+                                       - PropertyTable::kFirstStaticToken,
+                  "Static token table is the wrong size");
+
+    // Longest value that's worth adding to the dynamic table
+    static constexpr size_t kMaxDynamicValueSize = 64;
+
+
+    // Splits the next NUL-terminated string off the start of `in`. Returns false at the end,
+    // or if the string isn't terminated.
+    static bool nextString(slice &in, slice &str) {
+        auto end = in.findByte(0);
+        if (!end)
+            return false;
+        str = slice(in.buf, end);
+        in.setStart(end + 1);
+        return true;
+    }
+
+
+    // Returns `str` prefixed with its varint length.
+    static alloc_slice withLength(slice str) {
+        alloc_slice result(kMaxVarintLen32 + str.size);
+        size_t n = PutUVarInt((void*)result.buf, str.size);
+        memcpy((uint8_t*)result.buf + n, str.buf, str.size);
+        result.shorten(n + str.size);
+        return result;
+    }
+
+
+#pragma mark - TYPED VALUES:
+
+
+    size_t TypedValue::encodeInteger(int64_t n, char buf[kMaxSize]) {
+        buf[0] = (char)PropertyTable::kIntegerToken;
+        if (n == 0)
+            return 1;
+        uint64_t zigzag = (uint64_t(n) << 1) ^ uint64_t(n >> 63);
+        return 1 + PutUVarInt(buf + 1, zigzag);
+    }
+
+
+    size_t TypedValue::encodeBool(bool b, char buf[kMaxSize]) {
+        buf[0] = (char)(b ? PropertyTable::kTrueToken : PropertyTable::kFalseToken);
+        return 1;
+    }
+
+
+    bool TypedValue::readInteger(slice value, int64_t &result) {
+        if (value.size == 1 && (value[0] == PropertyTable::kFalseToken
+                                || value[0] == PropertyTable::kTrueToken)) {
+            result = (value[0] == PropertyTable::kTrueToken);
+            return true;
+        } else if (value.size > 0 && value[0] == PropertyTable::kIntegerToken) {
+            value.moveStart(1);
+            uint64_t zigzag = 0;
+            if (value.size > 0 && !(ReadUVarInt(&value, &zigzag) && value.size == 0))
+                return false;
+            result = int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+            return true;
+        }
+        return false;
+    }
+
+
+    slice TypedValue::text(slice value, char buf[kMaxTextSize]) {
+        if (value.size == 1 && value[0] == PropertyTable::kFalseToken)
+            return "false"_sl;
+        else if (value.size == 1 && value[0] == PropertyTable::kTrueToken)
+            return "true"_sl;
+        int64_t n;
+        if (!readInteger(value, n))
+            return unescape(value);
+        // Format the digits backwards from the end of the buffer:
+        char *end = buf + kMaxTextSize, *c = end;
+        uint64_t magnitude = (n < 0) ? 0 - uint64_t(n) : uint64_t(n);
+        do {
+            *--c = char('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+        if (n < 0)
+            *--c = '-';
+        return slice(c, end);
+    }
+
+
+#pragma mark - TABLE:
+
+
+    slice PropertyTable::staticString(uint8_t token) {
+        if (token < kFirstStaticToken || token >= kFirstStaticToken + kNumStaticStrings)
+            return nullslice;
+        return kStaticStrings[token - kFirstStaticToken];
+    }
+
+
+    uint8_t PropertyTable::staticToken(slice str) {
+        if (str.size < 2)
+            return 0;
+        for (size_t i = 0; i < kNumStaticStrings; ++i) {
+            if (kStaticStrings[i] == str)
+                return (uint8_t)(kFirstStaticToken + i);
+        }
+        return 0;
+    }
+
+
+    slice PropertyTable::get(uint64_t n) const {
+        if (n >= _entries.size())
+            return nullslice;
+        return _entries[_entries.size() - 1 - (size_t)n];
+    }
+
+
+    // Like HPACK, adding a string too big for the table just leaves the table empty.
+    void PropertyTable::add(slice str) {
+        size_t cost = str.size + kEntryOverhead;
+        while (!_entries.empty() && _size + cost > kDynamicTableSize) {
+            evicted(_entries.front(), _added - _entries.size());
+            _size -= _entries.front().size + kEntryOverhead;
+            _entries.pop_front();
+        }
+        if (cost > kDynamicTableSize)
+            return;
+        _entries.emplace_back(str);
+        _size += cost;
+        added(_entries.back(), _added++);
+    }
+
+
+#pragma mark - ENCODER:
+
+
+    alloc_slice PropertyEncoder::encode(slice properties, size_t maxDynamicSize) {
+        bool dynamic = _useDynamicTable;
+        bool changed = tokenize(properties, dynamic);
+        if (dynamic && _buffer.size() + kMaxVarintLen32 > maxDynamicSize) {
+            // Too big to be sure of fitting in the first frame, so don't touch the dynamic table:
+            dynamic = false;
+            changed = tokenize(properties, false);
+        }
+        if (!changed)
+            return nullslice;
+        for (slice str : _pending)
+            add(str);
+        _pending.clear();
+        return withLength(slice(_buffer));
+    }
+
+
+    alloc_slice PropertyEncoder::encodePlain(slice properties) {
+        // Usually there are no typed or escaped values, so check before copying anything:
+        slice in = properties, name, value;
+        bool found = false;
+        while (!found && nextString(in, name) && nextString(in, value))
+            found = TypedValue::needsEscape(value);
+        if (!found)
+            return nullslice;
+
+        string out;
+        char buf[TypedValue::kMaxTextSize];
+        in = properties;
+        while (nextString(in, name)) {
+            out.append((const char*)name.buf, name.size).push_back('\0');
+            if (!nextString(in, value))
+                break;
+            value = TypedValue::text(value, buf);
+            out.append((const char*)value.buf, value.size).push_back('\0');
+        }
+        return withLength(slice(out));
+    }
+
+
+    // Encodes the properties into _buffer, and the strings to add to the dynamic table into
+    // _pending. Returns false if the encoded properties are the same as the input.
+    bool PropertyEncoder::tokenize(slice properties, bool dynamic) {
+        _buffer.clear();
+        _pending.clear();
+        bool changed = false, isName = true;
+        slice str;
+        while (nextString(properties, str)) {
+            uint64_t index;
+            if (!isName && TypedValue::needsEscape(str)) {
+                // Typed and escaped values are already in their wire form
+                _buffer.append((const char*)str.buf, str.size);
+            } else if (uint8_t token = staticToken(str)) {
+                _buffer += (char)token;
+                changed = true;
+            } else if (dynamic && findDynamic(str, index)) {
+                char buf[kMaxVarintLen64];
+                _buffer += (char)kDynamicRefToken;
+                _buffer.append(buf, PutUVarInt(buf, relativeIndex(index) + 1));
+                changed = true;
+            } else {
+                if (dynamic && shouldAdd(str, isName)) {
+                    _buffer += (char)kDynamicAddToken;
+                    _pending.push_back(str);
+                    changed = true;
+                } else if (TypedValue::needsEscape(str)) {
+                    _buffer += (char)kEscapeToken;
+                    changed = true;
+                }
+                _buffer.append((const char*)str.buf, str.size);
+            }
+            _buffer += '\0';
+            isName = !isName;
+        }
+        return changed;
+    }
+
+
+    // Names are likely to recur, but values only if they're short and not numbers (which tend
+    // to be sequences or counts that differ in every message.)
+    bool PropertyEncoder::shouldAdd(slice str, bool isName) const {
+        if (str.size < 3 || !fits(str) || TypedValue::needsEscape(str)
+                || find(_pending.begin(), _pending.end(), str) != _pending.end())
+            return false;
+        if (isName)
+            return true;
+        if (str.size > kMaxDynamicValueSize)
+            return false;
+        for (size_t i = 0; i < str.size; ++i) {
+            if (!isdigit(str[i]) && str[i] != '-' && str[i] != '.')
+                return true;
+        }
+        return false;
+    }
+
+
+    bool PropertyEncoder::findDynamic(slice str, uint64_t &outIndex) const {
+        auto range = _index.equal_range(str.hash());
+        for (auto i = range.first; i != range.second; ++i) {
+            if (get(relativeIndex(i->second)) == str) {
+                outIndex = i->second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    void PropertyEncoder::added(slice str, uint64_t index) {
+        _index.emplace(str.hash(), index);
+    }
+
+
+    void PropertyEncoder::evicted(slice str, uint64_t index) {
+        auto range = _index.equal_range(str.hash());
+        for (auto i = range.first; i != range.second; ++i) {
+            if (i->second == index) {
+                _index.erase(i);
+                return;
+            }
+        }
+    }
+
+
+#pragma mark - DECODER:
+
+
+    void PropertyDecoder::decode(alloc_slice &properties, bool inFirstFrame) {
+        // Most messages have nothing to expand, so check before copying anything. (Typed and
+        // escaped values are stored as they arrive.)
+        bool tokenized = false, isName = true;
+        slice in = properties, str;
+        while (!tokenized && nextString(in, str)) {
+            uint8_t first = str.size > 0 ? str[0] : 0;
+            if (isName)
+                tokenized = (first != 0 && first < 0x20);
+            else
+                tokenized = (first != 0 && first < kFalseToken)
+                                || first == kDynamicRefToken || first == kDynamicAddToken;
+            isName = !isName;
+        }
+        if (!tokenized)
+            return;
+
+        string out;
+        out.reserve(2 * properties.size);
+        _pending.clear();
+        isName = true;
+        in = properties;
+        while (in.size > 0) {
+            if (!nextString(in, str))
+                throw runtime_error("message properties not null-terminated");
+            uint8_t first = str.size > 0 ? str[0] : 0;
+            slice text;
+            if (first == 0 || first >= 0x20) {
+                text = str;
+            } else if (first < kFalseToken) {
+                if (str.size != 1)
+                    throw runtime_error("invalid property token");
+                text = staticString(first);
+            } else if (first <= kIntegerToken) {
+                int64_t n;
+                if (isName || !TypedValue::readInteger(str, n))
+                    throw runtime_error("invalid typed property value");
+                out.append((const char*)str.buf, str.size);
+            } else if (first == kDynamicRefToken) {
+                if (!inFirstFrame)
+                    throw runtime_error("dynamic property token outside first frame");
+                str.moveStart(1);
+                uint64_t n;
+                if (ReadUVarInt(&str, &n) && n > 0 && str.size == 0)
+                    text = get(n - 1);
+                if (!text.buf)
+                    throw runtime_error("invalid dynamic property token");
+            } else {
+                str.moveStart(1);
+                if (first == kDynamicAddToken) {
+                    if (!inFirstFrame)
+                        throw runtime_error("dynamic property token outside first frame");
+                    _pending.push_back(str);
+                }
+                text = str;
+            }
+            if (text.buf) {
+                if (!isName && TypedValue::needsEscape(text))
+                    out += (char)kEscapeToken;
+                out.append((const char*)text.buf, text.size);
+            }
+            out += '\0';
+            if (out.size() > kMaxPropertiesSize)
+                throw runtime_error("properties excessively large");
+            isName = !isName;
+        }
+        for (slice added : _pending)
+            add(added);
+        _pending.clear();
+        properties = alloc_slice(out.data(), out.size());
+    }
+
+
+    void PropertyDecoder::decodePlain(alloc_slice &properties) {
+        slice in = properties, name, value;
+        bool found = false;
+        while (!found && nextString(in, name) && nextString(in, value))
+            found = TypedValue::needsEscape(value);
+        if (!found)
+            return;
+
+        string out;
+        in = properties;
+        while (nextString(in, name)) {
+            out.append((const char*)name.buf, name.size).push_back('\0');
+            if (!nextString(in, value))
+                break;
+            if (TypedValue::needsEscape(value))
+                out += (char)kEscapeToken;
+            out.append((const char*)value.buf, value.size).push_back('\0');
+        }
+        properties = alloc_slice(out.data(), out.size());
+    }
+
+} }
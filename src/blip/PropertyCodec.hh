@@ -0,0 +1,182 @@
+//
+// PropertyCodec.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "fleece/slice.hh"
+#include "varint.hh"
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+namespace litecore { namespace blip {
+
+    /** Property compression, used when both peers speak Connection::kWSTokenizedProtocolName.
+        Each NUL-terminated property string may be replaced by:
+        - a single byte 0x01-0x19, standing for an entry in a fixed table of common strings;
+        - a typed value 0x1A-0x1C (see TypedValue), if it's a property value;
+        - 0x1D followed by a varint n+1, standing for the n'th most recent dynamic table entry;
+        - 0x1E followed by the literal string, which is then added to the dynamic table;
+        - 0x1F followed by the literal string (an escape, if the string begins with a byte
+          below 0x20.)
+        Any other string is literal.
+
+        The dynamic table is per connection and direction, and holds up to kDynamicTableSize
+        bytes, counting 32 bytes of overhead per entry; the oldest entries are evicted to make
+        room. References are to the table as it was before the message, and a message's
+        additions are made after it's decoded, in order. Since both peers have to update the
+        table in the same order, a message may use it only if its properties are entirely in
+        its first frame; the decoder rejects any message that breaks this rule. */
+    class PropertyTable {
+    public:
+        static constexpr size_t kDynamicTableSize = 4096;
+        static constexpr size_t kEntryOverhead = 32;
+
+        static constexpr uint8_t kFirstStaticToken  = 0x01;
+        static constexpr uint8_t kFalseToken        = 0x1A;
+        static constexpr uint8_t kTrueToken         = 0x1B;
+        static constexpr uint8_t kIntegerToken      = 0x1C;
+        static constexpr uint8_t kDynamicRefToken   = 0x1D;
+        static constexpr uint8_t kDynamicAddToken   = 0x1E;
+        static constexpr uint8_t kEscapeToken       = 0x1F;
+
+        virtual ~PropertyTable() =default;
+
+        /** Returns the string a static token stands for, or nullslice if it's not one. */
+        static fleece::slice staticString(uint8_t token);
+
+        /** Returns the static token for a string, or 0 if it has none. */
+        static uint8_t staticToken(fleece::slice str);
+
+        /** Returns the n'th most recent entry of the dynamic table, or nullslice if none. */
+        fleece::slice get(uint64_t n) const;
+
+        /** Adds a string to the dynamic table, evicting old entries as necessary. */
+        void add(fleece::slice str);
+
+        static bool fits(fleece::slice str)     {return str.size + kEntryOverhead
+                                                            <= kDynamicTableSize;}
+
+    protected:
+        virtual void added(fleece::slice, uint64_t)      { }
+        virtual void evicted(fleece::slice, uint64_t)    { }
+
+        uint64_t relativeIndex(uint64_t abs) const       {return _added - 1 - abs;}
+
+    private:
+        std::deque<fleece::alloc_slice> _entries;   // Oldest first
+        uint64_t _added {0};                        // Number of entries ever added
+        size_t _size {0};                           // Size, including per-entry overhead
+    };
+
+
+    /** Property values as MessageBuilder writes them and MessageIn stores them, which is also
+        how they're sent when the peer supports tokenized properties. A value beginning with a
+        byte below 0x20 isn't literal text, but one of:
+        - kFalseToken or kTrueToken, a boolean;
+        - kIntegerToken followed by a zigzag-encoded varint, an integer; the varint is omitted
+          for zero, so that the value never contains a NUL byte;
+        - kEscapeToken followed by the literal text (which begins with a byte below 0x20.)
+        So integers and booleans don't need to be converted to text and back. */
+    class TypedValue {
+    public:
+        static constexpr size_t kMaxSize = 1 + fleece::kMaxVarintLen64;     // Encoded size
+        static constexpr size_t kMaxTextSize = 21;                  // "-9223372036854775808"
+
+        /** Writes an integer value to `buf`, returning its length. */
+        static size_t encodeInteger(int64_t, char buf[kMaxSize]);
+
+        /** Writes a boolean value to `buf`, returning its length. */
+        static size_t encodeBool(bool, char buf[kMaxSize]);
+
+        /** True if a string value would have to be escaped. */
+        static bool needsEscape(fleece::slice str)  {return str.size > 0 && str[0] < 0x20;}
+
+        /** True if the value is an integer or boolean. */
+        static bool isTyped(fleece::slice value) {
+            return value.size > 0 && value[0] >= PropertyTable::kFalseToken
+                                  && value[0] <= PropertyTable::kIntegerToken;
+        }
+
+        /** Gets the value of an integer or boolean (as 0 or 1.) Returns false if the value
+            isn't either of those, or is malformed. */
+        static bool readInteger(fleece::slice value, int64_t &result);
+
+        /** Returns a string value without its escape, if any. */
+        static fleece::slice unescape(fleece::slice value) {
+            if (value.size > 0 && value[0] == PropertyTable::kEscapeToken)
+                value.moveStart(1);
+            return value;
+        }
+
+        /** Returns the value as text, formatting an integer or boolean into `buf`. */
+        static fleece::slice text(fleece::slice value, char buf[kMaxTextSize]);
+    };
+
+
+    /** Tokenizes the properties of outgoing messages. Not thread-safe. */
+    class PropertyEncoder : public PropertyTable {
+    public:
+        explicit PropertyEncoder(bool useDynamicTable)
+        :_useDynamicTable(useDynamicTable)
+        { }
+
+        /** Returns the encoded form of a message's properties, prefixed with its varint length,
+            or nullslice if encoding wouldn't change them. The dynamic table is used only if the
+            result fits in `maxDynamicSize` bytes. */
+        fleece::alloc_slice encode(fleece::slice properties, size_t maxDynamicSize);
+
+        /** Converts typed and escaped values to plain text, for a peer that doesn't support
+            tokenized properties. Returns the result prefixed with its varint length, or
+            nullslice if there's nothing to convert. */
+        static fleece::alloc_slice encodePlain(fleece::slice properties);
+
+    protected:
+        virtual void added(fleece::slice, uint64_t) override;
+        virtual void evicted(fleece::slice, uint64_t) override;
+
+    private:
+        bool tokenize(fleece::slice properties, bool dynamic);
+        bool shouldAdd(fleece::slice str, bool isName) const;
+        bool findDynamic(fleece::slice str, uint64_t &outIndex) const;
+
+        bool const _useDynamicTable;
+        std::unordered_multimap<size_t, uint64_t> _index;  // Hash -> absolute index of entry
+        std::vector<fleece::slice> _pending;               // Strings to add after encoding
+        std::string _buffer;                               // Encoded properties
+    };
+
+
+    /** Expands the tokenized properties of incoming messages. Not thread-safe. */
+    class PropertyDecoder : public PropertyTable {
+    public:
+        /** Expands the tokens in a message's properties, in place. `inFirstFrame` should be
+            true if the properties were entirely contained in the message's first frame.
+            Throws std::runtime_error if they're malformed. */
+        void decode(fleece::alloc_slice &properties, bool inFirstFrame);
+
+        /** Escapes any plain-text values that would be mistaken for typed ones, for a peer that
+            doesn't support tokenized properties. */
+        static void decodePlain(fleece::alloc_slice &properties);
+
+    private:
+        std::vector<fleece::slice> _pending;        // Strings to add after decoding
+    };
+
+} }
@@ -67,8 +67,11 @@ namespace litecore { namespace blip {
             If they aren't equal, throws an exception. */
         void readAndVerifyChecksum(slice &input) const;
 
-    protected:
+        /** Adds data to the checksum without writing it anywhere. Used in Mode::Raw when the
+            caller sends the data itself instead of having the codec copy it. */
         void addToChecksum(slice data);
+
+    protected:
         void _writeRaw(slice &input, slice &output);
 
         uint32_t _checksum {0};
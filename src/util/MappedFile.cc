@@ -0,0 +1,208 @@
+//
+// MappedFile.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "MappedFile.hh"
+#include "Error.hh"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+    #define NOMINMAX
+#endif
+    #include <io.h>
+    #include <share.h>
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore {
+
+#ifdef _WIN32
+    static int openForReading(const char *path) {
+        int fd = -1;
+        _sopen_s(&fd, path, _O_RDONLY | _O_BINARY | _O_SEQUENTIAL, _SH_DENYWR, 0);
+        return fd;
+    }
+
+    static int64_t fileSize(int fd) {
+        struct _stat64 st;
+        return (_fstat64(fd, &st) == 0) ? st.st_size : -1;
+    }
+
+    static void closeFile(int fd)                   {_close(fd);}
+
+    static long writeFile(int fd, const void *buf, unsigned size) {
+        return _write(fd, buf, size);
+    }
+#else
+    static int openForReading(const char *path) {
+        return ::open(path, O_RDONLY);
+    }
+
+    static int64_t fileSize(int fd) {
+        struct stat st;
+        return (fstat(fd, &st) == 0) ? st.st_size : -1;
+    }
+
+    static void closeFile(int fd)                   {::close(fd);}
+
+    static long writeFile(int fd, const void *buf, unsigned size) {
+        return (long)::write(fd, buf, size);
+    }
+#endif
+
+
+#pragma mark - MAPPED FILE:
+
+
+    MappedFile::MappedFile(const string &path) {
+        int fd = openForReading(path.c_str());
+        if (fd < 0)
+            error::_throwErrno("Can't open %s", path.c_str());
+        try {
+            int64_t size = fileSize(fd);
+            if (size < 0)
+                error::_throwErrno("Can't get size of %s", path.c_str());
+            map(fd, (size_t)size);
+        } catch (...) {
+            closeFile(fd);
+            throw;
+        }
+        _fd = fd;                   // (The mapping doesn't need it, but truncated() does)
+    }
+
+
+    MappedFile::MappedFile(int fd, size_t size) {
+        map(fd, size);
+    }
+
+
+    bool MappedFile::truncated() const {
+        return _fd >= 0 && fileSize(_fd) < (int64_t)_contents.size;
+    }
+
+
+#ifdef _WIN32
+
+    void MappedFile::map(int fd, size_t size) {
+        if (size == 0)
+            return;                 // Can't map an empty file, but there's nothing to map
+        auto file = (HANDLE)_get_osfhandle(fd);
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        const void *addr = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size) : nullptr;
+        if (!addr) {
+            if (mapping)
+                CloseHandle(mapping);
+            error::_throw(error::IOError);
+        }
+        _mappingHandle = mapping;
+        _contents = slice(addr, size);
+    }
+
+
+    MappedFile::~MappedFile() {
+        if (_contents.buf)
+            UnmapViewOfFile(_contents.buf);
+        if (_mappingHandle)
+            CloseHandle(_mappingHandle);
+        if (_fd >= 0)
+            closeFile(_fd);
+    }
+
+#else
+
+    void MappedFile::map(int fd, size_t size) {
+        if (size == 0)
+            return;                 // Can't map an empty file, but there's nothing to map
+        void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+            error::_throwErrno("Can't map file");
+        (void)madvise(addr, size, MADV_SEQUENTIAL);
+        _contents = slice(addr, size);
+    }
+
+
+    MappedFile::~MappedFile() {
+        if (_contents.buf)
+            munmap((void*)_contents.buf, _contents.size);
+        if (_fd >= 0)
+            closeFile(_fd);
+    }
+
+#endif
+
+
+#pragma mark - TEMPORARY FILE:
+
+
+    static string defaultTempDirectory() {
+#ifdef _WIN32
+        char path[MAX_PATH + 1];
+        DWORD len = GetTempPathA(sizeof(path), path);
+        return (len > 0 && len < sizeof(path)) ? string(path, len) : string(".");
+#else
+        const char *dir = getenv("TMPDIR");
+        return (dir && *dir) ? string(dir) : string("/tmp");
+#endif
+    }
+
+
+    TemporaryFile::TemporaryFile(const string &directory) {
+        string path = directory.empty() ? defaultTempDirectory() : directory;
+        if (path.back() != '/' && path.back() != '\\')
+            path += '/';
+        path += "BLIP_XXXXXX";
+#ifdef _WIN32
+        if (_mktemp_s(&path[0], path.size() + 1) == 0)
+            _sopen_s(&_fd, path.c_str(),
+                     _O_CREAT | _O_EXCL | _O_RDWR | _O_BINARY | _O_TEMPORARY,
+                     _SH_DENYNO, _S_IREAD | _S_IWRITE);
+        if (_fd < 0)
+            error::_throwErrno("Can't create temporary file %s", path.c_str());
+#else
+        _fd = mkstemp(&path[0]);
+        if (_fd < 0)
+            error::_throwErrno("Can't create temporary file %s", path.c_str());
+        ::unlink(path.c_str());     // The file lives on, nameless, until it's closed & unmapped
+#endif
+    }
+
+
+    TemporaryFile::~TemporaryFile() {
+        if (_fd >= 0)
+            closeFile(_fd);
+    }
+
+
+    void TemporaryFile::write(slice data) {
+        while (data.size > 0) {
+            long n = writeFile(_fd, data.buf, (unsigned)min(data.size, size_t(1) << 30));
+            if (n < 0)
+                error::_throwErrno("Can't write to temporary file");
+            data.moveStart(n);
+            _size += n;
+        }
+    }
+
+}
@@ -0,0 +1,85 @@
+//
+// MappedFile.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "RefCounted.hh"
+#include "fleece/slice.hh"
+#include <string>
+
+namespace litecore {
+
+    /** A file mapped read-only into memory. The mapping lasts as long as the object, so
+        retaining it keeps slices of its contents valid. The OS is told the file will be read
+        sequentially, so it reads ahead of the pages being accessed.
+        If the file is truncated while it's mapped, reading a page past its new end raises
+        SIGBUS, which kills the process; see truncated(). */
+    class MappedFile : public fleece::RefCounted {
+    public:
+        /** Maps the file at `path`. Throws if it can't be opened or mapped. */
+        explicit MappedFile(const std::string &path);
+
+        /** Maps the first `size` bytes of an open file. The caller still owns `fd`. */
+        MappedFile(int fd, size_t size);
+
+        fleece::slice contents() const          {return _contents;}
+
+        /** True if the file's now shorter than its mapped contents, so they mustn't be read.
+            Only a file mapped by path is checked; this costs a system call. */
+        bool truncated() const;
+
+    protected:
+        virtual ~MappedFile();
+
+    private:
+        void map(int fd, size_t size);
+
+        fleece::slice _contents;
+        int _fd {-1};                           // Descriptor of a file mapped by path
+#ifdef _WIN32
+        void *_mappingHandle {nullptr};
+#endif
+    };
+
+
+    /** An anonymous temporary file, written sequentially and then mapped into memory. It's
+        deleted from its directory right away (or on Windows, as soon as it's closed), so it
+        goes away with the last reference to it, even if the process crashes. */
+    class TemporaryFile {
+    public:
+        /** Creates the file in `directory`, or the system's temporary directory if that's
+            empty. Throws if it can't be created. */
+        explicit TemporaryFile(const std::string &directory);
+        ~TemporaryFile();
+
+        size_t size() const                     {return _size;}
+
+        /** Appends data to the file. Throws on error (such as a full disk.) */
+        void write(fleece::slice data);
+
+        /** Maps the data written so far into memory. */
+        fleece::Retained<MappedFile> map()      {return new MappedFile(_fd, _size);}
+
+    private:
+        TemporaryFile(const TemporaryFile&) =delete;
+        TemporaryFile& operator=(const TemporaryFile&) =delete;
+
+        int _fd {-1};
+        size_t _size {0};
+    };
+
+}
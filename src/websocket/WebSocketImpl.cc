@@ -111,19 +111,7 @@ namespace litecore { namespace websocket {
                 return false;
             if (_framing) {
                 frame.resize(message.size + 10); // maximum space needed
-                size_t newSize;
-                if (role() == Role::Server) {
-                    newSize = ServerProtocol::formatMessage((char*)frame.buf,
-                                                            (const char*)message.buf, message.size,
-                                                            (uWS::OpCode)opcode, message.size,
-                                                            false);
-                } else {
-                    newSize = ClientProtocol::formatMessage((char*)frame.buf,
-                                                            (const char*)message.buf, message.size,
-                                                            (uWS::OpCode)opcode, message.size,
-                                                            false);
-                }
-                frame.shorten(newSize);
+                frame.shorten(formatMessage((void*)frame.buf, message, opcode));
             } else {
                 DebugAssert(opcode == uWS::BINARY);
                 frame = message;
@@ -138,6 +126,148 @@ namespace litecore { namespace websocket {
     }
 
 
+    // Sends multiple messages while taking the lock only once. With framing, the frames are
+    // handed to the transport in a single sendSegments call; segments that have owners (or
+    // holders) are passed along without being copied, except in the client role, where they
+    // have to be masked. Without framing, the transport does the framing, so each message is
+    // sent separately.
+    bool WebSocketImpl::sendBatch(const std::vector<MessageSegment> &segments, bool binary) {
+        int opcode = binary ? uWS::BINARY : uWS::TEXT;
+        vector<MessageSegment> output;
+        vector<alloc_slice> messages;
+        bool writeable;
+        {
+            lock_guard<std::mutex> lock(_mutex);
+            if (_closeSent)
+                return false;
+            if (_framing) {
+                // Scratch space holds the frame headers, plus any bytes that must be copied:
+                size_t scratchSize = 0;
+                for (auto &seg : segments) {
+                    if (!seg.owned() || role() == Role::Client)
+                        scratchSize += seg.data.size;
+                    if (seg.endOfMessage)
+                        scratchSize += 14;      // maximum header size
+                }
+                alloc_slice scratch(scratchSize);
+                size_t scratchUsed = 0;
+                output.reserve(segments.size() + 1);
+                size_t first = 0;
+                for (size_t i = 0; i < segments.size(); ++i) {
+                    if (segments[i].endOfMessage) {
+                        formatSegments(&segments[first], i + 1 - first, opcode,
+                                       scratch, scratchUsed, output);
+                        first = i + 1;
+                    }
+                }
+                for (auto &seg : output)
+                    _bufferedBytes += seg.data.size;
+            } else {
+                DebugAssert(opcode == uWS::BINARY);
+                size_t first = 0;
+                for (size_t i = 0; i < segments.size(); ++i) {
+                    if (segments[i].endOfMessage) {
+                        messages.push_back(gatherSegments(&segments[first], i + 1 - first));
+                        _bufferedBytes += messages.back().size;
+                        first = i + 1;
+                    }
+                }
+            }
+            writeable = (_bufferedBytes <= kSendBufferSize);
+        }
+        // As in sendOp, call sendBytes without holding the lock:
+        if (_framing) {
+            if (!output.empty())
+                sendSegments(move(output));
+        } else {
+            for (auto &message : messages)
+                sendBytes(message);
+        }
+        return writeable;
+    }
+
+
+    // Appends a WebSocket frame containing the concatenation of the segments to `output`.
+    // The header, and any segments that aren't owned or need masking, are copied into `scratch`;
+    // owned segments are referenced as-is.
+    void WebSocketImpl::formatSegments(const MessageSegment *segments, size_t count, int opcode,
+                                       alloc_slice &scratch, size_t &scratchUsed,
+                                       vector<MessageSegment> &output)
+    {
+        size_t length = 0;
+        for (size_t i = 0; i < count; ++i)
+            length += segments[i].data.size;
+
+        // Appends bytes from `scratch` to the output, merging with the previous segment if it's
+        // contiguous with it:
+        auto addScratch = [&](size_t start) {
+            slice bytes((char*)scratch.buf + start, (char*)scratch.buf + scratchUsed);
+            if (!output.empty() && output.back().owner.buf == scratch.buf
+                                && output.back().data.end() == bytes.buf)
+                output.back().data.setSize(output.back().data.size + bytes.size);
+            else
+                output.emplace_back(bytes, scratch, false);
+        };
+
+        size_t start = scratchUsed;
+        char *header = (char*)scratch.buf + scratchUsed;
+        if (role() == Role::Server) {
+            scratchUsed += ServerProtocol::formatMessage(header, nullptr, 0,
+                                                         (uWS::OpCode)opcode, length, false);
+            for (size_t i = 0; i < count; ++i) {
+                auto &seg = segments[i];
+                if (seg.owned()) {
+                    if (scratchUsed > start)
+                        addScratch(start);
+                    output.push_back(seg);
+                    output.back().endOfMessage = false;
+                    start = scratchUsed;
+                } else {
+                    memcpy((char*)scratch.buf + scratchUsed, seg.data.buf, seg.data.size);
+                    scratchUsed += seg.data.size;
+                }
+            }
+        } else {
+            // Client frames are masked, so everything has to be copied:
+            scratchUsed += ClientProtocol::formatMessage(header, nullptr, 0,
+                                                         (uWS::OpCode)opcode, length, false);
+            const char *mask = (const char*)scratch.buf + scratchUsed - 4;
+            char *dst = (char*)scratch.buf + scratchUsed;
+            size_t i = 0;
+            for (size_t s = 0; s < count; ++s) {
+                auto src = (const char*)segments[s].data.buf;
+                for (size_t n = segments[s].data.size; n > 0; --n)
+                    *dst++ = *src++ ^ mask[i++ % 4];
+            }
+            scratchUsed += length;
+        }
+        if (scratchUsed > start)
+            addScratch(start);
+    }
+
+
+    void WebSocketImpl::sendSegments(std::vector<MessageSegment> segments) {
+        sendBytes(gatherSegments(segments.data(), segments.size()));
+    }
+
+
+    // Writes a WebSocket frame containing `message` to `dst`, which must have room for
+    // message.size + 10 bytes. Returns the length of the frame.
+    size_t WebSocketImpl::formatMessage(void *dst, fleece::slice message, int opcode) {
+        if (role() == Role::Server) {
+            return ServerProtocol::formatMessage((char*)dst,
+                                                 (const char*)message.buf, message.size,
+                                                 (uWS::OpCode)opcode, message.size,
+                                                 false);
+        } else {
+            return ClientProtocol::formatMessage((char*)dst,
+                                                 (const char*)message.buf, message.size,
+                                                 (uWS::OpCode)opcode, message.size,
+                                                 false);
+        }
+    }
+
+
     void WebSocketImpl::onWriteComplete(size_t size) {
         bool notify, disconnect;
         {
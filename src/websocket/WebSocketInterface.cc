@@ -54,4 +54,36 @@ namespace litecore { namespace websocket {
         connect();
     }
 
+
+    bool WebSocket::sendBatch(const std::vector<MessageSegment> &segments, bool binary) {
+        bool writeable = true;
+        size_t first = 0;
+        for (size_t i = 0; i < segments.size(); ++i) {
+            if (segments[i].endOfMessage) {
+                if (i == first)
+                    writeable = send(segments[i].data, binary);
+                else
+                    writeable = send(gatherSegments(&segments[first], i + 1 - first), binary);
+                first = i + 1;
+            }
+        }
+        DebugAssert(first == segments.size());      // last segment must end a message
+        return writeable;
+    }
+
+
+    alloc_slice gatherSegments(const MessageSegment *segments, size_t count) {
+        if (count == 1 && segments[0].data.buf == segments[0].owner.buf
+                       && segments[0].data.size == segments[0].owner.size)
+            return segments[0].owner;
+        size_t size = 0;
+        for (size_t i = 0; i < count; ++i)
+            size += segments[i].data.size;
+        alloc_slice result(size);
+        slice out(result);
+        for (size_t i = 0; i < count; ++i)
+            out.writeFrom(segments[i].data);
+        return result;
+    }
+
 } }
@@ -0,0 +1,767 @@
+//
+// BLIPBenchmark.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "MessageQueue.hh"
+#include "MessageOut.hh"
+#include "BLIPConnection.hh"
+#include "LoopbackProvider.hh"
+#include "Codec.hh"
+#include "PropertyCodec.hh"
+#include "Stopwatch.hh"
+#include "StringUtil.hh"
+#include "varint.hh"
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace fleece;
+using namespace litecore;
+using namespace litecore::blip;
+using namespace litecore::websocket;
+
+
+#pragma mark - OUTBOX SCHEDULER:
+
+
+// A MessageOut with an endless body, so it stays in the outbox forever.
+class BenchMessage : public MessageOut {
+public:
+    BenchMessage(MessageNo n, bool urgent)
+    :MessageOut(nullptr, (FrameFlags)(kRequestType | (urgent ? kUrgent : 0) | kNoReply),
+                alloc_slice(size_t(2)), &endlessBody, n)
+    { }
+
+    // Writes one tiny frame, the way BLIPIO::writeToWebSocket() would.
+    void sendFrame(Codec &codec) {
+        uint8_t buf[64];
+        slice out(buf, sizeof(buf));
+        FrameFlags flags;
+        nextFrameToSend(codec, out, flags);
+        started = true;
+    }
+
+    bool started {false};
+
+private:
+    static int endlessBody(void *buf, size_t capacity) {
+        memset(buf, 'x', capacity);
+        return (int)capacity;
+    }
+};
+
+
+// The vector-based outbox that MessageQueue replaced, for comparison.
+class VectorQueue : public vector<Retained<BenchMessage>> {
+public:
+    Retained<BenchMessage> pop() {
+        if (empty())
+            return nullptr;
+        Retained<BenchMessage> msg(front());
+        erase(begin());
+        return msg;
+    }
+
+    void push(BenchMessage *msg) {
+        auto i = end();
+        if (msg->urgent() && size() > 1) {
+            const bool isNew = !msg->started;
+            do {
+                --i;
+                if ((*i)->urgent()) {
+                    if ((i+1) != end())
+                        ++i;
+                    break;
+                } else if (isNew && !(*i)->started) {
+                    break;
+                }
+            } while (i != begin());
+            ++i;
+        }
+        emplace(i, msg);
+    }
+};
+
+
+// Fills a queue with `depth` messages (every 8th one urgent), then times `ops` rounds of
+// pop / send a frame / requeue. Returns nanoseconds per round.
+template <class QUEUE>
+static double benchOutbox(size_t depth, size_t ops) {
+    Deflater codec(Deflater::NoCompression);
+    QUEUE queue;
+    for (size_t i = 1; i <= depth; ++i)
+        queue.push(new BenchMessage(i, (i % 8) == 0));
+
+    Stopwatch st;
+    for (size_t i = 0; i < ops; ++i) {
+        Retained<BenchMessage> msg((BenchMessage*)queue.pop().get());
+        msg->sendFrame(codec);
+        queue.push(msg);
+    }
+    return st.elapsed() * 1.0e9 / ops;
+}
+
+
+static void benchmarkOutbox() {
+    printf("Outbox scheduler: pop + frame + requeue, ns per frame\n");
+    printf("%10s %14s %14s %9s\n", "depth", "vector", "MessageQueue", "speedup");
+    for (size_t depth : {size_t(10), size_t(1000), size_t(100000)}) {
+        size_t ops = max(depth * 4, size_t(100000));
+        double oldTime = benchOutbox<VectorQueue>(depth, ops);
+        double newTime = benchOutbox<MessageQueue>(depth, ops);
+        printf("%10zu %14.1f %14.1f %8.1fx\n", depth, oldTime, newTime, oldTime / newTime);
+    }
+    printf("\n");
+}
+
+
+#pragma mark - COMPLETION TIMES:
+
+
+// Records the time at which each incoming request finishes arriving (and, if `handlerDelay` is
+// set, has been handled by a handler that takes that long.)
+class CompletionRecorder : public ConnectionDelegate {
+public:
+    explicit CompletionRecorder(size_t expected)
+    :_remaining(expected)
+    { }
+
+    void onConnect() override {
+        unique_lock<mutex> lock(_mutex);
+        _connected = true;
+        _cond.notify_all();
+    }
+
+    void onClose(Connection::CloseStatus, Connection::State) override {
+        unique_lock<mutex> lock(_mutex);
+        _closed = true;
+        _cond.notify_all();
+    }
+
+    void onRequestReceived(MessageIn *request) override {
+        if (handlerDelay > 0)
+            this_thread::sleep_for(chrono::duration<double>(handlerDelay));
+        unique_lock<mutex> lock(_mutex);
+        _times.push_back(_stopwatch.elapsed());
+        if (--_remaining == 0)
+            _cond.notify_all();
+    }
+
+    void waitForConnect() {
+        unique_lock<mutex> lock(_mutex);
+        _cond.wait(lock, [&]{return _connected;});
+    }
+
+    void waitForClose() {
+        unique_lock<mutex> lock(_mutex);
+        _cond.wait(lock, [&]{return _closed;});
+    }
+
+    void startClock() {
+        unique_lock<mutex> lock(_mutex);
+        _stopwatch.reset();
+    }
+
+    vector<double> waitForAll() {
+        unique_lock<mutex> lock(_mutex);
+        _cond.wait(lock, [&]{return _remaining == 0;});
+        return _times;
+    }
+
+    double handlerDelay {0};
+
+private:
+    mutex _mutex;
+    condition_variable _cond;
+    bool _connected {false}, _closed {false};
+    size_t _remaining;
+    Stopwatch _stopwatch;
+    vector<double> _times;
+};
+
+
+// A pair of Connections talking over loopback WebSockets with simulated latency.
+struct LoopbackPair {
+    CompletionRecorder sender, receiver;
+    Retained<Connection> conn1, conn2;
+
+    LoopbackPair(size_t expected, actor::delay_t latency =actor::delay_t::zero())
+    :sender(0)
+    ,receiver(expected)
+    {
+        Retained<WebSocket> ws1 = new LoopbackWebSocket(alloc_slice("ws://sender/"),
+                                                        Role::Client, latency);
+        Retained<WebSocket> ws2 = new LoopbackWebSocket(alloc_slice("ws://receiver/"),
+                                                        Role::Server, latency);
+        LoopbackWebSocket::bind(ws1, ws2);
+        conn1 = new Connection(ws1, AllocedDict(), sender);
+        conn2 = new Connection(ws2, AllocedDict(), receiver);
+    }
+
+    void start() {
+        conn1->start();
+        conn2->start();
+        sender.waitForConnect();
+        receiver.waitForConnect();
+    }
+
+    // Closes the connection, and waits until both delegates have been told.
+    void close() {
+        conn1->close();
+        sender.waitForClose();
+        receiver.waitForClose();
+    }
+};
+
+
+// Sends `count` large requests of assorted sizes over a loopback connection, and returns the
+// time (in seconds) each one took to arrive, sorted.
+static vector<double> sendLargeMessages(const Connection::SchedulingPolicy &policy,
+                                        size_t count)
+{
+    LoopbackPair pair(count);
+    auto &receiver = pair.receiver;
+    pair.conn1->setSchedulingPolicy(policy);
+    pair.start();
+
+    string body(64 * 1024 * 10, 'x');
+    receiver.startClock();
+    for (size_t i = 0; i < count; ++i) {
+        MessageBuilder msg({{"Profile"_sl, "bench"_sl}});
+        msg.noreply = true;
+        msg << slice(body.data(), 64 * 1024 * (1 + i % 10));     // 64KB ... 640KB
+        pair.conn1->sendRequest(msg);
+    }
+    vector<double> times = receiver.waitForAll();
+    pair.close();
+    sort(times.begin(), times.end());
+    return times;
+}
+
+
+static void benchmarkCompletionTimes() {
+    static const size_t kCount = 100;
+    printf("Completion time of %zu large messages sent at once, ms\n", kCount);
+    printf("%24s %10s %10s %10s\n", "scheduling", "mean", "p99", "last");
+    Connection::SchedulingPolicy roundRobin, srf;
+    srf.shortestRemainingFirst = true;
+    for (auto policy : {&roundRobin, &srf}) {
+        vector<double> times = sendLargeMessages(*policy, kCount);
+        double total = 0;
+        for (double t : times)
+            total += t;
+        printf("%24s %10.1f %10.1f %10.1f\n",
+               (policy->shortestRemainingFirst ? "shortest-remaining-first" : "round-robin"),
+               total / times.size() * 1000.0,
+               times[times.size() * 99 / 100] * 1000.0,
+               times.back() * 1000.0);
+    }
+    printf("\n");
+}
+
+
+#pragma mark - FLOW CONTROL:
+
+
+// Sends one large message over a loopback connection with the given round-trip time, and
+// returns the throughput in MB/sec. Also returns the final flow-control window.
+static double sendOneMessage(double rtt, size_t messageSize, size_t &outWindow) {
+    auto latency = chrono::duration_cast<actor::delay_t>(chrono::duration<double>(rtt / 2));
+    LoopbackPair pair(1, latency);
+    pair.start();
+
+    string body(messageSize, 'x');
+    pair.receiver.startClock();
+    MessageBuilder msg({{"Profile"_sl, "bench"_sl}});
+    msg.noreply = true;
+    msg << slice(body);
+    pair.conn1->sendRequest(msg);
+    double time = pair.receiver.waitForAll().back();
+    outWindow = pair.conn1->flowWindow();
+    pair.close();
+    return messageSize / time / 1.0e6;
+}
+
+
+static void benchmarkFlowControl() {
+    static const size_t kMessageSize = 64 * 1024 * 1024;
+    printf("Throughput of one %zuMB message vs. round-trip time\n", kMessageSize >> 20);
+    printf("%8s %10s %14s %18s\n", "RTT ms", "MB/sec", "final window", "fixed 128KB limit");
+    for (double rtt : {0.0, 0.010, 0.040, 0.080, 0.160}) {
+        size_t window;
+        double mbps = sendOneMessage(rtt, kMessageSize, window);
+        if (rtt > 0)
+            printf("%8.0f %10.1f %14zu %18.1f\n", rtt * 1000, mbps, window, 0.128 / rtt);
+        else
+            printf("%8.0f %10.1f %14zu %18s\n", rtt * 1000, mbps, window, "-");
+    }
+    printf("\n");
+}
+
+
+#pragma mark - REQUEST DISPATCH:
+
+
+// Sends `count` small requests to a receiver whose handler takes `delay` seconds, and returns
+// the time it takes for all of them to be handled.
+static double handleSlowRequests(unsigned workers, size_t count, double delay) {
+    LoopbackPair pair(count);
+    pair.receiver.handlerDelay = delay;
+    Connection::DispatchPolicy policy;
+    policy.workers = workers;
+    pair.conn2->setDispatchPolicy(policy);
+    pair.start();
+
+    pair.receiver.startClock();
+    for (size_t i = 0; i < count; ++i) {
+        MessageBuilder msg({{"Profile"_sl, "bench"_sl}});
+        msg.noreply = true;
+        msg << "hi"_sl;
+        pair.conn1->sendRequest(msg);
+    }
+    double time = pair.receiver.waitForAll().back();
+    pair.close();
+    return time;
+}
+
+
+static void benchmarkDispatch() {
+    static const size_t kCount = 200;
+    static const double kDelay = 0.002;
+    printf("Handling %zu requests with a %.0fms handler, ms\n", kCount, kDelay * 1000);
+    printf("%24s %10s\n", "handlers run on", "total");
+    for (unsigned workers : {0u, 4u, 16u}) {
+        double time = handleSlowRequests(workers, kCount, kDelay);
+        string where = workers ? format("%u workers", workers) : string("I/O thread");
+        printf("%24s %10.1f\n", where.c_str(), time * 1000.0);
+    }
+    printf("\n");
+}
+
+
+#pragma mark - FILE BODIES:
+
+
+// Sends a file as the body of one request, either through a MessageDataSource that reads it
+// or with MessageBuilder::writeFile, and returns the throughput in MB/sec.
+static double sendFile(const char *path, size_t fileSize, bool mapped) {
+    LoopbackPair pair(1);
+    pair.start();
+
+    pair.receiver.startClock();
+    MessageBuilder msg({{"Profile"_sl, "bench"_sl}});
+    msg.noreply = true;
+    FILE *in = nullptr;
+    if (mapped) {
+        msg.writeFile(path);
+    } else {
+        in = fopen(path, "rb");
+        msg.dataSource = [in](void *buf, size_t capacity) {
+            return (int)fread(buf, 1, capacity, in);
+        };
+    }
+    pair.conn1->sendRequest(msg);
+    double time = pair.receiver.waitForAll().back();
+    pair.close();
+    if (in)
+        fclose(in);
+    return fileSize / time / 1.0e6;
+}
+
+
+static void benchmarkFileBodies() {
+    static const size_t kFileSize = 64 * 1024 * 1024;
+    static const char *kPath = "/tmp/BLIPBenchmark_body";
+    FILE *out = fopen(kPath, "wb");
+    if (!out)
+        return;
+    string chunk(1024 * 1024, 'x');
+    for (size_t i = 0; i < kFileSize / chunk.size(); ++i)
+        fwrite(chunk.data(), 1, chunk.size(), out);
+    fclose(out);
+
+    printf("Throughput of a %zuMB file body, MB/sec\n", kFileSize >> 20);
+    printf("%24s %10s\n", "sent with", "MB/sec");
+    printf("%24s %10.1f\n", "MessageDataSource", sendFile(kPath, kFileSize, false));
+    printf("%24s %10.1f\n", "writeFile (mmap)", sendFile(kPath, kFileSize, true));
+    printf("\n");
+    remove(kPath);
+}
+
+
+#pragma mark - PROPERTY LOOKUP:
+
+
+// The strlen-based scan that MessageIn::property() used to do, for comparison.
+static slice scanForProperty(slice properties, slice name) {
+    auto key = (const char*)properties.buf;
+    auto end = (const char*)properties.end();
+    while (key < end) {
+        auto endOfKey = key + strlen(key);
+        auto val = endOfKey + 1;
+        if (val >= end)
+            break;
+        auto endOfVal = val + strlen(val);
+        if (name == slice(key, endOfKey))
+            return slice(val, endOfVal);
+        key = endOfVal + 1;
+    }
+    return nullslice;
+}
+
+
+static void benchmarkPropertyLookup() {
+    static const size_t kRounds = 1000000;
+    // Typical replication-style properties; look up each of them once per round:
+    static const size_t kCount = 10;
+    const char* const names[kCount] = {"Profile", "sequence", "history", "deleted", "revocation",
+                                       "Error-Domain", "Error-Code", "id", "rev",
+                                       "noconflicts"};
+    string encoded;
+    for (auto name : names) {
+        encoded.append(name).push_back('\0');
+        encoded.append("some-longish-property-value").push_back('\0');
+    }
+    slice properties(encoded);
+
+    size_t found = 0;
+    Stopwatch st;
+    for (size_t i = 0; i < kRounds; ++i)
+        for (auto name : names)
+            found += scanForProperty(properties, slice(name)).size;
+    double oldTime = st.elapsed();
+
+    st.reset();
+    for (size_t i = 0; i < kRounds; ++i) {
+        PropertyIndex index;                    // (Built once per message, as in MessageIn)
+        index.build(properties);
+        for (auto name : names)
+            found += index.find(properties, slice(name)).size;
+    }
+    double newTime = st.elapsed();
+
+    printf("Looking up %zu properties of a message, ns per message\n", kCount);
+    printf("%14s %14s %9s\n", "strlen scan", "index", "speedup");
+    printf("%14.1f %14.1f %8.1fx\n", oldTime * 1e9 / kRounds, newTime * 1e9 / kRounds,
+           oldTime / newTime);
+    printf("\n");
+    if (found == 0)
+        abort();
+}
+
+
+#pragma mark - PROPERTY TOKENS:
+
+
+// Encodes the properties of a stream of replication-style "rev" messages, with and without the
+// dynamic table, and checks that they decode back to the original.
+static void benchmarkPropertyTokens() {
+    static const size_t kMessages = 100000;
+    vector<string> messages;
+    for (size_t i = 0; i < 100; ++i) {
+        string props;
+        auto add = [&](const char *name, string value) {
+            props.append(name).push_back('\0');
+            props.append(value).push_back('\0');
+        };
+        add("Profile", "rev");
+        add("id", format("doc-%06zu", i * 7919 % 1000000));
+        add("rev", format("%zu-%08zx", i % 5 + 1, i * 2654435761u));
+        add("sequence", format("%zu", 1000 + i));
+        add("history", format("%zu-abcdef01,%zu-23456789", i % 5, i % 5 + 1));
+        add("noconflicts", "true");
+        add("revocation-mode", "channels");
+        messages.push_back(props);
+    }
+
+    printf("Tokenizing properties of %zu messages:\n", kMessages);
+    printf("%14s %14s %14s\n", "", "bytes/msg", "ns/msg");
+    size_t plainBytes = 0;
+    for (size_t i = 0; i < kMessages; ++i)
+        plainBytes += messages[i % messages.size()].size();
+    printf("%14s %14.1f %14s\n", "plain", plainBytes / double(kMessages), "-");
+
+    for (int dynamic = 0; dynamic <= 1; ++dynamic) {
+        PropertyEncoder encoder(dynamic != 0);
+        PropertyDecoder decoder;
+        size_t bytes = 0;
+        Stopwatch st;
+        for (size_t i = 0; i < kMessages; ++i) {
+            slice props(messages[i % messages.size()]);
+            alloc_slice encoded = encoder.encode(props, 2048);
+            slice body = props;
+            if (encoded) {
+                uint32_t size;
+                body = encoded;
+                ReadUVarInt32(&body, &size);
+            }
+            alloc_slice decoded(body);
+            decoder.decode(decoded, true);
+            bytes += body.size;
+            if (decoded != props)
+                abort();
+        }
+        printf("%14s %14.1f %14.1f\n", (dynamic ? "dynamic table" : "static table"),
+               bytes / double(kMessages), st.elapsed() * 1e9 / kMessages);
+    }
+    printf("\n");
+}
+
+
+#pragma mark - TYPED PROPERTIES:
+
+
+// Round-trips integer property values (like sequence numbers) through their encoded form, as
+// text the way addProperty() and intProperty() used to, and as typed values.
+static void benchmarkTypedProperties() {
+    static const size_t kRounds = 10000000;
+    int64_t total = 0;
+    Stopwatch st;
+    for (size_t i = 0; i < kRounds; ++i) {
+        char buf[30];
+        slice encoded(buf, sprintf(buf, "%lld", (long long)(i * 7919)));
+        string copy(encoded);                   // (intProperty needed a NUL-terminated copy)
+        total += strtoll(copy.c_str(), nullptr, 10);
+    }
+    double oldTime = st.elapsed();
+
+    st.reset();
+    for (size_t i = 0; i < kRounds; ++i) {
+        char buf[TypedValue::kMaxSize];
+        slice encoded(buf, TypedValue::encodeInteger(int64_t(i * 7919), buf));
+        int64_t n;
+        if (TypedValue::readInteger(encoded, n))
+            total -= n;
+    }
+    double newTime = st.elapsed();
+
+    printf("Encoding and decoding an integer property value, ns\n");
+    printf("%14s %14s %9s\n", "text", "typed", "speedup");
+    printf("%14.1f %14.1f %8.1fx\n", oldTime * 1e9 / kRounds, newTime * 1e9 / kRounds,
+           oldTime / newTime);
+    printf("\n");
+    if (total != 0)
+        abort();
+}
+
+
+#pragma mark - MESSAGE BUILDER:
+
+
+// Exposes finish(), so the benchmark can take the payload the way MessageOut does.
+struct BenchBuilder : public MessageBuilder {
+    using MessageBuilder::finish;
+};
+
+
+// Builds small requests, with a new MessageBuilder each time and with one that's reused.
+static void benchmarkMessageBuilder() {
+    static const size_t kRounds = 1000000;
+    auto build = [](BenchBuilder &mb, size_t i) {
+        mb.addProperty("Profile"_sl, "rev"_sl);
+        mb.addProperty("id"_sl, "some-document-id"_sl);
+        mb.addProperty("sequence"_sl, int64_t(i));
+        mb.write("{\"_id\":\"some-document-id\",\"value\":1234}"_sl);
+        return mb.finish().size;
+    };
+
+    size_t bytes = 0;
+    Stopwatch st;
+    for (size_t i = 0; i < kRounds; ++i) {
+        BenchBuilder mb;
+        bytes += build(mb, i);
+    }
+    double newTime = st.elapsed();
+
+    st.reset();
+    BenchBuilder mb;
+    for (size_t i = 0; i < kRounds; ++i) {
+        mb.reset();
+        bytes += build(mb, i);
+    }
+    double reusedTime = st.elapsed();
+
+    printf("Building a small request, ns\n");
+    printf("%14s %14s\n", "new builder", "reused");
+    printf("%14.1f %14.1f\n", newTime * 1e9 / kRounds, reusedTime * 1e9 / kRounds);
+    printf("\n");
+    if (bytes == 0)
+        abort();
+}
+
+
+#pragma mark - ATTACHED BODIES:
+
+
+// Sends `count` requests whose bodies are the same buffer, either copied in with write() or
+// attached by reference with attachBody(), and returns the throughput in MB/sec.
+static double sendBodies(alloc_slice body, size_t count, bool attach) {
+    LoopbackPair pair(count);
+    pair.start();
+
+    pair.receiver.startClock();
+    for (size_t i = 0; i < count; ++i) {
+        MessageBuilder msg({{"Profile"_sl, "bench"_sl}});
+        msg.noreply = true;
+        if (attach)
+            msg.attachBody(body);
+        else
+            msg.write(body);
+        pair.conn1->sendRequest(msg);
+    }
+    double time = pair.receiver.waitForAll().back();
+    pair.close();
+    return count * body.size / time / 1.0e6;
+}
+
+
+static void benchmarkAttachedBodies() {
+    static const size_t kBodySize = 256 * 1024, kCount = 256;
+    alloc_slice body(kBodySize);
+    memset((void*)body.buf, 'x', body.size);
+
+    printf("Throughput of %zu %zuKB bodies, MB/sec\n", kCount, kBodySize >> 10);
+    printf("%24s %10s\n", "sent with", "MB/sec");
+    printf("%24s %10.1f\n", "write (copied)", sendBodies(body, kCount, false));
+    printf("%24s %10.1f\n", "attachBody", sendBodies(body, kCount, true));
+    printf("\n");
+}
+
+
+#pragma mark - ENCODED MESSAGES:
+
+
+// Builds the same small request the way a server announcing a change to its peers would.
+static void buildAnnouncement(MessageBuilder &msg) {
+    msg.addProperty("Profile"_sl, "changes"_sl);
+    msg.addProperty("since"_sl, int64_t(123456));
+    msg.noreply = true;
+    msg.write("[[123457,\"some-document-id\",\"2-abcdef\"]]"_sl);
+}
+
+
+// Sends `count` copies of the request, each built anew or all from one EncodedMessage, and
+// returns the time per send in microseconds, until they've all arrived.
+static double sendAnnouncements(size_t count, bool encoded) {
+    LoopbackPair pair(count);
+    pair.start();
+
+    pair.receiver.startClock();
+    if (encoded) {
+        MessageBuilder msg;
+        buildAnnouncement(msg);
+        Retained<EncodedMessage> announcement = new EncodedMessage(msg);
+        for (size_t i = 0; i < count; ++i)
+            pair.conn1->sendRequest(announcement);
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            MessageBuilder msg;
+            buildAnnouncement(msg);
+            pair.conn1->sendRequest(msg);
+        }
+    }
+    double time = pair.receiver.waitForAll().back();
+    pair.close();
+    return time * 1.0e6 / count;
+}
+
+
+static void benchmarkEncodedMessages() {
+    static const size_t kCount = 100000;
+    printf("Sending %zu identical requests, usec per request\n", kCount);
+    printf("%24s %10s\n", "sent with", "usec");
+    printf("%24s %10.2f\n", "MessageBuilder", sendAnnouncements(kCount, false));
+    printf("%24s %10.2f\n", "EncodedMessage", sendAnnouncements(kCount, true));
+    printf("\n");
+}
+
+
+#pragma mark - BROADCAST:
+
+
+// Sends `count` announcements to each of `nConnections` peers, either building a request for
+// every connection or broadcasting one EncodedMessage, and returns the total time in msec
+// until all have arrived.
+static double broadcastAnnouncements(size_t nConnections, size_t count, bool broadcast) {
+    vector<unique_ptr<LoopbackPair>> pairs;
+    vector<Retained<Connection>> connections;
+    for (size_t i = 0; i < nConnections; ++i) {
+        pairs.emplace_back(new LoopbackPair(count));
+        pairs.back()->start();
+        connections.push_back(pairs.back()->conn1);
+    }
+
+    Stopwatch st;
+    for (auto &pair : pairs)
+        pair->receiver.startClock();
+    for (size_t n = 0; n < count; ++n) {
+        if (broadcast) {
+            MessageBuilder msg;
+            buildAnnouncement(msg);
+            Retained<EncodedMessage> announcement = new EncodedMessage(msg);
+            Broadcast::send(connections, announcement);
+        } else {
+            for (auto &connection : connections) {
+                MessageBuilder msg;
+                buildAnnouncement(msg);
+                connection->sendRequest(msg);
+            }
+        }
+    }
+    for (auto &pair : pairs)
+        pair->receiver.waitForAll();
+    double time = st.elapsed();
+    for (auto &pair : pairs)
+        pair->close();
+    return time * 1000.0;
+}
+
+
+static void benchmarkBroadcast() {
+    static const size_t kConnections = 64, kCount = 1000;
+    printf("Sending %zu requests to each of %zu connections, msec\n", kCount, kConnections);
+    printf("%24s %10s\n", "sent with", "msec");
+    printf("%24s %10.1f\n", "sendRequest loop",
+           broadcastAnnouncements(kConnections, kCount, false));
+    printf("%24s %10.1f\n", "Broadcast",
+           broadcastAnnouncements(kConnections, kCount, true));
+    printf("\n");
+}
+
+
+int main(int argc, const char * argv[]) {
+    benchmarkOutbox();
+    benchmarkCompletionTimes();
+    benchmarkFlowControl();
+    benchmarkDispatch();
+    benchmarkFileBodies();
+    benchmarkPropertyLookup();
+    benchmarkPropertyTokens();
+    benchmarkTypedProperties();
+    benchmarkMessageBuilder();
+    benchmarkAttachedBodies();
+    benchmarkEncodedMessages();
+    benchmarkBroadcast();
+    return 0;
+}
@@ -0,0 +1,2197 @@
+//
+// BLIPFunctionalTests.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "MessageIndex.hh"
+#include "MessageQueue.hh"
+#include "MessageOut.hh"
+#include "ProfileRouter.hh"
+#include "PropertyCodec.hh"
+#include "BLIPConnection.hh"
+#include "LoopbackProvider.hh"
+#include "MappedFile.hh"
+#include "Logging.hh"
+#include "varint.hh"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+    #include <direct.h>
+#else
+    #include <sys/resource.h>
+    #include <unistd.h>
+#endif
+
+using namespace std;
+using namespace fleece;
+using namespace litecore;
+using namespace litecore::blip;
+using namespace litecore::websocket;
+
+
+#pragma mark - OUTBOX:
+
+
+// A bare outgoing message, as the outbox sees it.
+class TestMessage : public MessageOut {
+public:
+    TestMessage(MessageNo n, FrameFlags flags)
+    :MessageOut(nullptr, flags, alloc_slice(size_t(2)), nullptr, n)
+    { }
+};
+
+
+// Pops every message from the queue, requeueing the ones listed in `requeue` the first time
+// they're popped (as BLIPIO does with a message that has more frames to send), and checks
+// the order they came out in.
+static bool popInOrder(MessageQueue &queue, vector<MessageNo> requeue,
+                       const vector<MessageNo> &expected)
+{
+    vector<MessageNo> popped;
+    while (Retained<MessageOut> msg = queue.pop()) {
+        popped.push_back(msg->number());
+        auto i = find(requeue.begin(), requeue.end(), msg->number());
+        if (i != requeue.end()) {
+            requeue.erase(i);
+            queue.push(msg);
+        }
+    }
+    if (popped == expected)
+        return true;
+    string order;
+    for (MessageNo n : popped)
+        order += " #" + to_string(n);
+    Warn("Outbox sent messages in the wrong order:%s", order.c_str());
+    return false;
+}
+
+
+static bool testMessageQueue() {
+    const auto normal = (FrameFlags)kRequestType;
+    const auto urgent = (FrameFlags)(kRequestType | kUrgent);
+    const auto ack = (FrameFlags)(kAckRequestType | kUrgent | kNoReply);
+    bool ok = true;
+
+    // Urgent messages go first, but each one is followed by a normal one if any are waiting;
+    // a requeued message goes to the back of its lane, and ACKs go before everything:
+    MessageQueue queue;
+    queue.push(new TestMessage(1, normal));
+    queue.push(new TestMessage(2, normal));
+    queue.push(new TestMessage(3, urgent));
+    queue.push(new TestMessage(4, urgent));
+    queue.push(new TestMessage(5, ack));
+    if (queue.size() != 5 || !queue.hasUrgent()) {
+        Warn("Outbox has %zu messages; expected 5", queue.size());
+        ok = false;
+    }
+    ok = popInOrder(queue, {3}, {5, 3, 1, 4, 2, 3}) && ok;
+    if (!queue.empty() || queue.hasUrgent()) {
+        Warn("Outbox isn't empty after popping everything");
+        ok = false;
+    }
+
+    // A removed message is never sent:
+    Retained<MessageOut> removed = new TestMessage(2, normal);
+    queue.push(new TestMessage(1, urgent));
+    queue.push(removed);
+    queue.push(new TestMessage(3, normal));
+    if (!queue.remove(removed) || queue.remove(removed)) {
+        Warn("Outbox didn't remove a message exactly once");
+        ok = false;
+    }
+    ok = popInOrder(queue, {}, {1, 3}) && ok;
+    return ok;
+}
+
+
+#pragma mark - MESSAGE INDEX:
+
+
+static bool testMessageIndex() {
+    bool ok = true;
+    MessageIndex index;
+    Retained<MessageOut> req1 = new TestMessage(1, (FrameFlags)kRequestType);
+    Retained<MessageOut> res1 = new TestMessage(1, (FrameFlags)kResponseType);
+    Retained<MessageOut> req2 = new TestMessage(2, (FrameFlags)kRequestType);
+    index.add(req1);
+    index.add(res1);
+    index.add(req2);
+
+    // A request and a response with the same number are different entries:
+    if (index.find(1, false) != req1.get() || index.find(1, true) != res1.get()
+            || index.find(2, false) != req2.get() || index.find(2, true) || index.find(3, false)) {
+        Warn("MessageIndex found the wrong messages");
+        ok = false;
+    }
+
+    // Frozen and parked messages are counted, and the counts follow removals:
+    bool frozen = false;
+    index.setFrozen(req1, true);
+    index.setParked(req2, true);
+    if (index.find(1, false, &frozen) != req1.get() || !frozen
+            || index.frozenCount() != 1 || index.parkedCount() != 1
+            || !index.isParked(req2) || index.isParked(res1)) {
+        Warn("MessageIndex lost track of frozen or parked messages");
+        ok = false;
+    }
+    if (!index.remove(req1) || index.remove(req1) || !index.remove(req2)
+            || index.frozenCount() != 0 || index.parkedCount() != 0 || index.size() != 1) {
+        Warn("MessageIndex didn't remove messages correctly");
+        ok = false;
+    }
+
+    // A message with a number that was removed can be added again:
+    Retained<MessageOut> req1b = new TestMessage(1, (FrameFlags)kRequestType);
+    index.add(req1b);
+    if (index.find(1, false) != req1b.get() || index.find(1, true) != res1.get()) {
+        Warn("MessageIndex didn't re-add a message");
+        ok = false;
+    }
+
+    index.clear();
+    if (!index.empty() || index.find(1, true)) {
+        Warn("MessageIndex isn't empty after clear()");
+        ok = false;
+    }
+    return ok;
+}
+
+
+#pragma mark - PROPERTY CODEC:
+
+
+// Builds properties in the form MessageBuilder stores them: NUL-terminated names and values,
+// with integers and booleans typed, and text beginning with a control byte escaped.
+class Props {
+public:
+    Props& add(const string &name, const string &value) {
+        append(name);
+        if (TypedValue::needsEscape(slice(value)))
+            _str += (char)PropertyTable::kEscapeToken;
+        append(value);
+        return *this;
+    }
+
+    Props& add(const string &name, int64_t value) {
+        char buf[TypedValue::kMaxSize];
+        append(name);
+        append(string(buf, TypedValue::encodeInteger(value, buf)));
+        return *this;
+    }
+
+    Props& addBool(const string &name, bool value) {
+        char buf[TypedValue::kMaxSize];
+        append(name);
+        append(string(buf, TypedValue::encodeBool(value, buf)));
+        return *this;
+    }
+
+    const string& str() const           {return _str;}
+    slice data() const                  {return slice(_str);}
+
+private:
+    void append(const string &s)        {_str += s; _str += '\0';}
+
+    string _str;
+};
+
+
+// Strips the varint length that PropertyEncoder puts in front of its output.
+static alloc_slice withoutLength(slice encoded) {
+    uint64_t length;
+    if (!ReadUVarInt(&encoded, &length) || length != encoded.size)
+        return nullslice;
+    return alloc_slice(encoded);
+}
+
+
+// Sends properties through an encoder and decoder, storing the encoded size (excluding its
+// length prefix) in `size`, and checks that the decoder restores them exactly.
+static bool roundTrip(PropertyEncoder &encoder, PropertyDecoder &decoder, const Props &props,
+                      size_t *size =nullptr)
+{
+    alloc_slice encoded = encoder.encode(props.data(), SIZE_MAX);
+    alloc_slice wire = encoded ? withoutLength(encoded) : alloc_slice(props.data());
+    if (!wire) {
+        Warn("PropertyEncoder's output has the wrong length prefix");
+        return false;
+    }
+    if (size)
+        *size = wire.size;
+    alloc_slice decoded = wire;
+    decoder.decode(decoded, true);
+    if (decoded != props.data()) {
+        Warn("PropertyDecoder didn't restore the properties");
+        return false;
+    }
+    return true;
+}
+
+
+static bool testTypedValues() {
+    bool ok = true;
+    char buf[TypedValue::kMaxSize], text[TypedValue::kMaxTextSize];
+    for (int64_t n : {int64_t(0), int64_t(1), int64_t(-1), int64_t(300), int64_t(-123456789),
+                      INT64_MAX, INT64_MIN}) {
+        slice value(buf, TypedValue::encodeInteger(n, buf));
+        int64_t result = 0;
+        if (value.findByte(0) || !TypedValue::isTyped(value)
+                || !TypedValue::readInteger(value, result) || result != n
+                || TypedValue::text(value, text) != slice(to_string(n))) {
+            Warn("Integer %lld didn't survive encoding", (long long)n);
+            ok = false;
+        }
+    }
+
+    for (bool b : {false, true}) {
+        slice value(buf, TypedValue::encodeBool(b, buf));
+        int64_t result = -1;
+        if (!TypedValue::isTyped(value) || !TypedValue::readInteger(value, result)
+                || result != b || TypedValue::text(value, text) != slice(b ? "true" : "false")) {
+            Warn("Boolean %s didn't survive encoding", (b ? "true" : "false"));
+            ok = false;
+        }
+    }
+
+    // Plain text isn't typed; text beginning with a control byte is escaped:
+    int64_t result;
+    if (TypedValue::isTyped("17"_sl) || TypedValue::readInteger("17"_sl, result)) {
+        Warn("Text was read as a typed value");
+        ok = false;
+    }
+    if (!TypedValue::needsEscape("\x05x"_sl) || TypedValue::needsEscape("x"_sl)
+            || TypedValue::unescape("\x1F\x05x"_sl) != "\x05x"_sl
+            || TypedValue::text("\x1F\x05x"_sl, text) != "\x05x"_sl) {
+        Warn("Escaped text isn't handled right");
+        ok = false;
+    }
+    return ok;
+}
+
+
+static bool testPropertyTokens() {
+    bool ok = true;
+
+    // The static table replaces common strings with single bytes:
+    if (PropertyTable::staticToken("Profile"_sl) != PropertyTable::kFirstStaticToken
+            || PropertyTable::staticString(PropertyTable::kFirstStaticToken) != "Profile"_sl
+            || PropertyTable::staticToken("NotACommonString"_sl) != 0
+            || PropertyTable::staticString(PropertyTable::kFalseToken)) {
+        Warn("Static token table is wrong");
+        ok = false;
+    }
+
+    PropertyEncoder staticEncoder(false);
+    PropertyDecoder staticDecoder;
+    Props common;
+    common.add("Profile", "getCheckpoint").add("client", "x");
+    alloc_slice wire = withoutLength(staticEncoder.encode(common.data(), SIZE_MAX));
+    // (3 tokens, "x", and 4 NULs:)
+    if (wire.size != 8 || wire[0] != PropertyTable::kFirstStaticToken) {
+        Warn("Common properties encoded to %zu bytes; expected 8", wire.size);
+        ok = false;
+    }
+    ok = roundTrip(staticEncoder, staticDecoder, common) && ok;
+
+    // Nothing to tokenize comes back as nullslice, and decodes as is:
+    Props plain;
+    plain.add("Zork", "x");
+    if (staticEncoder.encode(plain.data(), SIZE_MAX)) {
+        Warn("PropertyEncoder tokenized properties without any common strings");
+        ok = false;
+    }
+    ok = roundTrip(staticEncoder, staticDecoder, plain) && ok;
+
+    // The dynamic table makes repeated strings shorter in later messages, as long as the
+    // encoder and decoder see the same messages in the same order:
+    PropertyEncoder encoder(true);
+    PropertyDecoder decoder;
+    Props msg1, msg2;
+    msg1.add("Profile", "customProfile").add("CustomProperty", "some-value")
+        .add("Count", 12345).addBool("Flag", true).add("Control", "\x05\x06 ctl");
+    msg2.add("Profile", "customProfile").add("CustomProperty", "some-value")
+        .add("Count", -7).addBool("Flag", false).add("Control", "\x1F\x01 esc");
+    size_t size1 = 0, size2 = 0;
+    ok = roundTrip(encoder, decoder, msg1, &size1) && ok;
+    ok = roundTrip(encoder, decoder, msg2, &size2) && ok;
+    if (size2 >= size1) {
+        Warn("Dynamic table didn't shorten a repeated message (%zu bytes, then %zu)",
+             size1, size2);
+        ok = false;
+    }
+    if (!decoder.get(0) || encoder.get(0) != decoder.get(0)) {
+        Warn("Encoder's and decoder's dynamic tables differ");
+        ok = false;
+    }
+    ok = roundTrip(encoder, decoder, msg1) && ok;
+
+    // With the dynamic table too big for the first frame, the encoder leaves it alone:
+    PropertyEncoder encoder2(true);
+    PropertyDecoder decoder2;
+    encoder2.encode(msg1.data(), 4);
+    if (encoder2.get(0)) {
+        Warn("Encoder added to its dynamic table past the first frame");
+        ok = false;
+    }
+    ok = roundTrip(encoder2, decoder2, msg1) && ok;
+
+    // The decoder rejects dynamic table additions outside the first frame:
+    PropertyEncoder encoder3(true);
+    PropertyDecoder decoder3;
+    alloc_slice late = withoutLength(encoder3.encode(msg1.data(), SIZE_MAX));
+    try {
+        decoder3.decode(late, false);
+        Warn("Decoder accepted dynamic table additions past the first frame");
+        ok = false;
+    } catch (const runtime_error&) { }
+    return ok;
+}
+
+
+static bool testPlainProperties() {
+    bool ok = true;
+
+    // A peer without tokenized properties gets typed values as text, and escaped values
+    // without their escapes:
+    Props typed;
+    typed.add("Count", 42).addBool("Flag", true).add("Control", "\x05 ctl").add("Text", "hi");
+    alloc_slice plain = PropertyEncoder::encodePlain(typed.data());
+    Props expected;
+    expected.add("Count", "42").add("Flag", "true");
+    string expectedStr = expected.str() + "Control" + '\0' + "\x05 ctl" + '\0'
+                                                 + "Text" + '\0' + "hi" + '\0';
+    if (withoutLength(plain) != slice(expectedStr)) {
+        Warn("Typed properties weren't converted to text");
+        ok = false;
+    }
+
+    // ...and values from such a peer that begin with a control byte are escaped, so they
+    // aren't mistaken for typed values:
+    alloc_slice received(expectedStr);
+    PropertyDecoder::decodePlain(received);
+    Props escaped;
+    escaped.add("Count", "42").add("Flag", "true").add("Control", "\x05 ctl").add("Text", "hi");
+    if (received != escaped.data()) {
+        Warn("Text properties from an older peer weren't escaped");
+        ok = false;
+    }
+
+    // Properties with nothing to convert are left alone:
+    Props text;
+    text.add("Profile", "x");
+    if (PropertyEncoder::encodePlain(text.data())) {
+        Warn("encodePlain converted properties without typed values");
+        ok = false;
+    }
+    alloc_slice unchanged(text.data());
+    PropertyDecoder::decodePlain(unchanged);
+    if (unchanged != text.data()) {
+        Warn("decodePlain changed properties that didn't need escaping");
+        ok = false;
+    }
+    return ok;
+}
+
+
+static bool testPropertyIndex() {
+    bool ok = true;
+    Props props;
+    props.add("Profile", "x").add("Name", "value").add("Empty", "").add("Names", "more");
+    PropertyIndex index;
+    if (!index.build(props.data()) || index.empty()) {
+        Warn("PropertyIndex couldn't index well-formed properties");
+        return false;
+    }
+    if (index.find(props.data(), "Name"_sl) != "value"_sl
+            || index.find(props.data(), "Names"_sl) != "more"_sl
+            || index.find(props.data(), "Profile"_sl) != "x"_sl) {
+        Warn("PropertyIndex found the wrong values");
+        ok = false;
+    }
+    slice empty = index.find(props.data(), "Empty"_sl);
+    if (!empty.buf || empty.size != 0) {
+        Warn("PropertyIndex didn't find an empty value");
+        ok = false;
+    }
+    if (index.find(props.data(), "Nam"_sl) || index.find(props.data(), "value"_sl)
+            || index.find(props.data(), "Missing"_sl)) {
+        Warn("PropertyIndex found a property that isn't there");
+        ok = false;
+    }
+
+    // A name without a value is malformed:
+    string malformed = props.str() + "Orphan" + '\0';
+    if (index.build(slice(malformed))) {
+        Warn("PropertyIndex accepted a name without a value");
+        ok = false;
+    }
+    return ok;
+}
+
+
+#pragma mark - MESSAGE BUILDER:
+
+
+// Checks that a payload is the varint size of the properties, the properties, and the body.
+static bool checkPayload(slice payload, const Props &props, slice body) {
+    slice rest = payload;
+    uint64_t propertiesSize;
+    if (!ReadUVarInt(&rest, &propertiesSize) || propertiesSize != props.data().size
+            || rest.size < propertiesSize
+            || slice(rest.buf, size_t(propertiesSize)) != props.data()
+            || rest.from(size_t(propertiesSize)) != body) {
+        Warn("MessageBuilder's payload is wrong (%zu bytes, properties %zu bytes)",
+             payload.size, props.data().size);
+        return false;
+    }
+    return true;
+}
+
+
+static bool testMessageBuilder() {
+    bool ok = true;
+
+    // Short properties, whose size fits in one byte:
+    MessageBuilder shortMsg("getCheckpoint"_sl);
+    shortMsg.addProperty("Count"_sl, int64_t(3));
+    shortMsg << "hello"_sl;
+    Props shortProps;
+    shortProps.add("Profile", "getCheckpoint").add("Count", 3);
+    ok = checkPayload(shortMsg.finish(), shortProps, "hello"_sl) && ok;
+
+    // Properties of 128 bytes or more need a longer size, and are moved to make room:
+    string longValue(300, 'v');
+    MessageBuilder longMsg("getCheckpoint"_sl);
+    longMsg.addProperty("Long"_sl, slice(longValue));
+    longMsg << "hello"_sl;
+    Props longProps;
+    longProps.add("Profile", "getCheckpoint").add("Long", longValue);
+    ok = checkPayload(longMsg.finish(), longProps, "hello"_sl) && ok;
+
+    // No properties at all:
+    MessageBuilder bare;
+    bare << "body"_sl;
+    ok = checkPayload(bare.finish(), Props(), "body"_sl) && ok;
+    return ok;
+}
+
+
+#pragma mark - CONNECTIONS:
+
+
+// How long to wait for something that should happen, before calling it a failure
+static const auto kTimeout = chrono::seconds(10);
+
+
+// Calls `pred` (with the mutex locked) until it returns true, or kTimeout elapses.
+template <class PRED>
+static bool waitUntil(mutex &m, condition_variable &cond, PRED pred) {
+    unique_lock<mutex> lock(m);
+    return cond.wait_for(lock, kTimeout, pred);
+}
+
+
+// Records the progress notifications of an outgoing request.
+class ProgressRecorder {
+public:
+    MessageProgressCallback callback() {
+        return [this](const MessageProgress &progress) {
+            unique_lock<mutex> lock(_mutex);
+            _states.push_back(progress.state);
+            if (progress.reply)
+                _reply = progress.reply;
+            _cond.notify_all();
+        };
+    }
+
+    bool waitFor(MessageProgress::State state) {
+        return waitUntil(_mutex, _cond, [&]{return sawLocked(state);});
+    }
+
+    bool saw(MessageProgress::State state) {
+        unique_lock<mutex> lock(_mutex);
+        return sawLocked(state);
+    }
+
+    size_t count() {
+        unique_lock<mutex> lock(_mutex);
+        return _states.size();
+    }
+
+    Retained<MessageIn> reply() {
+        unique_lock<mutex> lock(_mutex);
+        return _reply;
+    }
+
+private:
+    bool sawLocked(MessageProgress::State state) const {
+        return find(_states.begin(), _states.end(), state) != _states.end();
+    }
+
+    mutex _mutex;
+    condition_variable _cond;
+    vector<MessageProgress::State> _states;
+    Retained<MessageIn> _reply;
+};
+
+
+// Records the profiles of the requests it receives, and responds to them. (Subclasses can
+// respond differently, by overriding respondTo.)
+class TestDelegate : public ConnectionDelegate {
+public:
+    virtual void onConnect() override {
+        unique_lock<mutex> lock(_mutex);
+        _connected = true;
+        _cond.notify_all();
+    }
+
+    virtual void onClose(Connection::CloseStatus, Connection::State) override {
+        unique_lock<mutex> lock(_mutex);
+        _closed = true;
+        _cond.notify_all();
+    }
+
+    virtual void onOutboxWritable() override {
+        unique_lock<mutex> lock(_mutex);
+        ++_writableCount;
+        _cond.notify_all();
+    }
+
+    virtual void onRequestReceived(MessageIn *request) override {
+        string profile = request->profile().asString();
+        Log("** Request #%llu received: %s", request->number(), profile.c_str());
+        if (!request->noReply())
+            respondTo(request);
+        unique_lock<mutex> lock(_mutex);
+        _profiles.push_back(profile);
+        _cond.notify_all();
+    }
+
+    bool waitForConnect()   {return waitUntil(_mutex, _cond, [&]{return _connected;});}
+    bool waitForClose()     {return waitUntil(_mutex, _cond, [&]{return _closed;});}
+
+    bool waitForRequests(size_t n) {
+        return waitUntil(_mutex, _cond, [&]{return _profiles.size() >= n;});
+    }
+
+    vector<string> profiles() {
+        unique_lock<mutex> lock(_mutex);
+        return _profiles;
+    }
+
+    bool waitForWritable()  {return waitUntil(_mutex, _cond, [&]{return _writableCount > 0;});}
+
+    int writableCount() {
+        unique_lock<mutex> lock(_mutex);
+        return _writableCount;
+    }
+
+protected:
+    virtual void respondTo(MessageIn *request) {
+        request->respond();
+    }
+
+    mutex _mutex;
+    condition_variable _cond;
+
+private:
+    bool _connected {false}, _closed {false};
+    int _writableCount {0};
+    vector<string> _profiles;
+};
+
+
+// Builds a dictionary of Connection options.
+class Options {
+public:
+    Options()                                   {_enc.beginDict();}
+
+    Options& set(const char *key, int64_t value) {
+        _enc.writeKey(slice(key));
+        _enc.writeInt(value);
+        return *this;
+    }
+
+    Options& set(const char *key, const string &value) {
+        _enc.writeKey(slice(key));
+        _enc.writeString(slice(value));
+        return *this;
+    }
+
+    AllocedDict dict() {
+        _enc.endDict();
+        return AllocedDict(_enc.finish());
+    }
+
+private:
+    Encoder _enc;
+};
+
+
+// A pair of Connections talking over loopback WebSockets with simulated latency. Unless
+// `legacyPeer` is true, they negotiate the BLIP_3+tokens subprotocol, as a real client and
+// server would when both support it.
+template <class DELEGATE =TestDelegate>
+struct TestPair {
+    TestDelegate sender;
+    DELEGATE receiver;
+    Retained<Connection> conn1, conn2;
+
+    explicit TestPair(chrono::milliseconds latency =chrono::milliseconds(0),
+                      bool legacyPeer =false,
+                      AllocedDict senderOptions =AllocedDict(),
+                      AllocedDict receiverOptions =AllocedDict())
+    :TestPair(new LoopbackWebSocket(alloc_slice("ws://sender/"), Role::Client, delay(latency)),
+              new LoopbackWebSocket(alloc_slice("ws://receiver/"), Role::Server, delay(latency)),
+              legacyPeer, senderOptions, receiverOptions)
+    { }
+
+    // Uses the given LoopbackWebSockets (or subclasses) instead of creating them.
+    TestPair(Retained<WebSocket> ws1, Retained<WebSocket> ws2,
+             bool legacyPeer =false,
+             AllocedDict senderOptions =AllocedDict(),
+             AllocedDict receiverOptions =AllocedDict())
+    {
+        Encoder enc;
+        enc.beginDict();
+        if (!legacyPeer) {
+            enc.writeKey("Sec-WebSocket-Protocol"_sl);
+            enc.writeString(slice(Connection::kWSTokenizedProtocolName));
+        }
+        enc.endDict();
+        LoopbackWebSocket::bind(ws1, ws2, AllocedDict(enc.finish()));
+        conn1 = new Connection(ws1, senderOptions, sender);
+        conn2 = new Connection(ws2, receiverOptions, receiver);
+    }
+
+    static actor::delay_t delay(chrono::milliseconds latency) {
+        return chrono::duration_cast<actor::delay_t>(latency);
+    }
+
+    bool start() {
+        conn1->start();
+        conn2->start();
+        if (sender.waitForConnect() && receiver.waitForConnect())
+            return true;
+        Warn("Connections didn't open");
+        return false;
+    }
+
+    bool close() {
+        conn1->close();
+        if (sender.waitForClose() && receiver.waitForClose())
+            return true;
+        Warn("Connections didn't close");
+        return false;
+    }
+
+    // Sends a request that the receiver responds to, and waits for the response. (Responses
+    // arrive in the order requests are sent, so by then earlier ones have arrived too.)
+    bool roundTrip(slice profile) {
+        MessageBuilder msg({{"Profile"_sl, profile}});
+        return roundTrip(msg);
+    }
+
+    bool roundTrip(MessageBuilder &msg) {
+        ProgressRecorder progress;
+        msg.onProgress = progress.callback();
+        conn1->sendRequest(msg);
+        if (progress.waitFor(MessageProgress::kComplete))
+            return true;
+        Warn("No response to a request");
+        return false;
+    }
+};
+
+
+static string join(const vector<string> &strings) {
+    string result;
+    for (auto &str : strings)
+        result += " " + str;
+    return result;
+}
+
+
+#pragma mark - PROPERTY ACCESS:
+
+
+// Responds to requests with properties of every kind.
+class PropertyDelegate : public TestDelegate {
+protected:
+    virtual void respondTo(MessageIn *request) override {
+        MessageBuilder response(request);
+        response.addProperty("Str"_sl, "text"_sl);
+        response.addProperty("Int"_sl, int64_t(-42));
+        response.addProperty("Text"_sl, "17"_sl);
+        response.addBoolProperty("Bool"_sl, true);
+        response.addProperty("Yes"_sl, "YES"_sl);
+        response.addProperty("Mode"_sl, "push"_sl);
+        request->respond(response);
+    }
+};
+
+
+static bool testMessageInProperties() {
+    TestPair<PropertyDelegate> pair;
+    bool ok = pair.start();
+    ProgressRecorder progress;
+    MessageBuilder msg({{"Profile"_sl, "props"_sl}});
+    msg.onProgress = progress.callback();
+    pair.conn1->sendRequest(msg);
+    Retained<MessageIn> reply;
+    if (progress.waitFor(MessageProgress::kComplete))
+        reply = progress.reply();
+    if (!reply) {
+        Warn("No response to 'props' request");
+        pair.close();
+        return false;
+    }
+
+    if (reply->property("Str"_sl) != "text"_sl || reply->property("Missing"_sl)) {
+        Warn("property() returned the wrong values");
+        ok = false;
+    }
+    if (reply->property("Int"_sl) != "-42"_sl || reply->property("Bool"_sl) != "true"_sl
+            || reply->property("Int"_sl).buf != reply->property("Int"_sl).buf) {
+        Warn("property() didn't return typed values as text");
+        ok = false;
+    }
+    if (reply->intProperty("Int"_sl) != -42 || reply->intProperty("Text"_sl) != 17
+            || reply->intProperty("Str"_sl, 7) != 7 || reply->intProperty("Missing"_sl, 7) != 7) {
+        Warn("intProperty() returned the wrong values");
+        ok = false;
+    }
+    if (!reply->boolProperty("Bool"_sl) || !reply->boolProperty("Yes"_sl)
+            || reply->boolProperty("Missing"_sl)) {
+        Warn("boolProperty() returned the wrong values");
+        ok = false;
+    }
+    if (reply->enumProperty("Mode"_sl, {"pull"_sl, "push"_sl}) != 1
+            || reply->enumProperty("Str"_sl, {"pull"_sl, "push"_sl}) != -1) {
+        Warn("enumProperty() returned the wrong values");
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+#pragma mark - BODIES:
+
+
+// Records the bodies of the requests it receives, whether they were kept in memory or
+// spilled to a file.
+class BodyDelegate : public TestDelegate {
+public:
+    alloc_slice lastBody() {
+        unique_lock<mutex> lock(_mutex);
+        return _lastBody;
+    }
+
+    bool lastBodySpilled() {
+        unique_lock<mutex> lock(_mutex);
+        return _lastBodySpilled;
+    }
+
+protected:
+    virtual void respondTo(MessageIn *request) override {
+        {
+            unique_lock<mutex> lock(_mutex);
+            Retained<MappedFile> mapped = request->mappedBody();
+            _lastBodySpilled = (mapped.get() != nullptr);
+            _lastBody = mapped ? alloc_slice(mapped->contents()) : request->body();
+        }
+        TestDelegate::respondTo(request);
+    }
+
+private:
+    alloc_slice _lastBody;
+    bool _lastBodySpilled {false};
+};
+
+
+// Sends a request and checks that the receiver got `expected` as its body.
+template <class PAIR>
+static bool checkBodyArrives(PAIR &pair, MessageBuilder &msg, const string &expected,
+                             const char *what)
+{
+    if (!pair.roundTrip(msg))
+        return false;
+    alloc_slice body = pair.receiver.lastBody();
+    if (body != slice(expected)) {
+        Warn("%s: received a body of %zu bytes; expected %zu", what, body.size, expected.size());
+        return false;
+    }
+    return true;
+}
+
+
+static bool testAttachBody() {
+    TestPair<BodyDelegate> pair;
+    bool ok = pair.start();
+    for (bool compressed : {false, true}) {
+        // Written and attached data interleaved, with attachments of all sizes, two of them
+        // in a row:
+        MessageBuilder msg({{"Profile"_sl, "attach"_sl}});
+        msg.compressed = compressed;
+        string expected;
+        msg << "prefix"_sl;
+        expected += "prefix";
+        char fill = 'a';
+        for (size_t size : {10, 3000, 200000, 5}) {
+            string data(size, fill++);
+            msg.attachBody(alloc_slice(data));
+            expected += data;
+            if (size != 200000) {
+                msg << "-sep-"_sl;
+                expected += "-sep-";
+            }
+        }
+        ok = checkBodyArrives(pair, msg, expected, "Mixed attachments") && ok;
+
+        // Many small attachments:
+        MessageBuilder many({{"Profile"_sl, "many"_sl}});
+        many.compressed = compressed;
+        expected.clear();
+        for (int i = 0; i < 1000; ++i) {
+            string data = to_string(i) + ",";
+            many.attachBody(alloc_slice(data));
+            expected += data;
+        }
+        ok = checkBodyArrives(pair, many, expected, "Many attachments") && ok;
+
+        // Only an attachment, with nothing written:
+        MessageBuilder only({{"Profile"_sl, "only"_sl}});
+        only.compressed = compressed;
+        expected = string(70000, 'z');
+        only.attachBody(alloc_slice(expected));
+        ok = checkBodyArrives(pair, only, expected, "Attachment only") && ok;
+    }
+    return pair.close() && ok;
+}
+
+
+// Uncompressed bodies are sent by reference once at least this much is left of a buffer (see
+// MessageOut.cc); check the bytes that arrive either side of it, with attachments too.
+static bool testZeroCopyBoundaries() {
+    static constexpr size_t kMinZeroCopySize = 1024;
+    bool ok = true;
+    for (bool legacyPeer : {false, true}) {
+        TestPair<BodyDelegate> pair(chrono::milliseconds(0), legacyPeer);
+        ok = pair.start() && ok;
+        for (size_t size : {kMinZeroCopySize - 1, kMinZeroCopySize, kMinZeroCopySize + 1}) {
+            string written, attached;
+            for (size_t i = 0; i < size; ++i) {
+                written += char('a' + i % 26);
+                attached += char('A' + i % 26);
+            }
+
+            MessageBuilder body({{"Profile"_sl, "written"_sl}});
+            body << slice(written);
+            ok = checkBodyArrives(pair, body, written, "Written body") && ok;
+
+            MessageBuilder attachment({{"Profile"_sl, "attached"_sl}});
+            attachment.attachBody(alloc_slice(attached));
+            ok = checkBodyArrives(pair, attachment, attached, "Attached body") && ok;
+
+            MessageBuilder mixed({{"Profile"_sl, "mixed"_sl}});
+            mixed << slice(written);
+            mixed.attachBody(alloc_slice(attached));
+            mixed.attachBody(alloc_slice(written));
+            mixed << "end"_sl;
+            ok = checkBodyArrives(pair, mixed, written + attached + written + "end",
+                                  "Mixed body") && ok;
+        }
+        ok = pair.close() && ok;
+    }
+    return ok;
+}
+
+
+// Writes `data` to a new file, returning its path, or an empty string on failure.
+static string writeTempFile(const string &data) {
+#ifdef _WIN32
+    char path[] = "BLIPFile_XXXXXX";
+    if (_mktemp_s(path, sizeof(path)) != 0)
+        return "";
+#else
+    char path[] = "/tmp/BLIPFile_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return "";
+    close(fd);
+#endif
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return "";
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = (fclose(f) == 0) && ok;
+    return ok ? path : "";
+}
+
+
+// A file body arrives intact, whether it's sent by reference or compressed, and after
+// written data or on its own.
+static bool testFileBody() {
+    TestPair<BodyDelegate> pair;
+    bool ok = pair.start();
+    char fill = 'a';
+    for (size_t size : {size_t(0), size_t(500), size_t(5000000)}) {
+        string contents(size, fill++);
+        for (size_t i = 0; i < size; i += 4093)
+            contents[i] = char(i);
+        string path = writeTempFile(contents);
+        if (path.empty()) {
+            Warn("Couldn't write a temporary file");
+            pair.close();
+            return false;
+        }
+        for (bool compressed : {false, true}) {
+            for (bool withPrefix : {false, true}) {
+                MessageBuilder msg({{"Profile"_sl, "file"_sl}});
+                msg.compressed = compressed;
+                if (withPrefix)
+                    msg << "prefix:"_sl;
+                msg.writeFile(path);
+                string expected = (withPrefix ? "prefix:" : "") + contents;
+                ok = checkBodyArrives(pair, msg, expected, "File body") && ok;
+            }
+        }
+        remove(path.c_str());
+    }
+    return pair.close() && ok;
+}
+
+
+// Makes an empty directory for spilled bodies.
+static string makeSpillDirectory() {
+#ifdef _WIN32
+    char path[] = "BLIPSpill_XXXXXX";
+    _mktemp_s(path, sizeof(path));
+    _mkdir(path);
+    return path;
+#else
+    char path[] = "/tmp/BLIPSpill_XXXXXX";
+    return mkdtemp(path) ? path : "";
+#endif
+}
+
+
+// Removes the spill directory, which only works if it's empty: the temporary files have to
+// be gone by the time the messages are.
+static bool removeSpillDirectory(const string &dir) {
+#ifdef _WIN32
+    bool removed = _rmdir(dir.c_str()) == 0;
+#else
+    bool removed = rmdir(dir.c_str()) == 0;
+#endif
+    if (!removed)
+        Warn("Spill directory %s wasn't left empty", dir.c_str());
+    return removed;
+}
+
+
+// A body that grows past the spill threshold is written to a temporary file, and is read
+// back through mappedBody(); one that doesn't stays in memory.
+static bool testSpillToDisk() {
+    static constexpr size_t kThreshold = 100000;
+    string dir = makeSpillDirectory();
+    if (dir.empty()) {
+        Warn("Couldn't create a spill directory");
+        return false;
+    }
+    bool ok;
+    {
+        TestPair<BodyDelegate> pair(chrono::milliseconds(0), false, AllocedDict(),
+                                    Options().set(Connection::kSpillThresholdOption,
+                                                  int64_t(kThreshold))
+                                             .set(Connection::kSpillDirectoryOption, dir)
+                                             .dict());
+        ok = pair.start();
+        char fill = 'a';
+        for (size_t size : {size_t(1000), kThreshold, kThreshold + 1, size_t(3000000)}) {
+            for (bool compressed : {false, true}) {
+                MessageBuilder msg({{"Profile"_sl, "spill"_sl}});
+                msg.compressed = compressed;
+                string body(size, fill++);
+                body[size / 2] = '*';
+                msg << slice(body);
+                ok = checkBodyArrives(pair, msg, body, "Spilled body") && ok;
+                bool shouldSpill = (size > kThreshold);
+                if (pair.receiver.lastBodySpilled() != shouldSpill) {
+                    Warn("Body of %zu bytes was%s spilled", size, (shouldSpill ? "n't" : ""));
+                    ok = false;
+                }
+            }
+        }
+        ok = pair.close() && ok;
+    }
+    return removeSpillDirectory(dir) && ok;
+}
+
+
+#ifndef _WIN32
+// Limits the size of the files the process can write, for as long as it exists.
+class FileSizeLimit {
+public:
+    explicit FileSizeLimit(rlim_t limit) {
+        getrlimit(RLIMIT_FSIZE, &_saved);
+        _savedHandler = signal(SIGXFSZ, SIG_IGN);   // So writes fail with EFBIG instead
+        rlimit lim = _saved;
+        lim.rlim_cur = limit;
+        setrlimit(RLIMIT_FSIZE, &lim);
+    }
+
+    ~FileSizeLimit() {
+        setrlimit(RLIMIT_FSIZE, &_saved);
+        signal(SIGXFSZ, _savedHandler);
+    }
+
+private:
+    rlimit _saved;
+    void (*_savedHandler)(int);
+};
+
+
+// A request whose body can't be written to the spill file gets an error response, and the
+// connection carries on.
+static bool testSpillFailure() {
+    string dir = makeSpillDirectory();
+    if (dir.empty()) {
+        Warn("Couldn't create a spill directory");
+        return false;
+    }
+    bool ok;
+    {
+        TestPair<BodyDelegate> pair(chrono::milliseconds(0), false, AllocedDict(),
+                                    Options().set(Connection::kSpillThresholdOption, 10000)
+                                             .set(Connection::kSpillDirectoryOption, dir)
+                                             .dict());
+        ok = pair.start();
+        ProgressRecorder progress;
+        {
+            FileSizeLimit limit(100000);
+            MessageBuilder msg({{"Profile"_sl, "spill"_sl}});
+            msg.onProgress = progress.callback();
+            msg << alloc_slice(string(1000000, 's'));
+            pair.conn1->sendRequest(msg);
+            if (!progress.waitFor(MessageProgress::kComplete)) {
+                Warn("No response to a request whose body couldn't be stored");
+                ok = false;
+            }
+        }
+        Retained<MessageIn> reply = progress.reply();
+        if (reply && (!reply->isError() || reply->getError().code != 500)) {
+            Warn("Request whose body couldn't be stored didn't get a 500 error");
+            ok = false;
+        }
+        if (!pair.receiver.profiles().empty()) {
+            Warn("Request whose body couldn't be stored went to the handler");
+            ok = false;
+        }
+        ok = pair.roundTrip("after"_sl) && ok;
+        ok = pair.close() && ok;
+    }
+    return removeSpillDirectory(dir) && ok;
+}
+#endif
+
+
+#pragma mark - BACKPRESSURE:
+
+
+// Filling the outbox past a high watermark makes it full; it becomes writable again, with
+// one call to onOutboxWritable, only once it's drained below the low watermarks.
+static bool testOutboxWatermarks() {
+    static constexpr size_t kMessageSize = 50000, kMessageCount = 10;
+    TestPair<> pair;
+    Connection::OutboxWatermarks watermarks;
+    watermarks.highBytes = 4 * kMessageSize;
+    watermarks.lowBytes = kMessageSize;
+    watermarks.highMessages = kMessageCount;
+    watermarks.lowMessages = 2;
+    pair.conn1->setOutboxWatermarks(watermarks);
+    bool ok = true;
+
+    // The outbox holds messages until the connection opens:
+    for (size_t i = 0; i < kMessageCount; ++i) {
+        MessageBuilder msg({{"Profile"_sl, "fill"_sl}});
+        msg.noreply = true;
+        msg << alloc_slice(string(kMessageSize, 'f'));
+        pair.conn1->sendRequest(msg);
+        bool shouldBeFull = (i + 1) * kMessageSize >= watermarks.highBytes;
+        if (pair.conn1->outboxFull() != shouldBeFull) {
+            Warn("Outbox is%s full after %zu messages", (shouldBeFull ? "n't" : ""), i + 1);
+            ok = false;
+        }
+    }
+    if (pair.conn1->queuedMessages() != kMessageCount
+            || pair.conn1->queuedBytes() < kMessageCount * kMessageSize) {
+        Warn("Outbox counts %zu messages, %zu bytes",
+             pair.conn1->queuedMessages(), pair.conn1->queuedBytes());
+        ok = false;
+    }
+
+    ok = pair.start() && ok;
+    if (!pair.sender.waitForWritable()) {
+        Warn("Outbox never became writable");
+        ok = false;
+    }
+    if (!pair.receiver.waitForRequests(kMessageCount)) {
+        Warn("Receiver got %zu requests", pair.receiver.profiles().size());
+        ok = false;
+    }
+    ok = pair.roundTrip("after"_sl) && ok;
+    if (pair.sender.writableCount() != 1 || pair.conn1->outboxFull()
+            || pair.conn1->queuedMessages() != 0 || pair.conn1->queuedBytes() != 0) {
+        Warn("After draining: %d writable notifications, outbox %s, %zu messages, %zu bytes",
+             pair.sender.writableCount(), (pair.conn1->outboxFull() ? "full" : "not full"),
+             pair.conn1->queuedMessages(), pair.conn1->queuedBytes());
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+#pragma mark - FRAME SIZES:
+
+
+// Sends a body big enough to give the frame sizer some measurements, then checks that the
+// sizes it chose are within the bounds set by the options.
+static bool checkFrameSizes(size_t minSize, size_t maxSize) {
+    TestPair<> pair(chrono::milliseconds(0), false,
+                    Options().set(Connection::kMinFrameSizeOption, int64_t(minSize))
+                             .set(Connection::kMaxFrameSizeOption, int64_t(maxSize)).dict());
+    bool ok = pair.start();
+    MessageBuilder msg({{"Profile"_sl, "big"_sl}});
+    msg << alloc_slice(string(4 * 1024 * 1024, 'b'));
+    ok = pair.roundTrip(msg) && ok;
+
+    size_t big = pair.conn1->bigFrameSize(), small = pair.conn1->smallFrameSize();
+    if (big < minSize || big > maxSize || small < minSize || small > big) {
+        Warn("With bounds %zu..%zu, frame sizes are %zu (small %zu)", minSize, maxSize,
+             big, small);
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+static bool testFrameSizeBounds() {
+    bool ok = checkFrameSizes(2048, 65536);         // The defaults
+    ok = checkFrameSizes(4096, 8192) && ok;
+    ok = checkFrameSizes(5000, 5000) && ok;         // Fixed, and not a multiple of 512
+    return ok;
+}
+
+
+#pragma mark - BATCHED WRITES:
+
+
+// A LoopbackWebSocket that counts the batches and frames it's asked to send.
+class CountingWebSocket : public LoopbackWebSocket {
+public:
+    CountingWebSocket(const alloc_slice &url, Role role)
+    :LoopbackWebSocket(url, role)
+    { }
+
+    virtual bool sendBatch(const vector<MessageSegment> &segments, bool binary) override {
+        ++batches;
+        for (auto &seg : segments)
+            if (seg.endOfMessage)
+                ++frames;
+        return LoopbackWebSocket::sendBatch(segments, binary);
+    }
+
+    atomic<size_t> batches {0}, frames {0};
+};
+
+
+// Many small messages waiting at once go to the WebSocket several frames per batch, and
+// arrive in order.
+static bool testBatchedWrites() {
+    static constexpr size_t kMessageCount = 500;
+    Retained<CountingWebSocket> ws1 = new CountingWebSocket(alloc_slice("ws://sender/"),
+                                                            Role::Client);
+    TestPair<> pair(ws1.get(), new LoopbackWebSocket(alloc_slice("ws://receiver/"), Role::Server));
+    vector<string> expected;
+    for (size_t i = 0; i < kMessageCount; ++i) {
+        expected.push_back(to_string(i));
+        MessageBuilder msg({{"Profile"_sl, slice(expected.back())}});
+        msg.noreply = true;
+        pair.conn1->sendRequest(msg);
+    }
+    bool ok = pair.start();
+
+    if (!pair.receiver.waitForRequests(kMessageCount) || pair.receiver.profiles() != expected) {
+        Warn("Receiver got %zu requests, or got them out of order",
+             pair.receiver.profiles().size());
+        ok = false;
+    }
+    size_t batches = ws1->batches, frames = ws1->frames;
+    if (frames < kMessageCount || batches * 4 > frames) {
+        Warn("Sent %zu frames in %zu batches", frames, batches);
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+#pragma mark - FLOW CONTROL:
+
+
+// Over a link with latency, a message bigger than the initial flow-control window makes the
+// window grow, but never past its bounds; and the message arrives intact.
+static bool testFlowWindow() {
+    static constexpr size_t kMinWindow = 128000, kMaxWindow = 1024 * 1024;
+    static constexpr size_t kBodySize = 8 * 1024 * 1024;
+    TestPair<BodyDelegate> pair(chrono::milliseconds(20), false,
+                                Options().set(Connection::kMinFlowWindowOption, kMinWindow)
+                                         .set(Connection::kMaxFlowWindowOption, kMaxWindow)
+                                         .dict());
+    bool ok = pair.start();
+    if (pair.conn1->flowWindow() != kMinWindow) {
+        Warn("Initial flow window is %zu", pair.conn1->flowWindow());
+        ok = false;
+    }
+
+    // Watch the window while the body is sent:
+    string body(kBodySize, 'w');
+    ProgressRecorder progress;
+    MessageBuilder msg({{"Profile"_sl, "window"_sl}});
+    msg << slice(body);
+    msg.onProgress = progress.callback();
+    pair.conn1->sendRequest(msg);
+    size_t minSeen = SIZE_MAX, maxSeen = 0;
+    auto giveUp = chrono::steady_clock::now() + kTimeout;
+    while (!progress.saw(MessageProgress::kComplete) && chrono::steady_clock::now() < giveUp) {
+        size_t window = pair.conn1->flowWindow();
+        minSeen = min(minSeen, window);
+        maxSeen = max(maxSeen, window);
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    if (!progress.saw(MessageProgress::kComplete) || pair.receiver.lastBody() != slice(body)) {
+        Warn("Body didn't arrive intact");
+        ok = false;
+    }
+    if (minSeen < kMinWindow || maxSeen > kMaxWindow || maxSeen <= kMinWindow) {
+        Warn("Flow window ranged from %zu to %zu", minSeen, maxSeen);
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+#pragma mark - SCHEDULING:
+
+
+// While two traffic classes both have messages waiting, the bytes they send are in proportion
+// to their weights.
+static bool testTrafficClassWeights() {
+    static constexpr unsigned kLight = 1, kHeavy = 2, kHeavyWeight = 4;
+    static constexpr size_t kMessageSize = 1024 * 1024, kMessagesPerClass = 4;
+    TestPair<> pair;
+    Connection::SchedulingPolicy policy;
+    policy.weights[kHeavy] = kHeavyWeight;
+    pair.conn1->setSchedulingPolicy(policy);
+
+    // Queue both classes before the connection opens, so both are backlogged from the start:
+    for (size_t i = 0; i < kMessagesPerClass; ++i) {
+        for (unsigned cls : {kLight, kHeavy}) {
+            MessageBuilder msg({{"Profile"_sl, "weighted"_sl}});
+            msg.noreply = true;
+            msg.trafficClass = int8_t(cls);
+            msg << alloc_slice(string(kMessageSize, 'w'));
+            pair.conn1->sendRequest(msg);
+        }
+    }
+    bool ok = pair.start();
+
+    // Sample the byte counts once the heavy class is a quarter done; by then the light class
+    // should have sent about a quarter as much, and is nowhere near finished:
+    auto giveUp = chrono::steady_clock::now() + kTimeout;
+    uint64_t light = 0, heavy = 0;
+    while (heavy < kMessagesPerClass * kMessageSize / 4 && chrono::steady_clock::now() < giveUp) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+        heavy = pair.conn1->bytesSent(kHeavy);
+        light = pair.conn1->bytesSent(kLight);
+    }
+    double ratio = light ? double(heavy) / double(light) : 0.0;
+    if (ratio < kHeavyWeight / 2.0 || ratio > kHeavyWeight * 2.0) {
+        Warn("Weights 1:%u sent %llu:%llu bytes", kHeavyWeight,
+             (unsigned long long)light, (unsigned long long)heavy);
+        ok = false;
+    }
+
+    if (!pair.receiver.waitForRequests(2 * kMessagesPerClass)) {
+        Warn("Receiver got %zu requests", pair.receiver.profiles().size());
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+#pragma mark - CANCELLATION:
+
+
+// A request canceled before it's begun to be sent never goes out at all.
+static bool testCancelQueuedRequest() {
+    TestPair<> pair;
+    ProgressRecorder progress;
+    MessageBuilder msg({{"Profile"_sl, "canceled"_sl}});
+    msg.noreply = true;
+    msg.onProgress = progress.callback();
+    RequestHandle handle = pair.conn1->sendRequest(msg);   // Held until the socket connects
+    handle.cancel();
+    bool ok = pair.start() && pair.roundTrip("after"_sl);
+
+    if (pair.receiver.profiles() != vector<string>{"after"}) {
+        Warn("Receiver got requests%s", join(pair.receiver.profiles()).c_str());
+        ok = false;
+    }
+    if (progress.count() > 0) {
+        Warn("Canceled request reported its progress");
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+// Starts sending a request whose body is far bigger than the initial flow window, so with
+// 50ms latency it can't finish before it's canceled.
+template <class PAIR>
+static void cancelPartlySentRequest(PAIR &pair, ProgressRecorder &progress) {
+    MessageBuilder msg({{"Profile"_sl, "canceled"_sl}});
+    msg.onProgress = progress.callback();
+    msg << alloc_slice(string(8 * 1024 * 1024, 'x'));
+    RequestHandle handle = pair.conn1->sendRequest(msg);
+    progress.waitFor(MessageProgress::kSending);
+    handle.cancel();
+    handle.cancel();        // Does nothing the second time
+}
+
+
+// Checks that a canceled request never got as far as reporting it had been sent.
+static bool checkNotFinished(ProgressRecorder &progress) {
+    if (progress.saw(MessageProgress::kAwaitingReply) || progress.saw(MessageProgress::kComplete)) {
+        Warn("Canceled request reported its progress after being canceled");
+        return false;
+    }
+    return true;
+}
+
+
+// A request canceled partway through is ended with a CANREQ, and the receiver discards it.
+static bool testCancelPartlySentRequest() {
+    TestPair<> pair(chrono::milliseconds(50));
+    bool ok = pair.start();
+    ProgressRecorder progress;
+    cancelPartlySentRequest(pair, progress);
+    ok = pair.roundTrip("after"_sl) && ok;
+
+    if (pair.receiver.profiles() != vector<string>{"after"}) {
+        Warn("Receiver got requests%s", join(pair.receiver.profiles()).c_str());
+        ok = false;
+    }
+    ok = checkNotFinished(progress) && ok;
+    return pair.close() && ok;
+}
+
+
+// A peer that only speaks BLIP_3 doesn't understand CANREQ, so a request canceled partway
+// through is sent in full, and its response ignored.
+static bool testCancelPartlySentRequestToLegacyPeer() {
+    TestPair<> pair(chrono::milliseconds(50), true);
+    bool ok = pair.start();
+    ProgressRecorder progress;
+    cancelPartlySentRequest(pair, progress);
+    ok = pair.roundTrip("after"_sl) && ok;
+
+    if (!pair.receiver.waitForRequests(2)) {
+        Warn("Receiver got requests%s", join(pair.receiver.profiles()).c_str());
+        ok = false;
+    }
+    ok = pair.roundTrip("after"_sl) && ok;      // (By now the response has arrived, too)
+    ok = checkNotFinished(progress) && ok;
+    return pair.close() && ok;
+}
+
+
+// Responds to "fail" requests with a body whose data source fails on its third call.
+class FailingDelegate : public TestDelegate {
+protected:
+    virtual void respondTo(MessageIn *request) override {
+        if (request->profile() != "fail"_sl)
+            return TestDelegate::respondTo(request);
+        MessageBuilder response(request);
+        auto calls = make_shared<int>(0);
+        response.dataSource = [calls](void *buf, size_t capacity) {
+            if (++*calls > 2)
+                return -1;
+            memset(buf, 'y', capacity);
+            return (int)capacity;
+        };
+        request->respond(response);
+    }
+};
+
+
+// Sends a "fail" request, whose progress goes to `progress`.
+template <class PAIR>
+static void sendFailingRequest(PAIR &pair, ProgressRecorder &progress) {
+    MessageBuilder msg({{"Profile"_sl, "fail"_sl}});
+    msg.onProgress = progress.callback();
+    pair.conn1->sendRequest(msg);
+}
+
+
+// A response whose data source fails partway is ended with a CANRES, and replaced by an
+// error response; the connection stays open.
+static bool testFailedResponse() {
+    TestPair<FailingDelegate> pair;
+    bool ok = pair.start();
+    ProgressRecorder progress;
+    sendFailingRequest(pair, progress);
+    if (!progress.waitFor(MessageProgress::kComplete)) {
+        Warn("No response to 'fail' request");
+        ok = false;
+    } else if (!progress.reply() || !progress.reply()->isError()) {
+        Warn("Response to 'fail' request isn't an error");
+        ok = false;
+    }
+    ok = pair.roundTrip("after"_sl) && ok;
+    return pair.close() && ok;
+}
+
+
+// A peer that only speaks BLIP_3 doesn't understand CANRES, so when a response's data source
+// fails partway, the connection is closed.
+static bool testFailedResponseToLegacyPeer() {
+    TestPair<FailingDelegate> pair(chrono::milliseconds(0), true);
+    bool ok = pair.start();
+    ProgressRecorder progress;
+    sendFailingRequest(pair, progress);
+    if (!pair.sender.waitForClose() || !pair.receiver.waitForClose()) {
+        Warn("Connection didn't close after a response failed");
+        ok = false;
+    }
+    if (progress.saw(MessageProgress::kComplete)) {
+        Warn("Failed response was delivered");
+        ok = false;
+    }
+    return ok;
+}
+
+
+#pragma mark - RESPONSE TIMEOUTS:
+
+
+// Doesn't respond to "ignore" requests, and begins responding to "stall" requests but doesn't
+// finish. Either can be finished later by calling finish().
+class SlowDelegate : public TestDelegate {
+public:
+    void finish() {
+        unique_lock<mutex> lock(_mutex);
+        for (auto &request : _ignored)
+            request->respond();
+        _ignored.clear();
+        for (auto &source : _stalled)
+            source->close();
+        _stalled.clear();
+    }
+
+protected:
+    virtual void respondTo(MessageIn *request) override {
+        slice profile = request->profile();
+        if (profile == "ignore"_sl) {
+            unique_lock<mutex> lock(_mutex);
+            _ignored.emplace_back(request);
+        } else if (profile == "stall"_sl) {
+            MessageBuilder response(request);
+            response.asyncDataSource = new AsyncDataSource;
+            response.asyncDataSource->write(alloc_slice(string(1000, 'x')));
+            {
+                unique_lock<mutex> lock(_mutex);
+                _stalled.push_back(response.asyncDataSource);
+            }
+            request->respond(response);
+        } else {
+            TestDelegate::respondTo(request);
+        }
+    }
+
+private:
+    vector<Retained<MessageIn>> _ignored;
+    vector<Retained<AsyncDataSource>> _stalled;
+};
+
+
+// Sends a request with a short timeout, and checks that it times out. The response is then
+// sent, to check that it's ignored and the connection still works.
+static bool timeOut(TestPair<SlowDelegate> &pair, slice profile) {
+    ProgressRecorder progress;
+    MessageBuilder msg({{"Profile"_sl, profile}});
+    msg.responseTimeout = chrono::milliseconds(100);
+    msg.onProgress = progress.callback();
+    pair.conn1->sendRequest(msg);
+    bool ok = true;
+    if (!progress.waitFor(MessageProgress::kTimedOut)) {
+        Warn("'%.*s' request didn't time out", SPLAT(profile));
+        ok = false;
+    }
+    size_t notifications = progress.count();
+
+    pair.receiver.finish();
+    ok = pair.roundTrip("after"_sl) && ok;
+    if (progress.count() != notifications) {
+        Warn("'%.*s' request reported progress after timing out", SPLAT(profile));
+        ok = false;
+    }
+    return ok;
+}
+
+
+static bool testResponseTimeout() {
+    TestPair<SlowDelegate> pair;
+    bool ok = pair.start();
+
+    // A response that never begins to arrive, or that stalls partway, times out:
+    ok = timeOut(pair, "ignore"_sl) && ok;
+    ok = timeOut(pair, "stall"_sl) && ok;
+
+    // A request that's responded to in time doesn't time out:
+    ProgressRecorder progress;
+    MessageBuilder msg({{"Profile"_sl, "prompt"_sl}});
+    msg.responseTimeout = chrono::milliseconds(5000);
+    msg.onProgress = progress.callback();
+    pair.conn1->sendRequest(msg);
+    if (!progress.waitFor(MessageProgress::kComplete) || progress.saw(MessageProgress::kTimedOut)) {
+        Warn("Request answered in time didn't complete normally");
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+#pragma mark - DEADLINES:
+
+
+// Records the deadline of the last request it received.
+class DeadlineDelegate : public TestDelegate {
+public:
+    Deadline lastDeadline() {
+        unique_lock<mutex> lock(_mutex);
+        return _lastDeadline;
+    }
+
+protected:
+    virtual void respondTo(MessageIn *request) override {
+        {
+            unique_lock<mutex> lock(_mutex);
+            _lastDeadline = request->deadline();
+        }
+        TestDelegate::respondTo(request);
+    }
+
+private:
+    Deadline _lastDeadline;
+};
+
+
+// A message whose deadline passes while it's waiting in the outbox is dropped, and reported
+// as expired.
+static bool testExpiredOutgoingMessage() {
+    TestPair<DeadlineDelegate> pair;
+    ProgressRecorder progress;
+    MessageBuilder msg({{"Profile"_sl, "expired"_sl}});
+    msg.setDeadline(chrono::system_clock::now() - chrono::seconds(1));
+    msg.onProgress = progress.callback();
+    pair.conn1->sendRequest(msg);       // Held until the socket connects, by which time it's late
+    bool ok = pair.start();
+
+    if (!progress.waitFor(MessageProgress::kExpired)) {
+        Warn("Expired request wasn't reported as expired");
+        ok = false;
+    }
+    ok = pair.roundTrip("after"_sl) && ok;
+    if (pair.receiver.profiles() != vector<string>{"after"}) {
+        Warn("Receiver got requests%s", join(pair.receiver.profiles()).c_str());
+        ok = false;
+    }
+    if (progress.saw(MessageProgress::kSending) || progress.saw(MessageProgress::kComplete)) {
+        Warn("Expired request reported being sent");
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+// A request whose "Deadline" property has passed by the time it arrives isn't handled; the
+// receiver responds with a 408 error instead.
+static bool testExpiredIncomingRequest() {
+    TestPair<DeadlineDelegate> pair(chrono::milliseconds(200));
+    bool ok = pair.start();
+    ProgressRecorder progress;
+    MessageBuilder msg({{"Profile"_sl, "late"_sl}});
+    msg.setTimeToLive(chrono::milliseconds(50), true);    // Sent at once; arrives 200ms later
+    msg.onProgress = progress.callback();
+    pair.conn1->sendRequest(msg);
+
+    Retained<MessageIn> reply;
+    if (progress.waitFor(MessageProgress::kComplete))
+        reply = progress.reply();
+    if (!reply || !reply->isError() || reply->getError().domain != "BLIP"_sl
+               || reply->getError().code != 408) {
+        Warn("Expired request didn't get a 408 error response");
+        ok = false;
+    }
+    ok = pair.roundTrip("after"_sl) && ok;
+    if (pair.receiver.profiles() != vector<string>{"after"}) {
+        Warn("Receiver handled requests%s", join(pair.receiver.profiles()).c_str());
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+// A deadline sent as a property arrives intact, to the millisecond; one that isn't sent
+// arrives as no deadline.
+static bool testDeadlineProperty() {
+    TestPair<DeadlineDelegate> pair;
+    bool ok = pair.start();
+    Deadline deadline = chrono::system_clock::now() + chrono::hours(1);
+    MessageBuilder msg({{"Profile"_sl, "deadline"_sl}});
+    msg.setDeadline(deadline, true);
+    ok = pair.roundTrip(msg) && ok;
+    auto sentMs = chrono::duration_cast<chrono::milliseconds>(deadline.time_since_epoch());
+    Deadline got = pair.receiver.lastDeadline();
+    auto gotMs = chrono::duration_cast<chrono::milliseconds>(got.time_since_epoch());
+    if (gotMs != sentMs) {
+        Warn("Deadline %lld ms arrived as %lld ms",
+             (long long)sentMs.count(), (long long)gotMs.count());
+        ok = false;
+    }
+
+    MessageBuilder local({{"Profile"_sl, "deadline"_sl}});
+    local.setDeadline(deadline);                            // Not sent as a property
+    ok = pair.roundTrip(local) && ok;
+    if (pair.receiver.lastDeadline() != Deadline()) {
+        Warn("A deadline that wasn't sent arrived anyway");
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+#pragma mark - PROFILE ROUTER:
+
+
+// Checks which value each profile is routed to (0 meaning none.)
+static bool checkRoutes(ProfileRouter<int> &router,
+                        initializer_list<pair<const char*, int>> expected)
+{
+    bool ok = true;
+    for (auto &route : expected) {
+        slice profile = route.first ? slice(route.first) : nullslice;
+        const int *value = router.find(profile);
+        int found = value ? *value : 0;
+        if (found != route.second) {
+            Warn("Profile '%.*s' routed to %d; expected %d",
+                 SPLAT(profile), found, route.second);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+
+static bool testProfileRouter() {
+    ProfileRouter<int> router;
+    bool ok = router.empty() && checkRoutes(router, {{"getCheckpoint", 0}});
+
+    // An exact route wins over a prefix, and a longer prefix over a shorter one:
+    router.set("getCheckpoint"_sl, 1);
+    router.set("get*"_sl, 2);
+    router.set("getAtt*"_sl, 3);
+    ok = !router.empty() && ok;
+    ok = checkRoutes(router, {{"getCheckpoint", 1}, {"getAttachment", 3}, {"getRev", 2},
+                              {"get", 2}, {"setCheckpoint", 0}, {nullptr, 0}}) && ok;
+
+    // "*" matches everything else, even a message without a profile:
+    router.set("*"_sl, 4);
+    ok = checkRoutes(router, {{"setCheckpoint", 4}, {nullptr, 4}, {"getCheckpoint", 1}}) && ok;
+
+    // Setting an existing route replaces its value:
+    router.set("getCheckpoint"_sl, 5);
+    router.set("get*"_sl, 6);
+    ok = checkRoutes(router, {{"getCheckpoint", 5}, {"getRev", 6}}) && ok;
+
+    // Removing a route exposes the next best one:
+    if (!router.remove("getCheckpoint"_sl) || router.remove("getCheckpoint"_sl)) {
+        Warn("ProfileRouter didn't remove a route exactly once");
+        ok = false;
+    }
+    ok = checkRoutes(router, {{"getCheckpoint", 6}}) && ok;
+    router.remove("get*"_sl);
+    ok = checkRoutes(router, {{"getCheckpoint", 4}, {"getAttachment", 3}}) && ok;
+    router.remove("*"_sl);
+    ok = checkRoutes(router, {{"getCheckpoint", 0}}) && ok;
+
+    router.clear();
+    return router.empty() && checkRoutes(router, {{"getAttachment", 0}}) && ok;
+}
+
+
+#pragma mark - REQUEST DISPATCH:
+
+
+// Counts how many calls of a slow handler are running at once.
+class ConcurrencyCounter {
+public:
+    void handle(MessageIn *request) {
+        {
+            unique_lock<mutex> lock(_mutex);
+            _maxRunning = max(_maxRunning, ++_running);
+        }
+        this_thread::sleep_for(chrono::milliseconds(50));
+        {
+            unique_lock<mutex> lock(_mutex);
+            --_running;
+        }
+        request->respond();
+    }
+
+    int maxRunning() {
+        unique_lock<mutex> lock(_mutex);
+        return _maxRunning;
+    }
+
+private:
+    mutex _mutex;
+    int _running {0}, _maxRunning {0};
+};
+
+
+// With a worker pool, a profile's requests are handled concurrently, but never more of them
+// at once than its limit.
+static bool testProfileConcurrencyLimit() {
+    static constexpr int kLimit = 2, kRequests = 8;
+    TestPair<> pair;
+    Connection::DispatchPolicy policy;
+    policy.workers = 4;
+    policy.profileLimits["slow"] = kLimit;
+    pair.conn2->setDispatchPolicy(policy);
+    ConcurrencyCounter counter;
+    pair.conn2->setRequestHandler("slow", false, [&](MessageIn *request) {
+        counter.handle(request);
+    });
+    bool ok = pair.start();
+
+    vector<unique_ptr<ProgressRecorder>> progress;
+    for (int i = 0; i < kRequests; ++i) {
+        progress.emplace_back(new ProgressRecorder);
+        MessageBuilder msg({{"Profile"_sl, "slow"_sl}});
+        msg.onProgress = progress.back()->callback();
+        pair.conn1->sendRequest(msg);
+    }
+    for (auto &p : progress) {
+        if (!p->waitFor(MessageProgress::kComplete)) {
+            Warn("No response to a 'slow' request");
+            ok = false;
+            break;
+        }
+    }
+    if (counter.maxRunning() != kLimit) {
+        Warn("%d 'slow' requests ran at once; the limit is %d", counter.maxRunning(), kLimit);
+        ok = false;
+    }
+    return pair.close() && ok;
+}
+
+
+// Holds on to the requests an async handler is given, and finishes them when asked.
+class AsyncHandlerState {
+public:
+    actor::Async<bool> handle(MessageIn *request) {
+        auto provider = actor::Async<bool>::provider();
+        unique_lock<mutex> lock(_mutex);
+        _pending.emplace_back(request, provider);
+        _cond.notify_all();
+        return provider;
+    }
+
+    bool waitForRequest() {
+        return waitUntil(_mutex, _cond, [&]{return !_pending.empty();});
+    }
+
+    // Responds to the pending requests (if `handled`), then makes their results ready.
+    void finish(bool handled) {
+        unique_lock<mutex> lock(_mutex);
+        for (auto &pending : _pending) {
+            if (handled)
+                pending.first->respond();
+            pending.second->setResult(handled);
+        }
+        _pending.clear();
+    }
+
+private:
+    mutex _mutex;
+    condition_variable _cond;
+    vector<pair<Retained<MessageIn>,Retained<actor::AsyncProvider<bool>>>> _pending;
+};
+
+
+// An async handler's request is answered when the handler responds, after it's returned; one
+// whose result is false gets a "no handler" error instead.
+static bool testAsyncRequestHandler() {
+    TestPair<> pair;
+    AsyncHandlerState state;
+    pair.conn2->setAsyncRequestHandler("async", [&](MessageIn *request) {
+        return state.handle(request);
+    });
+    bool ok = pair.start();
+
+    for (bool handled : {true, false}) {
+        ProgressRecorder progress;
+        MessageBuilder msg({{"Profile"_sl, "async"_sl}});
+        msg.onProgress = progress.callback();
+        pair.conn1->sendRequest(msg);
+        if (!state.waitForRequest()) {
+            Warn("Async handler wasn't called");
+            pair.close();
+            return false;
+        }
+        this_thread::sleep_for(chrono::milliseconds(50));
+        if (progress.saw(MessageProgress::kComplete)) {
+            Warn("Request completed before its async handler finished");
+            ok = false;
+        }
+        state.finish(handled);
+        Retained<MessageIn> reply;
+        if (progress.waitFor(MessageProgress::kComplete))
+            reply = progress.reply();
+        if (!reply || reply->isError() == handled
+                   || (!handled && reply->getError().code != 404)) {
+            Warn("Wrong response to a request whose async handler returned %s",
+                 (handled ? "true" : "false"));
+            ok = false;
+        }
+    }
+    return pair.close() && ok;
+}
+
+
+#pragma mark - BODY STREAMING:
+
+
+// Streams the bodies of requests to a sink that checks them. The sink pauses ACKs from inside
+// its callback the first time it's called, and resumes them from another thread a little
+// later, as a consumer that's fallen behind would.
+class StreamingDelegate : public TestDelegate {
+public:
+    virtual void onRequestBeginning(MessageIn *request) override {
+        Retained<MessageIn> req = request;
+        request->setBodySink([this, req](slice chunk, bool complete) {
+            unique_lock<mutex> lock(_mutex);
+            for (size_t i = 0; i < chunk.size; ++i) {
+                if (chunk[i] != uint8_t(_bodySize + i)) {
+                    Warn("Streamed body has %02x at offset %zu", chunk[i], size_t(_bodySize + i));
+                    _bodyOK = false;
+                    break;
+                }
+            }
+            _bodySize += chunk.size;
+            _complete = complete;
+            if (!_paused) {
+                _paused = true;
+                req->pauseAcks();
+                _resumer = thread([req] {
+                    this_thread::sleep_for(chrono::milliseconds(200));
+                    req->resumeAcks();
+                });
+            }
+            _cond.notify_all();
+        });
+    }
+
+    bool waitForBody(size_t size) {
+        bool ok = waitUntil(_mutex, _cond, [&]{return _complete;});
+        if (_resumer.joinable())
+            _resumer.join();
+        if (!ok || !_bodyOK || _bodySize != size) {
+            Warn("Streamed %zu of %zu bytes", _bodySize, size);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    size_t _bodySize {0};
+    bool _bodyOK {true}, _complete {false}, _paused {false};
+    thread _resumer;
+};
+
+
+static bool testBodySink() {
+    TestPair<StreamingDelegate> pair;
+    bool ok = pair.start();
+
+    // The body is several times the initial flow window, so the sender has to stop while the
+    // sink has ACKs paused, and continue once they're resumed:
+    const size_t kBodySize = 1024 * 1024;
+    string body(kBodySize, 0);
+    for (size_t i = 0; i < kBodySize; ++i)
+        body[i] = char(i);
+    MessageBuilder msg({{"Profile"_sl, "stream"_sl}});
+    msg << slice(body);
+    pair.conn1->sendRequest(msg);
+    ok = pair.receiver.waitForBody(kBodySize) && ok;
+    ok = pair.roundTrip("after"_sl) && ok;
+    return pair.close() && ok;
+}
+
+
+#pragma mark - ENCODED MESSAGES:
+
+
+// Sends an encoded message, and waits for its response.
+template <class PAIR>
+static bool sendEncoded(PAIR &pair, EncodedMessage *encoded) {
+    ProgressRecorder progress;
+    pair.conn1->sendRequest(encoded, progress.callback());
+    if (progress.waitFor(MessageProgress::kComplete) && progress.reply()
+            && !progress.reply()->isError())
+        return true;
+    Warn("No response to an encoded message");
+    return false;
+}
+
+
+// An EncodedMessage can be sent many times, by several Connections, to tokenized and legacy
+// peers alike; each send reports its own progress, and the builder can be reused.
+static bool testEncodedMessage() {
+    TestPair<BodyDelegate> pair1, pair2(chrono::milliseconds(0), true);
+    bool ok = pair1.start() && pair2.start();
+
+    MessageBuilder builder({{"Profile"_sl, "encoded"_sl}});
+    builder.addProperty("Count"_sl, int64_t(3));
+    string expected = string(5000, 'e') + string(20000, 'n');
+    builder << slice(expected).upTo(5000);
+    builder.attachBody(alloc_slice(string(20000, 'n')));
+    Retained<EncodedMessage> encoded = new EncodedMessage(builder);
+    builder.reset();
+
+    for (int i = 0; i < 3; ++i)
+        ok = sendEncoded(pair1, encoded) && ok;
+    ok = sendEncoded(pair2, encoded) && ok;
+    for (auto body : {pair1.receiver.lastBody(), pair2.receiver.lastBody()}) {
+        if (body != slice(expected)) {
+            Warn("Encoded message's body arrived as %zu bytes", body.size);
+            ok = false;
+        }
+    }
+    if (pair1.receiver.profiles() != vector<string>(3, "encoded")
+            || pair2.receiver.profiles() != vector<string>{"encoded"}) {
+        Warn("Receivers got requests%s and%s", join(pair1.receiver.profiles()).c_str(),
+             join(pair2.receiver.profiles()).c_str());
+        ok = false;
+    }
+
+    // The builder, now reset, makes an unrelated message:
+    builder.addProperty("Profile"_sl, "reused"_sl);
+    builder << "second"_sl;
+    ok = checkBodyArrives(pair1, builder, "second", "Reused builder") && ok;
+
+    ok = pair1.close() && ok;
+    return pair2.close() && ok;
+}
+
+
+#pragma mark - BROADCAST:
+
+
+// Records a Broadcast's completion callback.
+class BroadcastRecorder {
+public:
+    Broadcast::CompletionCallback callback() {
+        return [this](size_t delivered, size_t failed) {
+            unique_lock<mutex> lock(_mutex);
+            ++_calls;
+            _delivered = delivered;
+            _failed = failed;
+            _cond.notify_all();
+        };
+    }
+
+    // Waits for the callback, and checks it was called once, with the expected counts.
+    bool check(size_t delivered, size_t failed, const char *what) {
+        bool called = waitUntil(_mutex, _cond, [&]{return _calls > 0;});
+        unique_lock<mutex> lock(_mutex);
+        if (!called || _calls != 1 || _delivered != delivered || _failed != failed) {
+            Warn("%s: completion called %d times, with %zu delivered and %zu failed",
+                 what, _calls, _delivered, _failed);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    mutex _mutex;
+    condition_variable _cond;
+    int _calls {0};
+    size_t _delivered {0}, _failed {0};
+};
+
+
+static Retained<EncodedMessage> encodeRequest(slice profile) {
+    MessageBuilder msg({{"Profile"_sl, profile}});
+    msg << "broadcast body"_sl;
+    return new EncodedMessage(msg);
+}
+
+
+// A broadcast to no Connections completes at once.
+static bool testBroadcastToNobody() {
+    BroadcastRecorder recorder;
+    auto broadcast = Broadcast::send({}, encodeRequest("nobody"_sl), recorder.callback());
+    bool ok = recorder.check(0, 0, "Empty broadcast");
+    if (broadcast->count() != 0 || !broadcast->done()) {
+        Warn("Empty broadcast isn't done");
+        ok = false;
+    }
+    return ok;
+}
+
+
+// A broadcast is delivered to every open Connection; a copy sent to a closed one fails.
+static bool testBroadcastWithDisconnect() {
+    TestPair<> open1, open2, closed;
+    bool ok = open1.start() && open2.start() && closed.start() && closed.close();
+
+    BroadcastRecorder recorder;
+    auto broadcast = Broadcast::send({open1.conn1, open2.conn1, closed.conn1},
+                                     encodeRequest("broadcast"_sl), recorder.callback());
+    ok = recorder.check(2, 1, "Broadcast with a closed connection") && ok;
+    if (!broadcast->done() || broadcast->delivered() != 2 || broadcast->failed() != 1) {
+        Warn("Broadcast counts %zu delivered and %zu failed",
+             broadcast->delivered(), broadcast->failed());
+        ok = false;
+    }
+    for (auto pair : {&open1, &open2}) {
+        if (pair->receiver.profiles() != vector<string>{"broadcast"}) {
+            Warn("Receiver got requests%s", join(pair->receiver.profiles()).c_str());
+            ok = false;
+        }
+    }
+    ok = open1.close() && ok;
+    return open2.close() && ok;
+}
+
+
+// Canceling a broadcast fails every copy that hasn't been replied to yet.
+static bool testCancelBroadcast() {
+    TestPair<SlowDelegate> pair1, pair2;
+    bool ok = pair1.start() && pair2.start();
+
+    BroadcastRecorder recorder;
+    auto broadcast = Broadcast::send({pair1.conn1, pair2.conn1},
+                                     encodeRequest("ignore"_sl), recorder.callback());
+    if (!pair1.receiver.waitForRequests(1) || !pair2.receiver.waitForRequests(1)) {
+        Warn("Broadcast didn't arrive");
+        ok = false;
+    }
+    broadcast->cancel();
+    ok = recorder.check(0, 2, "Canceled broadcast") && ok;
+
+    // The replies that come after the cancel are ignored:
+    pair1.receiver.finish();
+    pair2.receiver.finish();
+    ok = pair1.roundTrip("after"_sl) && pair2.roundTrip("after"_sl) && ok;
+    ok = recorder.check(0, 2, "Canceled broadcast, after replies") && ok;
+    ok = pair1.close() && ok;
+    return pair2.close() && ok;
+}
+
+
+#pragma mark - MAIN:
+
+
+int main(int argc, const char *argv[]) {
+    struct {const char *name; bool (*fn)();} tests[] = {
+        {"MessageQueue",            testMessageQueue},
+        {"MessageIndex",            testMessageIndex},
+        {"TypedValues",             testTypedValues},
+        {"PropertyTokens",          testPropertyTokens},
+        {"PlainProperties",         testPlainProperties},
+        {"PropertyIndex",           testPropertyIndex},
+        {"MessageBuilder",          testMessageBuilder},
+        {"MessageInProperties",     testMessageInProperties},
+        {"AttachBody",              testAttachBody},
+        {"ZeroCopyBoundaries",      testZeroCopyBoundaries},
+        {"FileBody",                testFileBody},
+        {"SpillToDisk",             testSpillToDisk},
+#ifndef _WIN32
+        {"SpillFailure",            testSpillFailure},
+#endif
+        {"OutboxWatermarks",        testOutboxWatermarks},
+        {"FrameSizeBounds",         testFrameSizeBounds},
+        {"BatchedWrites",           testBatchedWrites},
+        {"FlowWindow",              testFlowWindow},
+        {"TrafficClassWeights",     testTrafficClassWeights},
+        {"CancelQueuedRequest",     testCancelQueuedRequest},
+        {"CancelPartlySentRequest", testCancelPartlySentRequest},
+        {"CancelToLegacyPeer",      testCancelPartlySentRequestToLegacyPeer},
+        {"FailedResponse",          testFailedResponse},
+        {"FailedResponseToLegacy",  testFailedResponseToLegacyPeer},
+        {"ResponseTimeout",         testResponseTimeout},
+        {"ExpiredOutgoingMessage",  testExpiredOutgoingMessage},
+        {"ExpiredIncomingRequest",  testExpiredIncomingRequest},
+        {"DeadlineProperty",        testDeadlineProperty},
+        {"ProfileRouter",           testProfileRouter},
+        {"ProfileConcurrencyLimit", testProfileConcurrencyLimit},
+        {"AsyncRequestHandler",     testAsyncRequestHandler},
+        {"BodySink",                testBodySink},
+        {"EncodedMessage",          testEncodedMessage},
+        {"BroadcastToNobody",       testBroadcastToNobody},
+        {"BroadcastWithDisconnect", testBroadcastWithDisconnect},
+        {"CancelBroadcast",         testCancelBroadcast},
+    };
+    int failures = 0;
+    for (auto &test : tests) {
+        Log("** Testing %s...", test.name);
+        bool ok = test.fn();
+        Log("** %s %s", test.name, (ok ? "OK" : "FAILED"));
+        if (!ok)
+            ++failures;
+    }
+    if (failures > 0)
+        Warn("** %d test(s) failed", failures);
+    else
+        Log("******** DONE ********");
+    return failures > 0;
+}